@@ -0,0 +1,153 @@
+/* arena.c - bump allocator for short-lived data */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/***************
+ * LOCAL TYPES *
+ ***************/
+
+/* arena_align • union of the types whose alignment must be honoured */
+union arena_align {
+	void *	ptr;
+	size_t	size;
+	long	l;
+	double	d; };
+
+#define ARENA_ALIGN (sizeof (union arena_align))
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+
+/* struct arena_chunk • header of a chunk, directly followed by its data */
+struct arena_chunk {
+	struct arena_chunk *	next;
+	size_t			size;	/* usable bytes after the header */
+	size_t			used; };	/* bytes already given away */
+
+#define CHUNK_HEADER ARENA_ROUND(sizeof (struct arena_chunk))
+
+
+
+/***************************
+ * STATIC HELPER FUNCTIONS *
+ ***************************/
+
+/* chunk_data • returns the first usable byte of a chunk */
+static char *
+chunk_data(struct arena_chunk *chunk) {
+	return (char *)chunk + CHUNK_HEADER; }
+
+
+/* chunk_new • allocates a chunk of at least the given usable size */
+static struct arena_chunk *
+chunk_new(size_t size) {
+	struct arena_chunk *ret = malloc(CHUNK_HEADER + size);
+	if (!ret) return 0;
+	ret->next = 0;
+	ret->size = size;
+	ret->used = 0;
+	return ret; }
+
+
+
+/*******************
+ * ARENA FUNCTIONS *
+ *******************/
+
+/* arena_alloc • returns uninitialized memory valid until the next reset */
+void *
+arena_alloc(struct arena *arena, size_t size) {
+	struct arena_chunk *chunk, *neo;
+	size_t need = ARENA_ROUND(size ? size : 1);
+	void *ret;
+
+	/* looking for room in the current chunk or the reusable ones */
+	chunk = arena->cur;
+	while (chunk && chunk->size - chunk->used < need) {
+		if (!chunk->next) break;
+		chunk = chunk->next;
+		chunk->used = 0; }
+
+	/* appending a new chunk when nothing fits */
+	if (!chunk || chunk->size - chunk->used < need) {
+		neo = chunk_new(need > arena->unit ? need : arena->unit);
+		if (!neo) return 0;
+		if (chunk) chunk->next = neo;
+		else arena->head = neo;
+		chunk = neo; }
+
+	arena->cur = chunk;
+	ret = chunk_data(chunk) + chunk->used;
+	chunk->used += need;
+	return ret; }
+
+
+/* arena_bufdup • read-only buffer holding a copy of the data in the arena */
+struct buf *
+arena_bufdup(struct arena *arena, const void *data, size_t size) {
+	struct buf *ret = arena_alloc(arena, sizeof (struct buf) + size);
+	if (!ret) return 0;
+	ret->data = (char *)(ret + 1);
+	ret->size = ret->asize = size;
+	ret->unit = 0;
+	ret->ref = 1;
+	ret->growth = 0;
+	ret->growth_cap = 0;
+	if (size) memcpy(ret->data, data, size);
+	return ret; }
+
+
+/* arena_free • gives back to the system all the memory of the arena */
+void
+arena_free(struct arena *arena) {
+	struct arena_chunk *chunk, *next;
+	if (!arena) return;
+	for (chunk = arena->head; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk); }
+	arena->head = arena->cur = 0; }
+
+
+/* arena_init • initialization of an empty arena */
+void
+arena_init(struct arena *arena, size_t unit) {
+	arena->head = arena->cur = 0;
+	arena->unit = unit; }
+
+
+/* arena_reset • invalidates all allocations, keeping chunks for reuse */
+void
+arena_reset(struct arena *arena) {
+	arena->cur = arena->head;
+	if (arena->head) arena->head->used = 0; }
+
+
+/* arena_size • bytes held by the chunks of the arena */
+size_t
+arena_size(struct arena *arena) {
+	struct arena_chunk *chunk;
+	size_t ret = 0;
+	for (chunk = arena->head; chunk; chunk = chunk->next)
+		ret += CHUNK_HEADER + chunk->size;
+	return ret; }
+
+/* vim: set filetype=c: */
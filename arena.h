@@ -0,0 +1,75 @@
+/* arena.h - bump allocator for short-lived data */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LITHIUM_ARENA_H
+#define LITHIUM_ARENA_H
+
+#include "buffer.h"
+
+#include <stddef.h>
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct arena_chunk • one block of memory owned by an arena */
+struct arena_chunk;
+
+
+/* struct arena • bump allocator, every allocation is freed at once */
+struct arena {
+	struct arena_chunk *	head;	/* first allocated chunk */
+	struct arena_chunk *	cur;	/* chunk currently being filled */
+	size_t			unit; };	/* minimal size of a chunk */
+
+
+
+/*******************
+ * ARENA FUNCTIONS *
+ *******************/
+
+/* arena_alloc • returns uninitialized memory valid until the next reset */
+void *
+arena_alloc(struct arena *, size_t);
+
+/* arena_bufdup • read-only buffer holding a copy of the data in the arena */
+/*	the result has a zero unit, so bufrelease() leaves it alone */
+struct buf *
+arena_bufdup(struct arena *, const void *data, size_t size);
+
+/* arena_free • gives back to the system all the memory of the arena */
+void
+arena_free(struct arena *);
+
+/* arena_init • initialization of an empty arena */
+void
+arena_init(struct arena *, size_t unit);
+
+/* arena_reset • invalidates all allocations, keeping chunks for reuse */
+void
+arena_reset(struct arena *);
+
+/* arena_size • bytes held by the chunks of the arena */
+size_t
+arena_size(struct arena *);
+
+
+#endif /* ndef LITHIUM_ARENA_H */
+
+/* vim: set filetype=c: */
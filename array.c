@@ -20,6 +20,8 @@
 
 #include <string.h>
 
+#define ARRAY_UNIT 16	/* smallest growth of arr_push */
+
 
 /***************************
  * STATIC HELPER FUNCTIONS *
@@ -120,6 +122,16 @@ arr_newitem(struct array *arr) {
 	return arr->size - 1; }
 
 
+/* arr_push • appends an element, growing the array geometrically */
+void *
+arr_push(struct array *arr) {
+	if (arr->size >= arr->asize
+	&& !arr_realloc(arr, arr->asize * 2 + ARRAY_UNIT))
+		return 0;
+	arr->size += 1;
+	return arr_item(arr, arr->size - 1); }
+
+
 /* arr_remove • removes the n-th elements of the array */
 void
 arr_remove(struct array *arr, int idx) {
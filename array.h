@@ -78,6 +78,11 @@ arr_item(struct array *, int);
 int
 arr_newitem(struct array *);
 
+/* arr_push • appends an element, growing the array geometrically */
+/*	returns a pointer to the new element, or NULL on failure */
+void *
+arr_push(struct array *);
+
 /* arr_remove • removes the n-th elements of the array */
 void
 arr_remove(struct array *, int);
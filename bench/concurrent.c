@@ -0,0 +1,266 @@
+/* concurrent.c - stress of renders running on several threads at once */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A set of small documents is generated from a fixed seed and rendered once
+ * on the main thread with every bundled renderer. Worker threads then render
+ * all of them again and again, first with markdown() and then with tables
+ * shared from mkd_compile(), every output being compared with the one of
+ * the main thread. The exit status is non-zero when any output differs.
+ */
+
+#include "markdown.h"
+#include "renderers.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DOC_NB 64	/* number of generated documents */
+#define DOC_SIZE 2000	/* default size of each of them */
+#define THREADS 8	/* default number of worker threads */
+#define ROUNDS 100	/* default renders of the whole set per thread */
+#define SEED 12345	/* seed of the corpus generator */
+#define RNDR_NB (sizeof renderers / sizeof *renderers)
+
+
+/* renderers • bundled renderers under test */
+static const struct mkd_renderer *const renderers[] = {
+	&mkd_html, &mkd_xhtml, &discount_html, &discount_xhtml,
+	&nat_html, &nat_xhtml };
+
+
+/* corpus • input and expected outputs, read-only in the workers */
+struct corpus {
+	struct buf *		in[DOC_NB];
+	struct buf *		out[RNDR_NB][DOC_NB];
+	struct mkd_compiled *	rules[RNDR_NB];
+	size_t			bytes; };	/* of all the inputs */
+
+
+/* worker • state of a worker thread */
+struct worker {
+	const struct corpus *	corpus;
+	int			compiled;	/* using markdown_compiled */
+	int			rounds;
+	unsigned long		mismatches;
+	pthread_t		tid; };
+
+
+
+/*********************
+ * CORPUS GENERATION *
+ *********************/
+
+static uint32_t seed = SEED;
+
+/* rnd • returns a pseudo-random number below n */
+static unsigned
+rnd(unsigned n) {
+	seed = seed * 1103515245u + 12345u;
+	return (seed >> 8) % n; }
+
+
+/* put_words • appends n words of prose, with occasional spans */
+static void
+put_words(struct buf *ib, int n) {
+	static const char *words[] = { "lorem", "ipsum", "dolor", "sit",
+	    "amet", "consectetur", "adipiscing", "elit", "sed", "do",
+	    "eiusmod", "tempor", "incididunt", "ut", "labore", "et" };
+	const char *w;
+	int i;
+	for (i = 0; i < n; i += 1) {
+		if (i) bufputc(ib, ' ');
+		w = words[rnd(16)];
+		switch (rnd(30)) {
+		    case 0: bufprintf(ib, "*%s*", w); break;
+		    case 1: bufprintf(ib, "__%s__", w); break;
+		    case 2: bufprintf(ib, "`%s()`", w); break;
+		    case 3: bufprintf(ib, "[%s](http://example.com/%s)", w, w);
+			break;
+		    case 4: bufprintf(ib, "[%s][r%u]", w, rnd(4)); break;
+		    case 5: bufprintf(ib, "%s &amp; <%s>", w, w); break;
+		    default: bufputs(ib, w); break; } } }
+
+
+/* gen_document • mix of the blocks found in short user content */
+static void
+gen_document(struct buf *ib, size_t size) {
+	unsigned i, n;
+	while (ib->size < size) {
+		switch (rnd(6)) {
+		    case 0:
+			bufputs(ib, rnd(2) ? "## " : "Title\n---\n");
+			put_words(ib, 1 + rnd(5));
+			break;
+		    case 1:
+			for (i = 0, n = 2 + rnd(4); i < n; i += 1) {
+				bufputs(ib, rnd(3) ? "- " : "1. ");
+				put_words(ib, 3 + rnd(10));
+				bufputc(ib, '\n'); }
+			break;
+		    case 2:
+			bufputs(ib, "| a | b |\n|:--|--:|\n");
+			for (i = 0, n = 1 + rnd(4); i < n; i += 1) {
+				bufputs(ib, "| ");
+				put_words(ib, 1 + rnd(3));
+				bufprintf(ib, " | %u |\n", rnd(1000)); }
+			break;
+		    case 3:
+			for (i = 0, n = 1 + rnd(5); i < n; i += 1)
+				bufprintf(ib, "    if (x < %u) return"
+						" \"<a>\";\n", rnd(100));
+			break;
+		    case 4:
+			bufputs(ib, "> ");
+			put_words(ib, 10 + rnd(20));
+			break;
+		    default:
+			put_words(ib, 20 + rnd(40));
+			break; }
+		bufputs(ib, "\n\n"); }
+	for (i = 0; i < 4; i += 1)
+		bufprintf(ib, "[r%u]: http://example.com/r%u \"R%u\"\n",
+								i, i, i); }
+
+
+
+/***********
+ * WORKERS *
+ ***********/
+
+/* now • monotonic time in seconds */
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9; }
+
+
+/* work • renders the whole corpus several times, checking each output */
+static void *
+work(void *arg) {
+	struct worker *w = arg;
+	const struct corpus *c = w->corpus;
+	struct buf *ob = bufnew(4096);
+	const struct buf *exp;
+	size_t r;
+	int k, d;
+
+	for (k = 0; k < w->rounds; k += 1)
+		for (r = 0; r < RNDR_NB; r += 1)
+			for (d = 0; d < DOC_NB; d += 1) {
+				ob->size = 0;
+				if (w->compiled)
+					markdown_compiled(ob, c->in[d],
+							c->rules[r]);
+				else
+					markdown(ob, c->in[d], renderers[r]);
+				exp = c->out[r][d];
+				if (ob->size != exp->size
+				|| memcmp(ob->data, exp->data, ob->size))
+					w->mismatches += 1; }
+	bufrelease(ob);
+	return 0; }
+
+
+/* run • renders on all the workers at once, returns the mismatches */
+static unsigned long
+run(const struct corpus *c, int compiled, int threads, int rounds) {
+	struct worker *w = calloc(threads, sizeof *w);
+	unsigned long bad = 0;
+	double start, t;
+	int i, started = 0;
+
+	if (!w) return 1;
+	start = now();
+	for (i = 0; i < threads; i += 1) {
+		w[i].corpus = c;
+		w[i].compiled = compiled;
+		w[i].rounds = rounds;
+		if (pthread_create(&w[i].tid, 0, work, w + i) != 0) break;
+		started += 1; }
+	for (i = 0; i < started; i += 1) {
+		pthread_join(w[i].tid, 0);
+		bad += w[i].mismatches; }
+	t = now() - start;
+	printf("%-10s %3d threads %10.0f docs/s %9.1f MB/s"
+		" %6lu mismatches\n", compiled ? "compiled" : "markdown",
+		started, (double)started * rounds * RNDR_NB * DOC_NB / t,
+		(double)started * rounds * RNDR_NB * c->bytes / t / 1e6, bad);
+	free(w);
+	return started < threads ? bad + 1 : bad; }
+
+
+
+/*****************
+ * MAIN FUNCTION *
+ *****************/
+
+/* usage • prints the command line help */
+static int
+usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n rounds] [-s size] [-t threads]\n",
+									name);
+	return 2; }
+
+
+/* main • checks markdown() then markdown_compiled() under contention */
+int
+main(int argc, char **argv) {
+	struct corpus c;
+	size_t size = DOC_SIZE, r;
+	int threads = THREADS, rounds = ROUNDS, i, d;
+	unsigned long bad;
+
+	for (i = 1; i < argc; i += 1) {
+		if (i + 1 >= argc || argv[i][0] != '-' || argv[i][2])
+			return usage(argv[0]);
+		switch (argv[i][1]) {
+		    case 'n': rounds = atoi(argv[++i]); break;
+		    case 's': size = strtoul(argv[++i], 0, 10); break;
+		    case 't': threads = atoi(argv[++i]); break;
+		    default: return usage(argv[0]); } }
+	if (rounds < 1 || threads < 1 || !size) return usage(argv[0]);
+
+	/* expected outputs, from the main thread alone */
+	c.bytes = 0;
+	for (d = 0; d < DOC_NB; d += 1) {
+		c.in[d] = bufnew(size + size / 4);
+		gen_document(c.in[d], size);
+		c.bytes += c.in[d]->size; }
+	for (r = 0; r < RNDR_NB; r += 1) {
+		c.rules[r] = mkd_compile(renderers[r]);
+		if (!c.rules[r]) return 2;
+		for (d = 0; d < DOC_NB; d += 1) {
+			c.out[r][d] = bufnew(4096);
+			markdown(c.out[r][d], c.in[d], renderers[r]); } }
+
+	bad = run(&c, 0, threads, rounds);
+	bad += run(&c, 1, threads, rounds);
+
+	for (r = 0; r < RNDR_NB; r += 1) {
+		mkd_compiled_free(c.rules[r]);
+		for (d = 0; d < DOC_NB; d += 1) bufrelease(c.out[r][d]); }
+	for (d = 0; d < DOC_NB; d += 1) bufrelease(c.in[d]);
+	return bad ? 1 : 0; }
+
+/* vim: set filetype=c: */
@@ -0,0 +1,146 @@
+/* pathological.c - timing of adversarial inline inputs */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Each case repeats a pattern into a single paragraph of growing size and
+ * renders it with nat_html. Linear parsing shows a ratio close to 2 between
+ * consecutive sizes; a ratio close to 4 reveals quadratic rescanning.
+ * Every size is rendered once per round and timed by the median of its
+ * RUNS rounds in processor time, so that neither a slower nor a faster
+ * spell of the machine during a single round can flag a case.
+ * The exit status is non-zero when a ratio goes over MAX_RATIO.
+ */
+
+#include "markdown.h"
+#include "renderers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STEPS 3		/* sizes per case, each doubling the previous one */
+#define RUNS 7		/* rounds over the sizes, the median one is kept */
+#define MAX_RATIO 3.0	/* time ratio between sizes flagged as quadratic */
+#define BASE_SIZE 100000	/* default size of the smallest input */
+
+
+/* pattern • repeated piece of input, with an optional closing suffix */
+/*	close is repeated after the tail as many times as the piece */
+struct pattern {
+	const char *	name;
+	const char *	piece;
+	const char *	tail;
+	const char *	close; };
+
+static const struct pattern patterns[] = {
+	{ "unclosed emphasis",		"*a ",		"", "" },
+	{ "unclosed double emphasis",	"**a ",		"", "" },
+	{ "unclosed triple emphasis",	"***a ",	"", "" },
+	{ "refused closers",		"*a b** ",	"", "" },
+	{ "mixed emphasis chars",	"*a _b ",	"", "" },
+	{ "emphasis over brackets",	"*a [b ",	"", "" },
+	{ "emphasis over links",	"*a [b](c ",	"", "" },
+	{ "emphasis over code",		"*a `b ",	"", "" },
+	{ "unclosed brackets",		"[a ",		"", "" },
+	{ "nested brackets",		"[",		"a", "" },
+	{ "balanced brackets",		"[",		"x", "]" },
+	{ "unclosed inline links",	"[a](",		"", "" },
+	{ "unclosed references",	"[a][",		"", "" },
+	{ "escaped parentheses",	"[a](\\) ",	"", "" },
+	{ "unclosed code spans",	"`a ",		"", "" },
+	{ "code span runs",		"`a ``b ",	"", "" },
+	{ "unclosed tags",		"<a ",		"", "" },
+	{ NULL, NULL, NULL, NULL } };
+
+
+/* build • fills ib with the pattern repeated up to size bytes */
+static void
+build(struct buf *ib, const struct pattern *p, size_t size) {
+	size_t n = 0;
+	ib->size = 0;
+	while (ib->size < size) {
+		bufputs(ib, p->piece);
+		n += 1; }
+	bufputs(ib, p->tail);
+	if (*p->close)
+		while (n--) bufputs(ib, p->close);
+	bufputc(ib, '\n'); }
+
+
+/* by_time • qsort comparison of durations */
+static int
+by_time(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y); }
+
+
+/* elapsed • processor seconds spent rendering ib once */
+static double
+elapsed(struct buf *ib, struct buf *ob) {
+	struct timespec beg, end;
+	ob->size = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &beg);
+	markdown(ob, ib, &nat_html);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	return (end.tv_sec - beg.tv_sec) + (end.tv_nsec - beg.tv_nsec) / 1e9; }
+
+
+/* main • runs every case, from the size given on the command line */
+int
+main(int argc, char **argv) {
+	struct buf *ib[STEPS];
+	struct buf *ob = bufnew(BASE_SIZE);
+	const struct pattern *p;
+	size_t size, base = BASE_SIZE;
+	double t[STEPS][RUNS], mid[STEPS];
+	int i, run, bad, ret = 0;
+
+	if (argc > 1) base = strtoul(argv[1], 0, 10);
+	if (!base) {
+		fprintf(stderr, "Usage: %s [size]\n", argv[0]);
+		return 2; }
+	for (i = 0; i < STEPS; i += 1)
+		ib[i] = bufnew(BASE_SIZE);
+
+	for (p = patterns; p->name; p += 1) {
+		printf("%-28s", p->name);
+		for (i = 0, size = base; i < STEPS; i += 1, size *= 2)
+			build(ib[i], p, size);
+		for (run = 0; run < RUNS; run += 1)
+			for (i = 0; i < STEPS; i += 1)
+				t[i][run] = elapsed(ib[i], ob);
+		for (i = 0; i < STEPS; i += 1) {
+			qsort(t[i], RUNS, sizeof t[i][0], by_time);
+			mid[i] = t[i][RUNS / 2]; }
+		bad = 0;
+		for (i = 0; i < STEPS; i += 1) {
+			printf(" %9.2f ms", mid[i] * 1e3);
+			/* ratios of very short runs are only noise */
+			if (i && mid[i - 1] > 1e-3
+			&& mid[i] / mid[i - 1] > MAX_RATIO)
+				bad = 1; }
+		printf("%s\n", bad ? "  (quadratic)" : "");
+		ret |= bad;
+		fflush(stdout); }
+
+	for (i = 0; i < STEPS; i += 1)
+		bufrelease(ib[i]);
+	bufrelease(ob);
+	return ret; }
+
+/* vim: set filetype=c: */
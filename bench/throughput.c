@@ -0,0 +1,405 @@
+/* throughput.c - rendering speed of the bundled renderers over a corpus */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The corpus is generated from a fixed seed, so that every run renders the
+ * same documents. Each document is rendered by each renderer, the best of
+ * several runs being reported along with the allocations of one render and
+ * a hash of its output. The report can be saved as a baseline, and later
+ * runs compared with it: a changed output or a slowdown over the tolerance
+ * makes the exit status non-zero.
+ *
+ * Allocations are counted when built with BENCH_WRAP_MALLOC and linked with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, as "make bench" does.
+ */
+
+#include "markdown.h"
+#include "renderers.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define DOC_SIZE 1000000	/* default size of each generated document */
+#define RUNS 5		/* default number of timed runs per case */
+#define TOLERANCE 15	/* default slowdown percentage tolerated */
+#define SEED 12345	/* seed of the corpus generator */
+#define BASE_LINE 256	/* longest line of a baseline file */
+
+
+/* document • generated corpus entry */
+struct document {
+	const char *	name;
+	void		(*generate)(struct buf *, size_t); };
+
+
+/* renderer • bundled renderer under test */
+struct renderer {
+	const char *			name;
+	const struct mkd_renderer *	rndr; };
+
+
+/* result • measure of a renderer over a document */
+struct result {
+	double		mbps;
+	double		nspb;
+	unsigned long	allocs;		/* allocations of a single render */
+	unsigned long	alloc_bytes;	/* bytes requested by them */
+	uint64_t	hash; };	/* of the output */
+
+
+
+/***********************
+ * ALLOCATION COUNTERS *
+ ***********************/
+
+static unsigned long alloc_nb = 0;
+static unsigned long alloc_bytes = 0;
+
+#ifdef BENCH_WRAP_MALLOC
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+
+void *
+__wrap_malloc(size_t size) {
+	alloc_nb += 1;
+	alloc_bytes += size;
+	return __real_malloc(size); }
+
+void *
+__wrap_calloc(size_t nb, size_t size) {
+	alloc_nb += 1;
+	alloc_bytes += nb * size;
+	return __real_calloc(nb, size); }
+
+void *
+__wrap_realloc(void *ptr, size_t size) {
+	alloc_nb += 1;
+	alloc_bytes += size;
+	return __real_realloc(ptr, size); }
+#endif
+
+
+
+/*********************
+ * CORPUS GENERATION *
+ *********************/
+
+static uint32_t seed = SEED;
+
+/* rnd • returns a pseudo-random number below n */
+static unsigned
+rnd(unsigned n) {
+	seed = seed * 1103515245u + 12345u;
+	return (seed >> 8) % n; }
+
+
+/* put_words • appends n words of prose, with occasional spans */
+static void
+put_words(struct buf *ib, int n) {
+	static const char *words[] = { "lorem", "ipsum", "dolor", "sit",
+	    "amet", "consectetur", "adipiscing", "elit", "sed", "do",
+	    "eiusmod", "tempor", "incididunt", "ut", "labore", "et" };
+	const char *w;
+	int i;
+	for (i = 0; i < n; i += 1) {
+		if (i) bufputc(ib, ' ');
+		w = words[rnd(16)];
+		switch (rnd(40)) {
+		    case 0: bufprintf(ib, "*%s*", w); break;
+		    case 1: bufprintf(ib, "**%s**", w); break;
+		    case 2: bufprintf(ib, "`%s()`", w); break;
+		    case 3: bufprintf(ib, "[%s](http://example.com/%s)", w, w);
+			break;
+		    case 4: bufprintf(ib, "%s &amp; <%s>", w, w); break;
+		    default: bufputs(ib, w); break; } } }
+
+
+/* gen_prose • paragraphs with headers and inline markup */
+static void
+gen_prose(struct buf *ib, size_t size) {
+	while (ib->size < size) {
+		if (rnd(8) == 0) {
+			bufputs(ib, rnd(2) ? "## " : "# ");
+			put_words(ib, 1 + rnd(6));
+			bufputs(ib, "\n\n"); }
+		put_words(ib, 40 + rnd(80));
+		bufputs(ib, "\n\n"); } }
+
+
+/* gen_code • indented code blocks between short paragraphs */
+static void
+gen_code(struct buf *ib, size_t size) {
+	int i, n;
+	while (ib->size < size) {
+		put_words(ib, 10 + rnd(20));
+		bufputs(ib, "\n\n");
+		n = 4 + rnd(30);
+		for (i = 0; i < n; i += 1)
+			bufprintf(ib, "    %*sif (x < %u && y > 0) "
+					"return \"<%u>\";\n", (int)rnd(4) * 4,
+					"", rnd(100), rnd(100));
+		bufputc(ib, '\n'); } }
+
+
+/* gen_tables • tables with aligned columns, parsed by discount renderers */
+static void
+gen_tables(struct buf *ib, size_t size) {
+	int i, n;
+	while (ib->size < size) {
+		bufputs(ib, "| name | value | *note* |\n");
+		bufputs(ib, "|:-----|------:|:-:|\n");
+		n = 10 + rnd(90);
+		for (i = 0; i < n; i += 1) {
+			bufputs(ib, "| ");
+			put_words(ib, 1 + rnd(3));
+			bufprintf(ib, " | %u | ", rnd(100000));
+			put_words(ib, 1 + rnd(5));
+			bufputs(ib, " |\n"); }
+		bufputc(ib, '\n'); } }
+
+
+/* gen_refs • paragraphs of reference links, with their definitions */
+static void
+gen_refs(struct buf *ib, size_t size) {
+	unsigned i, n = 0;
+	while (ib->size < size) {
+		for (i = 0; i < 8; i += 1) {
+			put_words(ib, 4 + rnd(8));
+			bufprintf(ib, " [link %u][r%u] and [r%u][] ",
+					rnd(100), rnd(n + 10), rnd(n + 10)); }
+		bufputs(ib, "\n\n");
+		for (i = 0; i < 10; i += 1, n += 1)
+			bufprintf(ib, "[r%u]: http://example.com/%u"
+						" \"Title %u\"\n", n, n, n);
+		bufputc(ib, '\n'); } }
+
+
+/* gen_nested • nested lists and blockquotes */
+static void
+gen_nested(struct buf *ib, size_t size) {
+	int depth, i, n;
+	while (ib->size < size) {
+		n = 2 + rnd(8);
+		for (i = 0; i < n; i += 1) {
+			depth = rnd(8);
+			bufprintf(ib, "%*s- ", depth * 4, "");
+			put_words(ib, 3 + rnd(10));
+			bufputc(ib, '\n'); }
+		bufputc(ib, '\n');
+		depth = 1 + rnd(8);
+		for (i = 0; i < depth; i += 1) bufputs(ib, "> ");
+		put_words(ib, 10 + rnd(20));
+		bufputs(ib, "\n\n"); } }
+
+
+/* gen_pathological • unclosed delimiters, as in bench/pathological */
+static void
+gen_pathological(struct buf *ib, size_t size) {
+	static const char *pieces[] = { "*a ", "**a ", "[a ", "[a](",
+	    "`a ", "<a ", "*a [b ", "_a *b " };
+	size_t end;
+	while (ib->size < size) {
+		const char *piece = pieces[rnd(8)];
+		end = ib->size + 1000 + rnd(20000);
+		while (ib->size < end) bufputs(ib, piece);
+		bufputs(ib, "\n\n"); } }
+
+
+static const struct document documents[] = {
+	{ "prose",		gen_prose },
+	{ "code",		gen_code },
+	{ "tables",		gen_tables },
+	{ "references",		gen_refs },
+	{ "nested",		gen_nested },
+	{ "pathological",	gen_pathological },
+	{ NULL, NULL } };
+
+static const struct renderer renderers[] = {
+	{ "mkd_html",		&mkd_html },
+	{ "mkd_xhtml",		&mkd_xhtml },
+	{ "discount_html",	&discount_html },
+	{ "discount_xhtml",	&discount_xhtml },
+	{ "nat_html",		&nat_html },
+	{ "nat_xhtml",		&nat_xhtml },
+	{ NULL, NULL } };
+
+
+
+/********************
+ * HELPER FUNCTIONS *
+ ********************/
+
+/* hash • FNV-1a hash of the data */
+static uint64_t
+hash(const char *data, size_t size) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < size; i += 1)
+		h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+	return h; }
+
+
+/* now • monotonic time in seconds */
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9; }
+
+
+/* measure • renders ib with rndr, keeping the best of runs */
+static void
+measure(struct result *res, struct buf *ib, const struct mkd_renderer *rndr,
+							int runs) {
+	struct buf *ob = bufnew(64 * 1024);
+	unsigned long nb, bytes;
+	double t, best = -1;
+	int i;
+
+	/* first render, counted and not timed */
+	nb = alloc_nb;
+	bytes = alloc_bytes;
+	markdown(ob, ib, rndr);
+	res->allocs = alloc_nb - nb;
+	res->alloc_bytes = alloc_bytes - bytes;
+	res->hash = hash(ob->data, ob->size);
+
+	for (i = 0; i < runs; i += 1) {
+		ob->size = 0;
+		t = now();
+		markdown(ob, ib, rndr);
+		t = now() - t;
+		if (best < 0 || t < best) best = t; }
+	if (best <= 0) best = 1e-9;
+	res->mbps = ib->size / best / 1e6;
+	res->nspb = best * 1e9 / ib->size;
+	bufrelease(ob); }
+
+
+/* compare • checks a result against the baseline, returns 0 when fine */
+static int
+compare(FILE *base, const char *doc, const char *rndr,
+			const struct result *res, int tolerance) {
+	char line[BASE_LINE], bdoc[64], brndr[64];
+	double mbps, nspb;
+	unsigned long long h;
+	double change;
+
+	rewind(base);
+	while (fgets(line, sizeof line, base))
+		if (sscanf(line, "%63s %63s %lf %lf %*u %*u %llx",
+				bdoc, brndr, &mbps, &nspb, &h) == 5
+		&& !strcmp(bdoc, doc) && !strcmp(brndr, rndr)) {
+			change = (res->mbps - mbps) * 100 / mbps;
+			printf("  %+6.1f%%", change);
+			if (h != res->hash) {
+				printf("  (output changed)");
+				return 1; }
+			if (change < -tolerance) {
+				printf("  (slower)");
+				return 1; }
+			return 0; }
+	printf("  (no baseline)");
+	return 0; }
+
+
+/* usage • prints the command line help */
+static int
+usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-c baseline] [-n runs] [-o baseline]"
+			" [-s size] [-t percent]\n", name);
+	return 2; }
+
+
+
+/*****************
+ * MAIN FUNCTION *
+ *****************/
+
+int
+main(int argc, char **argv) {
+	const struct document *doc;
+	const struct renderer *r;
+	struct result res;
+	struct rusage usage_data;
+	struct buf *ib;
+	FILE *base = 0, *out = 0;
+	size_t size = DOC_SIZE;
+	int runs = RUNS, tolerance = TOLERANCE, i, ret = 0;
+
+	for (i = 1; i < argc; i += 1) {
+		if (i + 1 >= argc || argv[i][0] != '-' || argv[i][2])
+			return usage(argv[0]);
+		switch (argv[i][1]) {
+		    case 'c':
+			if ((base = fopen(argv[++i], "r")) == 0) {
+				perror(argv[i]);
+				return 2; }
+			break;
+		    case 'n': runs = atoi(argv[++i]); break;
+		    case 'o':
+			if ((out = fopen(argv[++i], "w")) == 0) {
+				perror(argv[i]);
+				return 2; }
+			break;
+		    case 's': size = strtoul(argv[++i], 0, 10); break;
+		    case 't': tolerance = atoi(argv[++i]); break;
+		    default: return usage(argv[0]); } }
+	if (runs < 1 || !size) return usage(argv[0]);
+
+	printf("%-14s %-15s %9s %8s %9s %11s %16s\n", "document", "renderer",
+		"MB/s", "ns/byte", "allocs", "alloc bytes", "output hash");
+	ib = bufnew(64 * 1024);
+	for (doc = documents; doc->name; doc += 1) {
+		ib->size = 0;
+		seed = SEED;
+		doc->generate(ib, size);
+		for (r = renderers; r->name; r += 1) {
+			measure(&res, ib, r->rndr, runs);
+			printf("%-14s %-15s %9.1f %8.2f %9lu %11lu %016llx",
+				doc->name, r->name, res.mbps, res.nspb,
+				res.allocs, res.alloc_bytes,
+				(unsigned long long)res.hash);
+			if (base)
+				ret |= compare(base, doc->name, r->name, &res,
+								tolerance);
+			printf("\n");
+			fflush(stdout);
+			if (out)
+				fprintf(out, "%s %s %.1f %.2f %lu %lu"
+					" %016llx\n", doc->name, r->name,
+					res.mbps, res.nspb,
+					res.allocs, res.alloc_bytes,
+					(unsigned long long)res.hash); } }
+
+	getrusage(RUSAGE_SELF, &usage_data);
+	printf("peak RSS: %ld KiB\n", usage_data.ru_maxrss);
+#ifndef BENCH_WRAP_MALLOC
+	printf("(allocations not counted, see BENCH_WRAP_MALLOC)\n");
+#endif
+	bufrelease(ib);
+	if (base) fclose(base);
+	if (out) fclose(out);
+	return ret; }
+
+/* vim: set filetype=c: */
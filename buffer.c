@@ -31,6 +31,7 @@
  * COMPILE TIME OPTIONS
  *
  * BUFFER_STATS • if defined, stats are kept about memory usage
+ * MKD_PROFILE • if defined, reallocations are counted in each thread
  */
 
 #ifdef BUFFER_STATS
@@ -38,6 +39,11 @@ long buffer_stat_nb = 0;
 size_t buffer_stat_alloc_bytes = 0;
 #endif
 
+#ifdef MKD_PROFILE
+_Thread_local unsigned long buffer_prof_grow_nb = 0;
+_Thread_local size_t buffer_prof_grow_bytes = 0;
+#endif
+
 
 /***************************
  * STATIC HELPER FUNCTIONS *
@@ -112,6 +118,8 @@ bufdup(const struct buf *src, size_t dupunit) {
 	ret->unit = dupunit;
 	ret->size = src->size;
 	ret->ref = 1;
+	ret->growth = src->growth;
+	ret->growth_cap = src->growth_cap;
 	if (!src->size) {
 		ret->asize = 0;
 		ret->data = 0;
@@ -133,16 +141,32 @@ bufdup(const struct buf *src, size_t dupunit) {
 /* bufgrow • increasing the allocated size to the given value */
 int
 bufgrow(struct buf *buf, size_t neosz) {
-	size_t neoasz;
+	size_t neoasz, step;
 	void *neodata;
 	if (!buf || !buf->unit) return 0;
 	if (buf->asize >= neosz) return 1;
-	neoasz = buf->asize + buf->unit;
-	while (neoasz < neosz) neoasz += buf->unit;
+
+	/* computing the minimal step, geometric if requested */
+	step = buf->unit;
+	if (buf->growth > 0) {
+		size_t geo = buf->asize / 100 * buf->growth
+				+ buf->asize % 100 * buf->growth / 100;
+		if (buf->growth_cap && geo > buf->growth_cap)
+			geo = buf->growth_cap;
+		if (geo > step) step = geo; }
+	if (step < neosz - buf->asize) step = neosz - buf->asize;
+
+	/* rounding up to a whole number of units */
+	neoasz = buf->asize + (step + buf->unit - 1) / buf->unit * buf->unit;
+	if (neoasz < neosz) return 0; /* overflow */
 	neodata = realloc(buf->data, neoasz);
 	if (!neodata) return 0;
 #ifdef BUFFER_STATS
 	buffer_stat_alloc_bytes += (neoasz - buf->asize);
+#endif
+#ifdef MKD_PROFILE
+	buffer_prof_grow_nb += 1;
+	buffer_prof_grow_bytes += (neoasz - buf->asize);
 #endif
 	buf->data = neodata;
 	buf->asize = neoasz;
@@ -161,7 +185,19 @@ bufnew(size_t unit) {
 		ret->data = 0;
 		ret->size = ret->asize = 0;
 		ret->ref = 1;
-		ret->unit = unit; }
+		ret->unit = unit;
+		ret->growth = 0;
+		ret->growth_cap = 0; }
+	return ret; }
+
+
+/* bufnew_with_capacity • allocation of a buffer with room for size bytes */
+struct buf *
+bufnew_with_capacity(size_t unit, size_t size) {
+	struct buf *ret = bufnew(unit);
+	if (ret && size && !bufgrow(ret, size)) {
+		bufrelease(ret);
+		return 0; }
 	return ret; }
 
 
@@ -209,6 +245,19 @@ bufputc(struct buf *buf, char c) {
 	buf->size += 1; }
 
 
+/* bufputi • appends the decimal representation of an integer */
+void
+bufputi(struct buf *buf, long n) {
+	char tmp[24];
+	size_t i = sizeof tmp;
+	unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+	do {
+		tmp[--i] = '0' + u % 10;
+		u /= 10; } while (u);
+	if (n < 0) tmp[--i] = '-';
+	bufput(buf, tmp + i, sizeof tmp - i); }
+
+
 /* bufrelease • decrease the reference count and free the buffer if needed */
 void
 bufrelease(struct buf *buf) {
@@ -223,6 +272,15 @@ bufrelease(struct buf *buf) {
 		free(buf); } }
 
 
+/* bufreserve • makes room for len more bytes, returns where they start */
+char *
+bufreserve(struct buf *buf, size_t len) {
+	if (!buf) return 0;
+	if (buf->size + len > buf->asize && !bufgrow(buf, buf->size + len))
+		return 0;
+	return buf->data + buf->size; }
+
+
 /* bufreset • frees internal data of the buffer */
 void
 bufreset(struct buf *buf) {
@@ -245,6 +303,14 @@ bufset(struct buf **dest, struct buf *src) {
 	*dest = src; }
 
 
+/* bufsetgrowth • sets the growth policy of the buffer */
+void
+bufsetgrowth(struct buf *buf, int percent, size_t cap) {
+	if (!buf) return;
+	buf->growth = percent > 0 ? percent : 0;
+	buf->growth_cap = cap; }
+
+
 /* bufslurp • removes a given number of bytes from the head of the array */
 void
 bufslurp(struct buf *buf, size_t len) {
@@ -33,7 +33,9 @@ struct buf {
 	size_t	size;	/* size of the string */
 	size_t	asize;	/* allocated size (0 = volatile buffer) */
 	size_t	unit;	/* reallocation unit size (0 = read-only buffer) */
-	int	ref; };	/* reference count */
+	int	ref;	/* reference count */
+	int	growth;	/* geometric growth percentage (0 = linear growth) */
+	size_t	growth_cap; }; /* maximum geometric growth step (0 = none) */
 
 
 
@@ -108,6 +110,11 @@ struct buf *
 bufnew(size_t)
 	BUF_ALLOCATOR;
 
+/* bufnew_with_capacity • allocation of a buffer with room for size bytes */
+struct buf *
+bufnew_with_capacity(size_t unit, size_t size)
+	BUF_ALLOCATOR;
+
 /* bufnullterm • NUL-termination of the string array (making a C-string) */
 void
 bufnullterm(struct buf *);
@@ -129,10 +136,20 @@ bufputs(struct buf *, const char*);
 void
 bufputc(struct buf *, char);
 
+/* bufputi • appends the decimal representation of an integer */
+void
+bufputi(struct buf *, long);
+
 /* bufrelease • decrease the reference count and free the buffer if needed */
 void
 bufrelease(struct buf *);
 
+/* bufreserve • makes room for len more bytes, returns where they start */
+/*	the caller writes at most len bytes there and then adds to size */
+/*	what it wrote; returns NULL when the buffer cannot grow */
+char *
+bufreserve(struct buf *, size_t len);
+
 /* bufreset • frees internal data of the buffer */
 void
 bufreset(struct buf *);
@@ -141,6 +158,12 @@ bufreset(struct buf *);
 void
 bufset(struct buf **, struct buf *);
 
+/* bufsetgrowth • sets the growth policy of the buffer */
+/*	each reallocation adds at least the given percentage of the current */
+/*	allocated size, without exceeding cap bytes at once (if non-zero) */
+void
+bufsetgrowth(struct buf *, int percent, size_t cap);
+
 /* bufslurp • removes a given number of bytes from the head of the array */
 void
 bufslurp(struct buf *, size_t);
@@ -165,6 +188,13 @@ extern size_t buffer_stat_alloc_bytes;
 
 #endif /* def BUFFER_STATS */
 
+#ifdef MKD_PROFILE
+
+extern _Thread_local unsigned long buffer_prof_grow_nb;
+extern _Thread_local size_t buffer_prof_grow_bytes;
+
+#endif /* def MKD_PROFILE */
+
 
 #endif /* ndef LITHIUM_BUFFER_H */
 
@@ -0,0 +1,601 @@
+/* cache.c - rendered output cache keyed by input content */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "cache.h"
+#include "array.h"
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#ifndef MKD_NO_THREADS
+#include <pthread.h>
+#endif
+
+#define CACHE_VERSION 2	/* to be bumped whenever the output changes */
+#define CACHE_SLOTS 64	/* initial number of hash table slots */
+#define PATH_UNIT 64
+
+#define HASH_M1 0x9e3779b97f4a7c15ULL
+#define HASH_M2 0xc2b2ae3d27d4eb4fULL
+#define HASH_M3 0x165667b19e3779f9ULL
+
+
+/***************
+ * LOCAL TYPES *
+ ***************/
+
+/* struct cache_key • identity of a rendered document */
+/*	the hash only finds the candidates, a hit matching all the fields */
+struct cache_key {
+	uint64_t	hash;	/* hash of the input, renderer and state */
+	const char *	id;	/* renderer id */
+	size_t		id_size;
+	const char *	data;	/* input */
+	size_t		size;
+	int		appended; };	/* whether the output was not empty */
+
+
+/* struct cache_entry • document kept in memory */
+/*	followed by the renderer id, the input and the output */
+struct cache_entry {
+	struct cache_entry *	prev;	/* more recently used entry */
+	struct cache_entry *	next;	/* less recently used entry */
+	struct cache_entry *	chain;	/* next entry in the same slot */
+	uint64_t		hash;
+	size_t			id_size;
+	size_t			in_size;
+	int			appended;
+	size_t			size; };	/* size of the output */
+
+
+/* struct disk_file • document file found in the cache directory */
+struct disk_file {
+	char			name[48];
+	size_t			size;
+	time_t			mtime; };
+
+
+/* struct mkd_cache • memory and disk stores of rendered documents */
+struct mkd_cache {
+	struct cache_entry **	slot;	/* hash table of the entries */
+	size_t			slot_nb;	/* power of two */
+	struct cache_entry *	head;	/* most recently used entry */
+	struct cache_entry *	tail;	/* least recently used entry */
+	size_t			max_size;
+	char *			dir;	/* 0 for a memory-only cache */
+	size_t			max_disk;	/* 0 for an unbounded one */
+	size_t			disk_size;	/* estimated bytes of files */
+	int			disk_known;	/* whether it was counted */
+	mode_t			mode;	/* of the files, 0644 less the umask */
+	struct mkd_cache_stats	stats;
+#ifndef MKD_NO_THREADS
+	pthread_mutex_t		lock;
+#endif
+};
+
+
+
+/***************************
+ * STATIC HELPER FUNCTIONS *
+ ***************************/
+
+/* rotl • 64-bit left rotation */
+static uint64_t
+rotl(uint64_t x, int n) {
+	return (x << n) | (x >> (64 - n)); }
+
+
+/* read_word • unaligned 64-bit load */
+static uint64_t
+read_word(const char *data) {
+	uint64_t ret;
+	memcpy(&ret, data, sizeof ret);
+	return ret; }
+
+
+/* hash_round • mixes one input word into an accumulator */
+static uint64_t
+hash_round(uint64_t acc, uint64_t word) {
+	return rotl(acc + word * HASH_M2, 31) * HASH_M1; }
+
+
+/* hash_data • 64-bit hash of a byte array */
+/*	four independent lanes eat 32 bytes per round, so that hashing a */
+/*	document costs much less than parsing it */
+static uint64_t
+hash_data(const char *data, size_t size, uint64_t seed) {
+	uint64_t v0 = seed + HASH_M1 + HASH_M2, v1 = seed + HASH_M2;
+	uint64_t v2 = seed, v3 = seed - HASH_M1, h;
+	size_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		v0 = hash_round(v0, read_word(data + i));
+		v1 = hash_round(v1, read_word(data + i + 8));
+		v2 = hash_round(v2, read_word(data + i + 16));
+		v3 = hash_round(v3, read_word(data + i + 24)); }
+	h = rotl(v0, 1) + rotl(v1, 7) + rotl(v2, 12) + rotl(v3, 18);
+	h += size * HASH_M3;
+	for (; i + 8 <= size; i += 8)
+		h = rotl(h ^ hash_round(0, read_word(data + i)), 27)
+							* HASH_M1 + HASH_M3;
+	for (; i < size; i += 1)
+		h = rotl(h ^ ((unsigned char)data[i] * HASH_M3), 11) * HASH_M1;
+
+	/* final avalanche */
+	h ^= h >> 33;
+	h *= HASH_M2;
+	h ^= h >> 29;
+	h *= HASH_M3;
+	h ^= h >> 32;
+	return h; }
+
+
+/* cache_key • computes the key of a document */
+/*	the renderers emit a leading newline into non-empty output buffers, */
+/*	so the emptiness of ob is part of the key too */
+static void
+cache_key(struct cache_key *key, const struct buf *ib, const char *id,
+						const struct buf *ob) {
+	uint64_t seed = CACHE_VERSION * 2 + (ob->size != 0);
+	key->id = id;
+	key->id_size = strlen(id);
+	key->data = ib->data;
+	key->size = ib->size;
+	key->appended = (ob->size != 0);
+	seed = hash_data(id, key->id_size, seed);
+	key->hash = hash_data(ib->data, ib->size, seed); }
+
+
+/* cache_lock • takes the lock of the cache */
+static void
+cache_lock(struct mkd_cache *cache) {
+#ifndef MKD_NO_THREADS
+	pthread_mutex_lock(&cache->lock);
+#endif
+	(void)cache; }
+
+
+/* cache_unlock • releases the lock of the cache */
+static void
+cache_unlock(struct mkd_cache *cache) {
+#ifndef MKD_NO_THREADS
+	pthread_mutex_unlock(&cache->lock);
+#endif
+	(void)cache; }
+
+
+
+/****************
+ * MEMORY STORE *
+ ****************/
+
+/* entry_data • returns the output stored after the entry */
+static char *
+entry_data(struct cache_entry *entry) {
+	return (char *)(entry + 1) + entry->id_size + entry->in_size; }
+
+
+/* entry_size • memory accounted for an entry */
+static size_t
+entry_size(struct cache_entry *entry) {
+	return sizeof *entry + entry->id_size + entry->in_size + entry->size; }
+
+
+/* entry_match • whether an entry holds the document of a key */
+static int
+entry_match(struct cache_entry *entry, const struct cache_key *key) {
+	const char *id = (const char *)(entry + 1);
+	return entry->hash == key->hash && entry->in_size == key->size
+	    && entry->id_size == key->id_size
+	    && entry->appended == key->appended
+	    && memcmp(id, key->id, key->id_size) == 0
+	    && memcmp(id + key->id_size, key->data, key->size) == 0; }
+
+
+/* lru_unlink • removes an entry from the recently used list */
+static void
+lru_unlink(struct mkd_cache *cache, struct cache_entry *entry) {
+	if (entry->prev) entry->prev->next = entry->next;
+	else cache->head = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	else cache->tail = entry->prev; }
+
+
+/* lru_push • inserts an entry as the most recently used one */
+static void
+lru_push(struct mkd_cache *cache, struct cache_entry *entry) {
+	entry->prev = 0;
+	entry->next = cache->head;
+	if (cache->head) cache->head->prev = entry;
+	else cache->tail = entry;
+	cache->head = entry; }
+
+
+/* mem_find • looks up an entry, marking it as recently used */
+static struct cache_entry *
+mem_find(struct mkd_cache *cache, const struct cache_key *key) {
+	struct cache_entry *entry;
+	if (!cache->slot_nb) return 0;
+	entry = cache->slot[key->hash & (cache->slot_nb - 1)];
+	while (entry && !entry_match(entry, key))
+		entry = entry->chain;
+	if (entry && entry != cache->head) {
+		lru_unlink(cache, entry);
+		lru_push(cache, entry); }
+	return entry; }
+
+
+/* mem_drop • removes the least recently used entry */
+static void
+mem_drop(struct mkd_cache *cache) {
+	struct cache_entry *entry = cache->tail, **link;
+	link = &cache->slot[entry->hash & (cache->slot_nb - 1)];
+	while (*link != entry) link = &(*link)->chain;
+	*link = entry->chain;
+	lru_unlink(cache, entry);
+	cache->stats.entries -= 1;
+	cache->stats.size -= entry_size(entry);
+	free(entry); }
+
+
+/* mem_rehash • doubles the number of slots of the hash table */
+static void
+mem_rehash(struct mkd_cache *cache) {
+	size_t nb = cache->slot_nb ? cache->slot_nb * 2 : CACHE_SLOTS;
+	struct cache_entry **slot = calloc(nb, sizeof *slot), *entry;
+	size_t i;
+	if (!slot) return;
+	for (entry = cache->head; entry; entry = entry->next) {
+		i = entry->hash & (nb - 1);
+		entry->chain = slot[i];
+		slot[i] = entry; }
+	free(cache->slot);
+	cache->slot = slot;
+	cache->slot_nb = nb; }
+
+
+/* mem_put • stores a copy of the output, evicting older entries */
+/*	the id and the input are kept too, to check the hits */
+static void
+mem_put(struct mkd_cache *cache, const struct cache_key *key,
+					const char *data, size_t size) {
+	struct cache_entry *entry;
+	size_t i, total = sizeof *entry + key->id_size + key->size + size;
+
+	if (total > cache->max_size
+	|| mem_find(cache, key))
+		return;
+	while (cache->stats.size + total > cache->max_size)
+		mem_drop(cache);
+	if (cache->stats.entries >= cache->slot_nb)
+		mem_rehash(cache);
+	if (!cache->slot_nb
+	|| (entry = malloc(total)) == 0)
+		return;
+
+	entry->hash = key->hash;
+	entry->id_size = key->id_size;
+	entry->in_size = key->size;
+	entry->appended = key->appended;
+	entry->size = size;
+	memcpy(entry + 1, key->id, key->id_size);
+	memcpy((char *)(entry + 1) + key->id_size, key->data, key->size);
+	memcpy(entry_data(entry), data, size);
+	i = key->hash & (cache->slot_nb - 1);
+	entry->chain = cache->slot[i];
+	cache->slot[i] = entry;
+	lru_push(cache, entry);
+	cache->stats.entries += 1;
+	cache->stats.size += entry_size(entry); }
+
+
+
+/**************
+ * DISK STORE *
+ **************/
+
+/* disk_path • writes the file name of a document */
+static void
+disk_path(struct buf *path, struct mkd_cache *cache,
+					const struct cache_key *key) {
+	path->size = 0;
+	bufprintf(path, "%s/%016llx-%llx.html", cache->dir,
+			(unsigned long long)key->hash,
+			(unsigned long long)key->size);
+	bufnullterm(path); }
+
+
+/* disk_head • size of the file header: id, a NUL and the appended flag */
+static size_t
+disk_head(const struct cache_key *key) {
+	return key->id_size + 2; }
+
+
+/* disk_get • appends a document from its file, returns 0 when absent */
+/*	the file holds the header and the input before the output, and is */
+/*	only a hit when they match the key; its time is then updated, for */
+/*	disk_prune to drop the least recently used files first */
+static int
+disk_get(struct mkd_cache *cache, const struct cache_key *key,
+							struct buf *ob) {
+	struct buf *path = bufnew(PATH_UNIT);
+	struct stat st;
+	size_t org = ob->size, skip = disk_head(key) + key->size;
+	FILE *in = 0;
+	char *data;
+	int ret = 0;
+
+	if (!path) return 0;
+	disk_path(path, cache, key);
+	if ((in = fopen(path->data, "rb")) != 0
+	&& fstat(fileno(in), &st) == 0
+	&& (size_t)st.st_size >= skip
+	&& bufgrow(ob, org + st.st_size)
+	&& fread(ob->data + org, 1, st.st_size, in) == (size_t)st.st_size) {
+		data = ob->data + org;
+		if (memcmp(data, key->id, key->id_size) == 0
+		&& data[key->id_size] == 0
+		&& data[key->id_size + 1] == '0' + key->appended
+		&& memcmp(data + disk_head(key), key->data, key->size) == 0) {
+			memmove(data, data + skip, st.st_size - skip);
+			ob->size = org + st.st_size - skip;
+			ret = 1; } }
+	if (in) fclose(in);
+	if (ret) utime(path->data, 0);
+	bufrelease(path);
+	return ret; }
+
+
+/* disk_is_file • whether a file name is the one of a cached document */
+static int
+disk_is_file(const char *name) {
+	size_t i;
+	for (i = 0; i < 16; i += 1)
+		if (!strchr("0123456789abcdef", name[i]) || !name[i]) return 0;
+	if (name[i++] != '-') return 0;
+	while (name[i] && strchr("0123456789abcdef", name[i])) i += 1;
+	return i > 17 && i < 40 && strcmp(name + i, ".html") == 0; }
+
+
+/* disk_cmp • order of document files, least recently used first */
+static int
+disk_cmp(const void *a, const void *b) {
+	const struct disk_file *fa = a, *fb = b;
+	return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime); }
+
+
+/* disk_prune • counts the bytes of the document files in the directory */
+/*	when over max_disk, the least recently used files are removed until */
+/*	they fit in 3/4 of it, leaving room for the next documents */
+static void
+disk_prune(struct mkd_cache *cache) {
+	struct buf *path = bufnew(PATH_UNIT);
+	struct disk_file *file;
+	struct array files;
+	struct dirent *de;
+	struct stat st;
+	size_t total = 0;
+	DIR *dir;
+	int i;
+
+	if (!path || (dir = opendir(cache->dir)) == 0) {
+		bufrelease(path);
+		return; }
+	arr_init(&files, sizeof (struct disk_file));
+	while ((de = readdir(dir)) != 0) {
+		if (!disk_is_file(de->d_name)) continue;
+		path->size = 0;
+		bufprintf(path, "%s/%s", cache->dir, de->d_name);
+		bufnullterm(path);
+		if (stat(path->data, &st) != 0
+		|| (file = arr_push(&files)) == 0)
+			continue;
+		strcpy(file->name, de->d_name);
+		file->size = st.st_size;
+		file->mtime = st.st_mtime;
+		total += file->size; }
+	closedir(dir);
+
+	if (total > cache->max_disk) {
+		qsort(files.base, files.size, files.unit, disk_cmp);
+		file = files.base;
+		for (i = 0; i < files.size && total > cache->max_disk / 4 * 3;
+								i += 1) {
+			path->size = 0;
+			bufprintf(path, "%s/%s", cache->dir, file[i].name);
+			bufnullterm(path);
+			if (unlink(path->data) == 0) total -= file[i].size; } }
+	cache->disk_size = total;
+	cache->disk_known = 1;
+	arr_free(&files);
+	bufrelease(path); }
+
+
+/* disk_write • writes a whole array into a file, returns 0 on failure */
+static int
+disk_write(int fd, const char *data, size_t size) {
+	ssize_t ret;
+	while (size > 0 && (ret = write(fd, data, size)) > 0) {
+		data += ret;
+		size -= ret; }
+	return size == 0; }
+
+
+/* disk_put • writes a document into its file, returns the bytes written */
+/*	a temporary file is renamed into place, so that concurrent readers */
+/*	never see a partial document; mkstemp creates it private, so it is */
+/*	opened to the other users of the cache first */
+static size_t
+disk_put(struct mkd_cache *cache, const struct cache_key *key,
+					const char *data, size_t size) {
+	struct buf *path = bufnew(PATH_UNIT), *tmp = bufnew(PATH_UNIT);
+	char flag[2];
+	size_t ret = 0;
+	int fd, ok;
+
+	if (!path || !tmp) {
+		bufrelease(path);
+		bufrelease(tmp);
+		return 0; }
+	disk_path(path, cache, key);
+	bufprintf(tmp, "%s/.mkd-XXXXXX", cache->dir);
+	bufnullterm(tmp);
+	flag[0] = 0;
+	flag[1] = '0' + key->appended;
+	if ((fd = mkstemp(tmp->data)) >= 0) {
+		ok = fchmod(fd, cache->mode) == 0
+		  && disk_write(fd, key->id, key->id_size)
+		  && disk_write(fd, flag, sizeof flag)
+		  && disk_write(fd, key->data, key->size)
+		  && disk_write(fd, data, size);
+		if (close(fd) != 0 || !ok
+		|| rename(tmp->data, path->data) != 0)
+			unlink(tmp->data);
+		else ret = disk_head(key) + key->size + size; }
+	bufrelease(path);
+	bufrelease(tmp);
+	return ret; }
+
+
+
+/********************
+ * CACHED RENDERING *
+ ********************/
+
+/* cache_render • looks the document up, rendering and storing it if needed */
+static void
+cache_render(struct mkd_cache *cache, struct mkd_context *ctx,
+			const struct mkd_renderer *rndr,
+			struct buf *ob, struct buf *ib, const char *id) {
+	struct cache_entry *entry;
+	struct cache_key key;
+	size_t org = ob->size, written = 0;
+
+	cache_key(&key, ib, id, ob);
+
+	/* memory lookup, copying while the entry cannot be dropped */
+	cache_lock(cache);
+	if ((entry = mem_find(cache, &key)) != 0) {
+		bufput(ob, entry_data(entry), entry->size);
+		cache->stats.hits += 1;
+		cache_unlock(cache);
+		return; }
+	cache_unlock(cache);
+
+	/* disk lookup, then actual rendering */
+	if (cache->dir && disk_get(cache, &key, ob)) {
+		cache_lock(cache);
+		cache->stats.hits += 1; }
+	else {
+		if (ctx) mkd_render(ctx, ob, ib);
+		else markdown(ob, ib, rndr);
+		if (cache->dir)
+			written = disk_put(cache, &key, ob->data + org,
+							ob->size - org);
+		cache_lock(cache);
+		cache->stats.misses += 1;
+
+		/* the directory is only counted again when over its limit */
+		if (written && cache->max_disk) {
+			cache->disk_size += written;
+			if (!cache->disk_known
+			|| cache->disk_size > cache->max_disk)
+				disk_prune(cache); } }
+	if (cache->max_size)
+		mem_put(cache, &key, ob->data + org, ob->size - org);
+	cache_unlock(cache); }
+
+
+
+/**********************
+ * EXPORTED FUNCTIONS *
+ **********************/
+
+/* mkd_cache_free • releases a cache, leaving its directory untouched */
+void
+mkd_cache_free(struct mkd_cache *cache) {
+	struct cache_entry *entry, *next;
+	if (!cache) return;
+	for (entry = cache->head; entry; entry = next) {
+		next = entry->next;
+		free(entry); }
+#ifndef MKD_NO_THREADS
+	pthread_mutex_destroy(&cache->lock);
+#endif
+	free(cache->slot);
+	free(cache->dir);
+	free(cache); }
+
+
+/* mkd_cache_markdown • cached equivalent of markdown() */
+void
+mkd_cache_markdown(struct mkd_cache *cache, struct buf *ob, struct buf *ib,
+			const struct mkd_renderer *rndr, const char *id) {
+	if (!cache) markdown(ob, ib, rndr);
+	else if (ob && ib && rndr && id)
+		cache_render(cache, 0, rndr, ob, ib, id); }
+
+
+/* mkd_cache_new • allocates a cache */
+struct mkd_cache *
+mkd_cache_new(size_t max_size, const char *dir, size_t max_disk) {
+	struct mkd_cache *cache = malloc(sizeof *cache);
+	if (!cache) return 0;
+	memset(cache, 0, sizeof *cache);
+	cache->max_size = max_size;
+	cache->max_disk = max_disk;
+	if (dir && (cache->dir = malloc(strlen(dir) + 1)) == 0) {
+		free(cache);
+		return 0; }
+	if (dir) strcpy(cache->dir, dir);
+	/* the umask is only read by setting it, so once here and not */
+	/* around every file while other threads may create theirs */
+	cache->mode = umask(022);
+	umask(cache->mode);
+	cache->mode = 0644 & ~cache->mode;
+#ifndef MKD_NO_THREADS
+	if (pthread_mutex_init(&cache->lock, 0) != 0) {
+		free(cache->dir);
+		free(cache);
+		return 0; }
+#endif
+	return cache; }
+
+
+/* mkd_cache_render • cached equivalent of mkd_render() */
+void
+mkd_cache_render(struct mkd_cache *cache, struct mkd_context *ctx,
+			struct buf *ob, struct buf *ib, const char *id) {
+	if (!cache) mkd_render(ctx, ob, ib);
+	else if (ctx && ob && ib && id)
+		cache_render(cache, ctx, 0, ob, ib, id); }
+
+
+/* mkd_cache_stats • fills the counters of the cache */
+void
+mkd_cache_stats(struct mkd_cache *cache, struct mkd_cache_stats *stats) {
+	cache_lock(cache);
+	*stats = cache->stats;
+	cache_unlock(cache); }
+
+/* vim: set filetype=c: */
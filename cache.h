@@ -0,0 +1,82 @@
+/* cache.h - rendered output cache keyed by input content */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LITHIUM_CACHE_H
+#define LITHIUM_CACHE_H
+
+#include "markdown.h"
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* mkd_cache • store of rendered documents, in memory and/or on disk */
+struct mkd_cache;
+
+
+/* mkd_cache_stats • counters of a cache */
+struct mkd_cache_stats {
+	unsigned long	hits;		/* documents found in the cache */
+	unsigned long	misses;		/* documents actually rendered */
+	size_t		entries;	/* documents currently in memory */
+	size_t		size; };	/* bytes currently used in memory */
+
+
+
+/*******************
+ * CACHE FUNCTIONS *
+ *******************/
+
+/* mkd_cache_free • releases a cache, leaving its directory untouched */
+void
+mkd_cache_free(struct mkd_cache *cache);
+
+/* mkd_cache_markdown • cached equivalent of markdown() */
+/*	id names the renderer (e.g. "nat_html"), and must be different for */
+/*	every renderer whose output can differ for the same input */
+void
+mkd_cache_markdown(struct mkd_cache *cache, struct buf *ob, struct buf *ib,
+			const struct mkd_renderer *rndr, const char *id);
+
+/* mkd_cache_new • allocates a cache */
+/*	at most max_size bytes are kept in memory, the least recently used */
+/*	documents being dropped first (0 disabling the memory store); when */
+/*	dir is not NULL, documents are also stored as files in that existing */
+/*	directory, shared across processes and users (files are created */
+/*	with mode 0644 less the umask read here), the least recently used */
+/*	ones being removed once they take more than max_disk bytes (0 for */
+/*	no limit); both stores keep the input along with the output, so that */
+/*	a document is only found for the very same input */
+struct mkd_cache *
+mkd_cache_new(size_t max_size, const char *dir, size_t max_disk);
+
+/* mkd_cache_render • cached equivalent of mkd_render() */
+/*	same constraint on id as mkd_cache_markdown */
+void
+mkd_cache_render(struct mkd_cache *cache, struct mkd_context *ctx,
+			struct buf *ob, struct buf *ib, const char *id);
+
+/* mkd_cache_stats • fills the counters of the cache */
+void
+mkd_cache_stats(struct mkd_cache *cache, struct mkd_cache_stats *stats);
+
+
+#endif /* ndef LITHIUM_CACHE_H */
+
+/* vim: set filetype=c: */
@@ -18,17 +18,58 @@
 
 #include "markdown.h"
 
+#include "arena.h"
 #include "array.h"
+#include "renderers.h"
+#include "scan.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 #include <strings.h> /* for strncasecmp */
+#ifndef MKD_NO_THREADS
+#include <pthread.h>
+#endif
+#ifdef MKD_PROFILE
+#include <time.h>
+#endif
 
 #define TEXT_UNIT 64	/* unit for the copy of the input buffer */
 #define WORK_UNIT 64	/* block-level working buffer */
+#define ARENA_UNIT 4096	/* chunk size for per-document allocations */
+#define GROWTH 50	/* geometric growth percentage of internal buffers */
+#define REF_SLOTS 64	/* initial size of the reference hash table */
+#define PARALLEL_MIN 65536	/* smallest chunk worth a thread */
+#define PARALLEL_SPLIT 4	/* chunks per thread, for load balancing */
+#define STREAM_UNIT 1024	/* unit for the buffers of a stream */
+#define STREAM_LOOKAHEAD 8	/* newlines is_ref may need after a line */
+#define STREAM_HTML_MAX 262144	/* longest HTML block a stream waits for */
+#define MEMO_TICKS 8	/* code span delimiter lengths with a scan memo */
+#define MATCH_SCAN 256	/* bracket scan length before indexing its span */
+#define EMPH_SCAN 8	/* emphasis landings before recording them */
+#define BUDGET_CHECK 64	/* budget steps between memory checks */
+#define EXTRACT_UNIT 256	/* unit for the text of an extraction */
 
 #define MKD_LI_END 8	/* internal list flag */
 
+/* MAKE, SPAN • callbacks of a render, constant in specialized parsers */
+#ifndef MKD_SPECIAL
+#define MAKE(rndr) (&(rndr)->make)
+#define SPAN(rndr) (&(rndr)->span)
+#endif
+
+#define HAS_BLOCKHTML(rndr) ((rndr)->rules->has_blockhtml)
+#define TABLE_BUFFERED(rndr) ((rndr)->rules->table_buffered)
+#define HAS_TABLE(rndr) ((rndr)->rules->has_table)
+#define BUDGET_OK(rndr) (!(rndr)->budget || budget_step(rndr))
+
+/* BUDGET_SLOW • keeps the budget code out of the parsing loops */
+#ifdef __GNUC__
+#define BUDGET_SLOW __attribute__ ((noinline))
+#else
+#define BUDGET_SLOW
+#endif
+
 
 /***************
  * LOCAL TYPES *
@@ -38,25 +79,294 @@
 struct link_ref {
 	struct buf *	id;
 	struct buf *	link;
+	struct buf *	title;
+	unsigned	hash; };	/* ref_hash() of id */
+
+
+/* span_kind • nested inline construct, closed once its contents parsed */
+enum span_kind {
+	SPAN_NONE,
+	SPAN_EMPH1,
+	SPAN_EMPH2,
+	SPAN_EMPH3,
+	SPAN_LINK };
+
+
+/* inline_span • nested inline construct opened by a trigger */
+struct inline_span {
+	enum span_kind	kind;
+	char		c;	/* emphasis char */
+	char *		data;	/* contents to parse */
+	size_t		size;
+	size_t		len;	/* chars taken care of, if the callback agrees */
+	struct buf *	work;	/* rendered contents */
+	struct buf *	link;
 	struct buf *	title; };
 
 
+/* inline_frame • span being parsed by parse_inline */
+struct inline_frame {
+	struct buf *		ob;
+	char *			data;
+	size_t			size;
+	size_t			i;	/* beginning of the pending text */
+	size_t			end;	/* next char to look at */
+	struct inline_span	span; };	/* what to close in the parent */
+
+
+/* frame_kind • block-level construct on the explicit stack */
+enum frame_kind {
+	FRAME_BLOCKS,	/* sequence of blocks */
+	FRAME_QUOTE,
+	FRAME_LIST,
+	FRAME_ITEM };
+
+
+/* block_frame • block-level construct being parsed by parse_block_until */
+struct block_frame {
+	enum frame_kind	kind;
+	int		step;	/* quote and item progress, end of list */
+	struct buf *	ob;	/* output of the construct */
+	char *		data;
+	size_t		size;
+	size_t		beg;	/* current offset, and result when done */
+	size_t		stop;	/* blocks starting before stop are parsed */
+	size_t		org;	/* beginning of the pending nested block */
+	size_t		mark;	/* size of ob before it */
+	int		top;	/* whether blocks are recorded */
+	int		flags;	/* list and item flags */
+	size_t		sublist; /* offset of the sublist in item work */
+	struct buf *	work;	/* quote and item contents, list output */
+	struct buf *	out;	/* quote output, item intermediate render */
+	char *		from;	/* text the contents are copied from */
+	size_t		map_beg; /* their segments in nest_map */
+	size_t		map_end; };
+
+
+/* memo_slot • forward searches remembered by inline_index */
+enum memo_slot {
+	MEMO_LBRACKET,
+	MEMO_RBRACKET,
+	MEMO_LPAREN,
+	MEMO_RPAREN,	/* not preceded by a backslash */
+	MEMO_RANGLE,
+	MEMO_TICK,	/* runs of 1 to MEMO_TICKS backticks */
+	MEMO_NB = MEMO_TICK + MEMO_TICKS };
+
+
+/* scan_memo • last answer of a forward search in inline data */
+/*	still valid for a search in the same span starting in [from, at] */
+struct scan_memo {
+	const char *	from;
+	const char *	at;	/* what was found, or end when nothing */
+	const char *	end; };	/* end of the searched span */
+
+
+/* emph_mark • emphasis scans known to fail from a position */
+struct emph_mark {
+	unsigned	end;	/* end offset of the scanned span */
+	char		c;
+	unsigned char	kinds; };	/* 1 << (n - 1) for parse_emphn */
+
+
+/* inline_index • lazily built indexes over the data of parse_inline */
+/*	they keep emphasis and link matching linear in the size of the data */
+struct inline_index {
+	char *			root;	/* outermost span, 0 when too large */
+	size_t			size;
+	struct scan_memo	memo[MEMO_NB];
+	unsigned *		match;	/* offset + 1 of the ']' of each '[' */
+	size_t			match_size;
+	int			has_match;	/* whether match is built */
+	struct emph_mark *	mark;	/* indexed by offset of a landing */
+	size_t			mark_size;
+	int			has_mark;	/* whether mark is cleared */
+	int			landings;	/* of the current scan */
+	struct array		stack; };	/* unsigned offsets */
+
+
+/* extract_state • headings and links found by an extraction */
+struct extract_state {
+	struct array	heading;	/* struct mkd_heading */
+	struct array	link;		/* struct mkd_link */
+	struct buf *	text;		/* contents of their slices */
+	int		failed; };	/* whether an allocation failed */
+
+
+/* src_seg • beginning of a run of text copied as is from the input */
+struct src_seg {
+	size_t	text;	/* offset in the text */
+	size_t	input; };	/* offset in the input */
+
+
 /* char_trigger • function pointer to render active chars */
 /*   returns the number of chars taken care of */
 /*   data is the pointer of the beginning of the span */
 /*   offset is the number of valid chars before data */
+/*   nested constructs are described in span instead, returning 0 */
 struct render;
 typedef size_t
 (*char_trigger)(struct buf *ob, struct render *rndr,
-		char *data, size_t offset, size_t size);
+		char *data, size_t offset, size_t size,
+		struct inline_span *span);
+
+
+/* special_render • context_render of a parser specialized by special.h */
+typedef void
+special_render(struct mkd_context *ctx, struct buf *ob, struct buf *ib,
+							int nthreads);
+
+/* parsers of the built-in renderers, in special_*.c */
+special_render special_mkd_html, special_discount_html, special_nat_html;
+
+
+/* mkd_compiled • renderer with its derived tables, read-only once built */
+struct mkd_compiled {
+	struct mkd_renderer	make;
+	special_render *	special;	/* parser for make, or 0 */
+	struct mkd_span_renderer span;		/* used where make has NULL */
+	char_trigger		active_char[256];
+	struct scan_set		active_set;	/* bytes with a trigger */
+	int			active_scan;	/* whether to use active_set */
+	int			has_blockhtml;
+	int			has_table;
+	int			table_buffered;	/* legacy table callbacks */
+};
 
 
 /* render • structure containing one particular render */
 struct render {
+	const struct mkd_compiled *rules;	/* tables, maybe shared */
 	struct mkd_renderer	make;
+	struct mkd_span_renderer span;		/* used where make has NULL */
 	struct array		refs;
-	char_trigger		active_char[256];
-	struct parray		work; };
+	int *			ref_slot;	/* open addressing on refs */
+	int			ref_slot_size;	/* (index + 1, 0 = empty) */
+	struct array		ref_lines;	/* offsets of refs not stored yet */
+	char *			ref_data;	/* their source, and its size */
+	size_t			ref_size;
+	size_t			ref_id_max;	/* bound of the id sizes */
+	struct parray		work;
+	struct parray		quote;		/* copies of blockquote contents */
+	struct array		spans;		/* stack of inline_frame */
+	struct array		frames;		/* stack of block_frame */
+	struct array		nest_map;	/* struct src_seg of frames */
+	struct inline_index	index;		/* of the current parse_inline */
+	struct buf *		flush_ob;	/* top-level output to flush */
+	size_t			flush_mark;	/* flush_ob high-water mark */
+	mkd_sink		flush;
+	void *			flush_opaque;
+	struct array *		blocks;		/* top-level doc_block, or 0 */
+	size_t			html_max;	/* longest HTML block, or 0 */
+	const struct mkd_budget *budget;	/* limits of the render, or 0 */
+	enum mkd_status		over;		/* limit reached, or MKD_OK */
+	unsigned long		steps;		/* spent from the budget */
+	struct buf *		out_ob;		/* output checked against it */
+	size_t			out_base;	/* its size before the render */
+	struct extract_state *	extract;	/* extraction results, or 0 */
+	struct array *		src_map;	/* struct src_seg, or 0 */
+	char *			src_text;	/* text it maps to the input */
+	size_t			src_size;
+	size_t			src_input;	/* size of the input */
+#ifdef MKD_PROFILE
+	struct mkd_stats	stats;		/* of the current rendering */
+#endif
+	struct arena		arena; };	/* memory freed after each document */
+
+
+/* PROFILE_ADD • adds n to a counter of rndr->stats, with MKD_PROFILE only */
+#ifdef MKD_PROFILE
+#define PROFILE_ADD(rndr, field, n) ((rndr)->stats.field += (n))
+#else
+#define PROFILE_ADD(rndr, field, n) ((void)0)
+#endif
+#define PROFILE_BLOCK(rndr, kind) PROFILE_ADD(rndr, blocks[kind], 1)
+
+#ifdef MKD_PROFILE
+/* last_stats • counters of the last rendering of the thread */
+static _Thread_local struct mkd_stats last_stats;
+#endif
+
+
+/* mkd_context • render structure kept alive between documents */
+struct mkd_context {
+	struct render	rndr;
+	struct mkd_compiled own;	/* tables of rndr, unless shared */
+	struct array	src_map;	/* storage of rndr.src_map */
+	struct buf *	text; };	/* copy of the input, minus references */
+
+
+/* mkd_stream • document rendered while its input is pushed */
+struct mkd_stream {
+	struct mkd_context	ctx;
+	struct buf *		in;	/* input not seen by parse_refs yet */
+	struct buf *		out;	/* output of the blocks being rendered */
+	mkd_sink		sink;
+	void *			opaque;
+	size_t			scan;	/* next line of text to look at */
+	size_t			cut;	/* last block boundary found, or 0 */
+	size_t			html_end; /* end of the known HTML blocks */
+	size_t			html_beg; /* HTML block waiting for its end */
+	size_t			html_seen; /* where its search resumes, or 0 */
+	int			blank;	/* whether the line before scan is blank */
+	int			started; /* whether the prolog has been sent */
+	int			emitted; /* whether anything has been sent */
+	char			last; };	/* last byte sent */
+
+
+/* doc_block • top-level block of a document, with its rendered output */
+struct doc_block {
+	size_t	beg;	/* offsets in the text */
+	size_t	end;
+	size_t	dep;	/* end of the text read to parse it, 0 for unknown */
+	size_t	out;	/* offsets in the output */
+	size_t	out_end; };
+
+
+/* mkd_document • document re-rendered after edits, block by block */
+struct mkd_document {
+	struct mkd_context	ctx;
+	struct buf *		text;	/* input without references */
+	struct buf *		out;	/* seed, prolog, blocks and epilog */
+	struct buf *		refs;	/* serialized reference definitions */
+	struct array		blocks;
+	struct buf *		old_text;	/* same, for the previous render */
+	struct buf *		old_out;
+	struct buf *		old_refs;
+	struct array		old_blocks;
+	int			valid;	/* whether the old fields can be used */
+	int			seeded;	/* whether out begins with a seed */
+	char			seed; };
+
+
+/* parallel_job • document chunks shared between rendering threads */
+struct parallel_job {
+	struct render *	rndr;		/* read-only model of the workers */
+	char *		data;
+	size_t		size;
+	size_t *	split;		/* nb + 1 chunk boundaries */
+	size_t *	reached;	/* actual end of each chunk parse */
+	struct buf **	out;		/* seeded output of each chunk */
+	int		seed_first;	/* whether chunk 0 is seeded */
+	char		seed;		/* its seed byte */
+	int		nb;
+	int		next;		/* first chunk not taken yet */
+#ifndef MKD_NO_THREADS
+	pthread_mutex_t	lock;
+#endif
+#ifdef MKD_PROFILE
+	struct mkd_stats stats;		/* merged from the workers */
+#endif
+};
+
+/* JOB_LOCK, JOB_UNLOCK • lock of the job, when there are threads */
+#ifndef MKD_NO_THREADS
+#define JOB_LOCK(job) pthread_mutex_lock(&(job)->lock)
+#define JOB_UNLOCK(job) pthread_mutex_unlock(&(job)->lock)
+#else
+#define JOB_LOCK(job) ((void)0)
+#define JOB_UNLOCK(job) ((void)0)
+#endif
 
 
 /* html_tag • structure for quick HTML tag search (inspired from discount) */
@@ -70,7 +380,7 @@ struct html_tag {
  * GLOBAL VARIABLES *
  ********************/
 
-/* block_tags • recognised block tags, sorted by cmp_html_tag */
+/* block_tags • recognised block tags, indexed by find_block_tag */
 static struct html_tag block_tags[] = {
 /*0*/	{ "p",		1 },
 	{ "dl",		2 },
@@ -105,8 +415,9 @@ static struct html_tag block_tags[] = {
  ***************************/
 
 /* build_ref_id • collapse whitespace from input text to make it a ref id */
+/*	fails as soon as the id grows over max bytes */
 static int
-build_ref_id(struct buf *id, const char *data, size_t size) {
+build_ref_id(struct buf *id, const char *data, size_t size, size_t max) {
 	size_t beg, i;
 
 	/* skip leading whitespace */
@@ -129,8 +440,9 @@ build_ref_id(struct buf *id, const char *data, size_t size) {
 		/* copy non-whitespace into the output buffer */
 		beg = i;
 		while (i < size
-		&& !(data[i] == ' ' || data[i] == '\t' || data[i] == '\n'))
-			i += 1;
+		&& !(data[i] == ' ' || data[i] == '\t' || data[i] == '\n')) {
+			if (id->size + (i - beg) >= max) return -1;
+			i += 1; }
 		bufput(id, data + beg, i - beg);
 
 		/* add a single space and skip all consecutive whitespace */
@@ -141,35 +453,68 @@ build_ref_id(struct buf *id, const char *data, size_t size) {
 	return 0; }
 
 
-/* cmp_link_ref • comparison function for link_ref sorted arrays */
-static int
-cmp_link_ref(void *key, void *array_entry) {
-	struct link_ref *lr = array_entry;
-	return bufcasecmp(key, lr->id); }
-
-
-/* cmp_link_ref_sort • comparison function for link_ref qsort */
-static int
-cmp_link_ref_sort(const void *a, const void *b) {
-	const struct link_ref *lra = a;
-	const struct link_ref *lrb = b;
-	return bufcasecmp(lra->id, lrb->id); }
+/* ref_hash • case-insensitive hash of a ref id (FNV-1a on lower case) */
+static unsigned
+ref_hash(const char *data, size_t size) {
+	unsigned h = 2166136261u;
+	size_t i;
+	for (i = 0; i < size; i += 1) {
+		unsigned char c = data[i];
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		h = (h ^ c) * 16777619u; }
+	return h; }
+
+
+/* find_link_ref • looks up a ref id in the hash table */
+static struct link_ref *
+find_link_ref(struct render *rndr, struct buf *id, unsigned hash) {
+	struct link_ref *lr = rndr->refs.base;
+	int mask = rndr->ref_slot_size - 1, i, slot;
+	if (!rndr->ref_slot_size) return 0;
+	for (i = hash & mask; (slot = rndr->ref_slot[i]) != 0;
+						i = (i + 1) & mask)
+		if (lr[slot - 1].hash == hash
+		&& bufcasecmp(lr[slot - 1].id, id) == 0)
+			return lr + slot - 1;
+	return 0; }
 
 
-/* cmp_html_tag • comparison function for bsearch() (stolen from discount) */
-static int
-cmp_html_tag(const void *a, const void *b) {
-	const struct html_tag *hta = a;
-	const struct html_tag *htb = b;
-	if (hta->size != htb->size) return hta->size - htb->size;
-	return strncasecmp(hta->text, htb->text, hta->size); }
+/* index_link_ref • inserts the last ref into the hash table */
+/*	the table is kept at most half full, rebuilding it when needed */
+static void
+index_link_ref(struct render *rndr) {
+	struct link_ref *lr = rndr->refs.base;
+	int n = rndr->refs.size, mask, i, j, *neo;
+
+	if (n * 2 > rndr->ref_slot_size) {
+		int neosz = rndr->ref_slot_size ? rndr->ref_slot_size * 2
+						: REF_SLOTS;
+		while (n * 2 > neosz) neosz *= 2;
+		neo = realloc(rndr->ref_slot, neosz * sizeof *neo);
+		if (!neo) {
+			rndr->refs.size -= 1;
+			return; }
+		rndr->ref_slot = neo;
+		rndr->ref_slot_size = neosz;
+		memset(neo, 0, neosz * sizeof *neo);
+		j = 0; }
+	else j = n - 1;
+
+	/* (re)inserting every ref not yet in the table */
+	mask = rndr->ref_slot_size - 1;
+	for (; j < n; j += 1) {
+		for (i = lr[j].hash & mask; rndr->ref_slot[i];
+						i = (i + 1) & mask);
+		rndr->ref_slot[i] = j + 1; } }
 
 
 /* find_block_tag • returns the current block tag */
+/*	the only candidate is found from the length and the first letters */
+/*	of the name, and then compared as a whole */
 static struct html_tag *
 find_block_tag(char *data, size_t size) {
 	size_t i = 0;
-	struct html_tag key;
+	struct html_tag *tag = 0;
 
 	/* looking for the word end */
 	while (i < size && ((data[i] >= '0' && data[i] <= '9')
@@ -178,12 +523,55 @@ find_block_tag(char *data, size_t size) {
 		i += 1;
 	if (i >= size) return 0;
 
-	/* binary search of the tag */
-	key.text = data;
-	key.size = i;
-	return bsearch(&key, block_tags,
-				sizeof block_tags / sizeof block_tags[0],
-				sizeof block_tags[0], cmp_html_tag); }
+	/* dispatch on the indexes of block_tags */
+	switch (i) {
+	    case 1: tag = block_tags; break;
+	    case 2:
+		switch (data[0] | 0x20) {
+		    case 'd': tag = block_tags + 1; break;
+		    case 'h':
+			if (data[1] >= '1' && data[1] <= '6')
+				tag = block_tags + 2 + (data[1] - '1');
+			break;
+		    case 'o': tag = block_tags + 8; break;
+		    case 'u': tag = block_tags + 9; break; }
+		break;
+	    case 3:
+		switch (data[0] | 0x20) {
+		    case 'd':
+			tag = ((data[1] | 0x20) == 'e') ? DEL_TAG
+							: block_tags + 11;
+			break;
+		    case 'i': tag = INS_TAG; break;
+		    case 'p': tag = block_tags + 13; break; }
+		break;
+	    case 4:
+		switch (data[0] | 0x20) {
+		    case 'f': tag = block_tags + 14; break;
+		    case 'm': tag = block_tags + 15; break; }
+		break;
+	    case 5: tag = block_tags + 16; break;
+	    case 6:
+		switch (data[0] | 0x20) {
+		    case 'i': tag = block_tags + 17; break;
+		    case 's': tag = block_tags + 18; break; }
+		break;
+	    case 8:
+		switch (data[0] | 0x20) {
+		    case 'f': tag = block_tags + 19; break;
+		    case 'n': tag = block_tags + 20; break; }
+		break;
+	    case 10: tag = block_tags + 21; break; }
+	return (tag && strncasecmp(data, tag->text, i) == 0) ? tag : 0; }
+
+
+/* line_end • returns the offset just after the end of the line at beg */
+static size_t
+line_end(char *data, size_t beg, size_t size) {
+	char *nl;
+	if (beg >= size) return size;
+	nl = memchr(data + beg, '\n', size - beg);
+	return nl ? (size_t)(nl - data) + 1 : size; }
 
 
 /* new_work_buffer • get a new working buffer from the stack or create one */
@@ -196,7 +584,12 @@ new_work_buffer(struct render *rndr) {
 		ret->size = 0; }
 	else {
 		ret = bufnew(WORK_UNIT);
+		bufsetgrowth(ret, GROWTH, 0);
 		parr_push(&rndr->work, ret); }
+#ifdef MKD_PROFILE
+	if (rndr->work.size > rndr->stats.work_peak)
+		rndr->stats.work_peak = rndr->work.size;
+#endif
 	return ret; }
 
 
@@ -208,11 +601,471 @@ release_work_buffer(struct render *rndr, struct buf *buf) {
 	rndr->work.size -= 1; }
 
 
+/* new_quote_buffer • get a buffer for the contents of a blockquote */
+/*	kept apart from the work stack, so that it does not count in its depth */
+static struct buf *
+new_quote_buffer(struct render *rndr) {
+	struct buf *ret = 0;
+
+	if (rndr->quote.size < rndr->quote.asize) {
+		ret = rndr->quote.item[rndr->quote.size ++];
+		ret->size = 0; }
+	else {
+		ret = bufnew(WORK_UNIT);
+		bufsetgrowth(ret, GROWTH, 0);
+		parr_push(&rndr->quote, ret); }
+	return ret; }
+
+
+/* release_quote_buffer • release the given blockquote buffer */
+static void
+release_quote_buffer(struct render *rndr, struct buf *buf) {
+	assert(rndr->quote.size > 0
+	&& rndr->quote.item[rndr->quote.size - 1] == buf);
+	rndr->quote.size -= 1; }
+
+
+/* render_memory • bytes held by the buffers and the arena of a render */
+static size_t
+render_memory(struct render *rndr) {
+	size_t ret = arena_size(&rndr->arena) + rndr->out_ob->asize;
+	int i;
+	for (i = 0; i < rndr->work.asize; i += 1)
+		ret += ((struct buf *)rndr->work.item[i])->asize;
+	for (i = 0; i < rndr->quote.asize; i += 1)
+		ret += ((struct buf *)rndr->quote.item[i])->asize;
+	return ret; }
+
+
+/* budget_step • spends one step, returns whether the budget still holds */
+static int BUDGET_SLOW
+budget_step(struct render *rndr) {
+	const struct mkd_budget *budget = rndr->budget;
+
+	if (rndr->over != MKD_OK) return 0;
+	rndr->steps += 1;
+	if (budget->max_steps && rndr->steps > budget->max_steps)
+		rndr->over = MKD_STEP_LIMIT;
+	else if (budget->max_output
+	&& rndr->out_ob->size - rndr->out_base > budget->max_output)
+		rndr->over = MKD_OUTPUT_LIMIT;
+	else if (budget->max_memory && rndr->steps % BUDGET_CHECK == 0
+	&& render_memory(rndr) > budget->max_memory)
+		rndr->over = MKD_MEMORY_LIMIT;
+	return rndr->over == MKD_OK; }
+
+
+/* seg_add • records that text from off is copied from input in map */
+/*	segments before first belong to another text and are left alone */
+static void
+seg_add(struct array *map, size_t first, size_t off, size_t input) {
+	struct src_seg *seg;
+
+	if (map->size > first) {
+		seg = arr_item(map, map->size - 1);
+		if (off - seg->text == input - seg->input) return;
+		if (off == seg->text) {
+			seg->input = input;
+			return; } }
+	if ((seg = arr_push(map)) == 0) return;
+	seg->text = off;
+	seg->input = input; }
+
+
+/* source_add • records that text from offset off is copied from input */
+static void
+source_add(struct render *rndr, size_t off, size_t input) {
+	if (rndr->src_map) seg_add(rndr->src_map, 0, off, input); }
+
+
+/* nest_add • records that contents from off are copied from text at from */
+/*	first is the first segment of the contents in nest_map */
+static void
+nest_add(struct render *rndr, size_t first, size_t off, size_t from) {
+	if (rndr->src_map) seg_add(&rndr->nest_map, first, off, from); }
+
+
+/* seg_offset • offset in the original of an offset in a copy */
+/*	the end of a range is that of its last byte, so that text removed */
+/*	after it is not included */
+static size_t
+seg_offset(const struct src_seg *seg, size_t n, size_t off, int end) {
+	size_t lo = 0, hi = n, mid, key = (end && off) ? off - 1 : off;
+
+	if (!n) return off;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (seg[mid].text <= key) lo = mid;
+		else hi = mid; }
+	if (key < seg[lo].text) return seg[lo].input;
+	return seg[lo].input + (key - seg[lo].text) + (end && off); }
+
+
+/* source_offset • input offset of an offset in the text */
+static size_t
+source_offset(struct render *rndr, size_t off, int end) {
+	struct array *map = rndr->src_map;
+	return map ? seg_offset(map->base, map->size, off, end) : off; }
+
+
+/* source_range • input range of data seen by the parser */
+/*	data copied out of the text for a blockquote or a list item is taken */
+/*	back through the segments of each copy, innermost first */
+static void
+source_range(struct render *rndr, const char *data, size_t size,
+					size_t *beg, size_t *end) {
+	const char *text = rndr->src_text;
+	struct block_frame *frame = 0;
+	struct src_seg *seg;
+	size_t b = 0, e = 0, n;
+	int i = rndr->frames.size - 1;
+
+	while (data && (data < text || data > text + rndr->src_size)) {
+		for (; i >= 0; i -= 1) {
+			frame = arr_item(&rndr->frames, i);
+			if (frame->from && data >= frame->work->data
+			&& data <= frame->work->data + frame->work->size)
+				break; }
+		if (i < 0) {
+			data = 0;
+			break; }
+		seg = (struct src_seg *)rndr->nest_map.base + frame->map_beg;
+		n = frame->map_end - frame->map_beg;
+		b = data - frame->work->data;
+		e = seg_offset(seg, n, b + size, 1);
+		b = seg_offset(seg, n, b, 0);
+		data = frame->from + b;
+		size = e > b ? e - b : 0;
+		i -= 1; }
+	if (data) {
+		b = data - text;
+		e = b + size; }
+	if (e > rndr->src_size) e = rndr->src_size;
+	*beg = source_offset(rndr, b, 0);
+	if (!end) return;
+	*end = source_offset(rndr, e, 1);
+	if (*end > rndr->src_input) *end = rndr->src_input;
+	if (*beg > *end) *beg = *end; }
+
+
+/* block_source • hands the input range of a block to block_source */
+static void
+block_source(struct render *rndr, struct buf *ob, enum mkd_block kind,
+					const char *data, size_t size) {
+	size_t beg, end;
+	if (!MAKE(rndr)->block_source || !rndr->src_map) return;
+	source_range(rndr, data, size, &beg, &end);
+	MAKE(rndr)->block_source(ob, kind, beg, end, rndr->make.opaque); }
+
+
+/* extract_slice • copies data into the text of an extraction */
+static struct mkd_slice
+extract_slice(struct extract_state *ex, const char *data, size_t size) {
+	struct mkd_slice ret;
+	ret.offset = ex->text->size;
+	ret.size = size;
+	if (size) bufput(ex->text, data, size);
+	if (ex->text->size != ret.offset + size) ex->failed = 1;
+	return ret; }
+
+
+/* extract_heading • records a header, beginning at org */
+static void
+extract_heading(struct render *rndr, int level, const char *org,
+					const char *data, size_t size) {
+	struct extract_state *ex = rndr->extract;
+	struct mkd_heading *h = arr_push(&ex->heading);
+
+	if (!h) {
+		ex->failed = 1;
+		return; }
+	h->level = level;
+	source_range(rndr, org, 0, &h->offset, 0);
+	h->text = extract_slice(ex, data, size); }
+
+
+/* extract_link • records a link, image or autolink beginning at org */
+static void
+extract_link(struct render *rndr, int flags, const char *org,
+		const char *link, size_t link_size, const char *title,
+		size_t title_size, const char *data, size_t size) {
+	struct extract_state *ex = rndr->extract;
+	struct mkd_link *l = arr_push(&ex->link);
+
+	if (!l) {
+		ex->failed = 1;
+		return; }
+	l->flags = flags;
+	source_range(rndr, org, 0, &l->offset, 0);
+	l->link = extract_slice(ex, link, link_size);
+	l->title = extract_slice(ex, title, title_size);
+	l->text = extract_slice(ex, data, size); }
+
+
+/* extract_none • returns whether inline data has no link to extract */
+static int
+extract_none(const char *data, size_t size) {
+	struct scan_set set;
+	scan_set_init(&set);
+	scan_set_add(&set, '[');
+	scan_set_add(&set, '<');
+	return scan_find(&set, data, size) >= size; }
+
+
 
 /****************************
  * INLINE PARSING FUNCTIONS *
  ****************************/
 
+/* index_init • initialization of empty indexes */
+static void
+index_init(struct inline_index *idx) {
+	memset(idx, 0, sizeof *idx);
+	arr_init(&idx->stack, sizeof (unsigned)); }
+
+
+/* index_free • frees the memory of the indexes */
+static void
+index_free(struct inline_index *idx) {
+	free(idx->match);
+	free(idx->mark);
+	arr_free(&idx->stack);
+	index_init(idx); }
+
+
+/* index_reset • forgets the indexes, before parsing another root span */
+static void
+index_reset(struct inline_index *idx, char *data, size_t size) {
+	int i;
+	idx->root = (size < UINT_MAX) ? data : 0;
+	idx->size = size;
+	for (i = 0; i < MEMO_NB; i += 1)
+		idx->memo[i].end = 0;
+	idx->has_match = 0;
+	idx->has_mark = 0; }
+
+
+/* next_char • offset of the next char of the memo slot from beg, or size */
+static size_t
+next_char(struct render *rndr, char *data, size_t beg, size_t size,
+					enum memo_slot slot) {
+	static const char chars[] = "[]()>";
+	struct scan_memo *memo = rndr->index.memo + slot;
+	char *p = data + beg, *end = data + size;
+
+	if (beg >= size) return size;
+	if (memo->end == end && memo->from <= p && p <= memo->at)
+		return memo->at - data;
+	while ((p = memchr(p, chars[slot], end - p)) != 0
+	&& slot == MEMO_RPAREN && p[-1] == '\\')
+		p += 1;
+	if (!p) p = end;
+	memo->from = data + beg;
+	memo->at = p;
+	memo->end = end;
+	return p - data; }
+
+
+/* first_char • offset of the first c in data[beg..end), or 0 */
+static size_t
+first_char(char *data, size_t beg, size_t end, char c) {
+	char *p = (beg < end) ? memchr(data + beg, c, end - beg) : 0;
+	return p ? p - data : 0; }
+
+
+/* tick_close • end of the first run of at least nb backticks from beg */
+/*	returns 0 when there is none; data[beg] must not be a backtick */
+static size_t
+tick_close(struct render *rndr, char *data, size_t beg, size_t size,
+					size_t nb) {
+	struct scan_memo *memo = 0;
+	char *p = data + beg, *q, *end = data + size;
+
+	if (beg >= size) return 0;
+	if (nb <= MEMO_TICKS) {
+		memo = rndr->index.memo + MEMO_TICK + nb - 1;
+		if (memo->end == end && memo->from <= p && p <= memo->at)
+			return memo->at < end ? memo->at + nb - data : 0; }
+	while ((p = memchr(p, '`', end - p)) != 0) {
+		for (q = p; q < end && *q == '`'; q += 1);
+		if (q - p >= nb) break;
+		p = q; }
+	if (!p) p = end;
+	if (memo) {
+		memo->from = data + beg;
+		memo->at = p;
+		memo->end = end; }
+	return p < end ? p + nb - data : 0; }
+
+
+/* index_match • pairs every '[' of the root span with its ']' */
+/*	escaped '[' are not paired, as they may still open a link */
+static int
+index_match(struct inline_index *idx) {
+	struct scan_set set;
+	char *data = idx->root;
+	size_t i, size = idx->size;
+	unsigned *open;
+	int base = idx->stack.size;
+
+	if (idx->match_size < size) {
+		unsigned *match = realloc(idx->match, size * sizeof *match);
+		if (!match) return 0;
+		idx->match = match;
+		idx->match_size = size; }
+	scan_set_init(&set);
+	scan_set_add(&set, '[');
+	scan_set_add(&set, ']');
+	for (i = 0; (i += scan_find(&set, data + i, size - i)) < size;
+								i += 1)
+		if (i && data[i - 1] == '\\') {
+			if (data[i] == '[') idx->match[i] = UINT_MAX; }
+		else if (data[i] == '[') {
+			idx->match[i] = 0;
+			if ((open = arr_push(&idx->stack)) == 0) {
+				idx->stack.size = base;
+				return 0; }
+			*open = i; }
+		else if (idx->stack.size > base) {
+			open = arr_item(&idx->stack, idx->stack.size - 1);
+			idx->match[*open] = i + 1;
+			idx->stack.size -= 1; }
+	idx->stack.size = base;
+	idx->has_match = 1;
+	return 1; }
+
+
+/* bracket_close • offset of the ']' closing the '[' at data, or 0 */
+/*	the span is only indexed once a scan goes over MATCH_SCAN chars */
+static size_t
+bracket_close(struct render *rndr, char *data, size_t size) {
+	struct inline_index *idx = &rndr->index;
+	size_t i = 1, off, scan = size;
+	unsigned match;
+	int level = 1, indexed;
+
+	indexed = (idx->root && data >= idx->root
+				&& data < idx->root + idx->size);
+	if (indexed && !idx->has_match && size > MATCH_SCAN)
+		scan = MATCH_SCAN;
+	if (!indexed || !idx->has_match) {
+		for (; i < scan; i += 1)
+			if (data[i - 1] == '\\') continue;
+			else if (data[i] == '[') level += 1;
+			else if (data[i] == ']') {
+				level -= 1;
+				if (level <= 0) return i; }
+		if (scan >= size) return 0; }
+
+	if (idx->has_match || index_match(idx)) {
+		off = data - idx->root;
+		match = idx->match[off];
+		if (match != UINT_MAX) {
+			if (!match || match - 1 - off >= size) return 0;
+			return match - 1 - off; } }
+
+	/* resuming the scan without index */
+	for (; i < size; i += 1)
+		if (data[i - 1] == '\\') continue;
+		else if (data[i] == '[') level += 1;
+		else if (data[i] == ']') {
+			level -= 1;
+			if (level <= 0) return i; }
+	return 0; }
+
+
+/* emph_begin • starts an emphasis scan, returning the base of its landings */
+static int
+emph_begin(struct render *rndr) {
+	rndr->index.landings = 0;
+	return rndr->index.stack.size; }
+
+
+/* emph_landing • records a position examined by an emphasis scan */
+/*	returns whether the scan is already known to fail from there; the */
+/*	first landings are not recorded, short scans being cheap enough */
+static int
+emph_landing(struct render *rndr, char *data, char *end, char c, int kind) {
+	struct inline_index *idx = &rndr->index;
+	struct emph_mark *mark;
+	unsigned *landing;
+
+	if (idx->landings < EMPH_SCAN) {
+		idx->landings += 1;
+		return 0; }
+	if (!idx->root || data < idx->root || end > idx->root + idx->size)
+		return 0;
+	if (idx->has_mark) {
+		mark = idx->mark + (data - idx->root);
+		if (mark->end == end - idx->root && mark->c == c
+		&& (mark->kinds & kind))
+			return 1; }
+	if ((landing = arr_push(&idx->stack)) != 0)
+		*landing = data - idx->root;
+	return 0; }
+
+
+/* emph_end • ends an emphasis scan, whose landings are above base */
+/*	landings of a failed scan are marked, as scans going through any */
+/*	of them reach the same end */
+static void
+emph_end(struct render *rndr, int base, char *end, char c, int kind,
+					int failed) {
+	struct inline_index *idx = &rndr->index;
+	struct emph_mark *mark;
+	unsigned *landing;
+	int i;
+
+	if (failed && idx->stack.size > base && !idx->has_mark) {
+		if (idx->mark_size < idx->size) {
+			mark = realloc(idx->mark, idx->size * sizeof *mark);
+			if (mark) {
+				idx->mark = mark;
+				idx->mark_size = idx->size; } }
+		if (idx->mark_size >= idx->size) {
+			memset(idx->mark, 0, idx->size * sizeof *idx->mark);
+			idx->has_mark = 1; } }
+	if (failed && idx->has_mark)
+		for (i = base; i < idx->stack.size; i += 1) {
+			landing = arr_item(&idx->stack, i);
+			mark = idx->mark + *landing;
+			if (mark->end != end - idx->root || mark->c != c) {
+				mark->end = end - idx->root;
+				mark->c = c;
+				mark->kinds = 0; }
+			mark->kinds |= kind; }
+	idx->stack.size = base; }
+
+
+/* put_text • renders a run of normal text taken from the input */
+static void
+put_text(struct buf *ob, struct render *rndr, char *data, size_t size) {
+	if (SPAN(rndr)->normal_text)
+		SPAN(rndr)->normal_text(ob, data, size, rndr->make.opaque);
+	else if (MAKE(rndr)->normal_text) {
+		struct buf work = { data, size, 0, 0, 0 };
+		MAKE(rndr)->normal_text(ob, &work, rndr->make.opaque); }
+	else bufput(ob, data, size); }
+
+
+/* budget_rest • outputs the part of the input left over by a limit */
+/*	as text, cut to the room left under max_output before escaping */
+static void BUDGET_SLOW
+budget_rest(struct buf *ob, struct render *rndr, char *data, size_t size) {
+	size_t used, max = rndr->budget->max_output;
+	int i;
+
+	if (rndr->over == MKD_OUTPUT_LIMIT) return;
+	if (max) {
+		/* counting the output of the open blocks and spans */
+		used = rndr->out_ob->size - rndr->out_base;
+		for (i = 0; i < rndr->work.size; i += 1)
+			used += ((struct buf *)rndr->work.item[i])->size;
+		if (used >= max) return;
+		if (size > max - used) size = max - used; }
+	if (size) put_text(ob, rndr, data, size); }
+
+
 /* is_mail_autolink • looks for the address part of a mail autolink and '>' */
 /* this is less strict than the original markdown e-mail address matching */
 static size_t
@@ -232,7 +1085,8 @@ is_mail_autolink(char *data, size_t size) {
 
 /* tag_length • returns the length of the given tag, or 0 if it's not valid */
 static size_t
-tag_length(char *data, size_t size, enum mkd_autolink *autolink) {
+tag_length(struct render *rndr, char *data, size_t size,
+					enum mkd_autolink *autolink) {
 	size_t i, j;
 
 	/* a valid tag can't be shorter than 3 chars */
@@ -276,55 +1130,177 @@ tag_length(char *data, size_t size, enum mkd_autolink *autolink) {
 		return i + j; }
 
 	/* looking for something like a tag end */
-	while (i < size && data[i] != '>') i += 1;
+	i = next_char(rndr, data, i, size, MEMO_RANGLE);
 	if (i >= size) return 0;
 	return i + 1; }
 
 
-/* parse_inline • parses inline markdown elements */
-static void
-parse_inline(struct buf *ob, struct render *rndr, char *data, size_t size) {
-	size_t i = 0, end = 0;
-	char_trigger action = 0;
-	struct buf work = { 0, 0, 0, 0, 0 };
+#ifdef MKD_PROFILE
+/* trigger_kind • counter of mkd_stats.triggers for an active char */
+static enum mkd_trigger
+trigger_kind(char c) {
+	switch (c) {
+	case '\n':	return MKD_TRIGGER_LINEBREAK;
+	case '`':	return MKD_TRIGGER_CODESPAN;
+	case '[':	return MKD_TRIGGER_LINK;
+	case '<':	return MKD_TRIGGER_LANGLE;
+	case '\\':	return MKD_TRIGGER_ESCAPE;
+	case '&':	return MKD_TRIGGER_ENTITY;
+	default:	return MKD_TRIGGER_EMPHASIS; } }
+#endif
+
+
+/* inline_push • starts parsing the contents of a span */
+/*	too deep spans are copied verbatim; returns 0 when nothing is pushed */
+static int
+inline_push(struct render *rndr, struct buf *ob, char *data, size_t size,
+					const struct inline_span *span) {
+	struct inline_frame *frame;
 
 	if (rndr->work.size > rndr->make.max_work_stack) {
+		PROFILE_ADD(rndr, fallbacks, 1);
 		if (size) bufput(ob, data, size);
-		return; }
+		return 0; }
+	if ((frame = arr_push(&rndr->spans)) == 0) return 0;
+	frame->ob = ob;
+	frame->data = data;
+	frame->size = size;
+	frame->i = frame->end = 0;
+	frame->span = *span;
+	return 1; }
+
+
+/* span_close • renders a parsed span into the output of its parent */
+static void
+span_close(struct render *rndr, struct inline_frame *parent,
+					struct inline_span *span) {
+	struct buf *ob = parent->ob;
+	int r = 0;
+
+	switch (span->kind) {
+	    case SPAN_EMPH1:
+		r = MAKE(rndr)->emphasis(ob, span->work, span->c,
+						rndr->make.opaque);
+		break;
+	    case SPAN_EMPH2:
+		r = MAKE(rndr)->double_emphasis(ob, span->work, span->c,
+						rndr->make.opaque);
+		break;
+	    case SPAN_EMPH3:
+		r = MAKE(rndr)->triple_emphasis(ob, span->work, span->c,
+						rndr->make.opaque);
+		break;
+	    case SPAN_LINK:
+		r = MAKE(rndr)->link(ob, span->link, span->title, span->work,
+						rndr->make.opaque);
+		release_work_buffer(rndr, span->title);
+		release_work_buffer(rndr, span->link);
+		break;
+	    case SPAN_NONE:
+		break; }
+	release_work_buffer(rndr, span->work);
+
+	/* same as a trigger returning span->len, or 0 when refused */
+	if (r) {
+		parent->i += span->len;
+		parent->end = parent->i; }
+	else parent->end = parent->i + 1; }
+
+
+/* inline_run • parses a span until its end or a nested span */
+/*	returns 0 when a nested span has been pushed */
+static int
+inline_run(struct render *rndr, struct inline_frame *frame) {
+	struct buf *ob = frame->ob;
+	char *data = frame->data;
+	size_t size = frame->size, i = frame->i, end = frame->end;
+	char_trigger action = 0;
+	const struct mkd_compiled *rules = rndr->rules;
+	struct inline_span span;
 
 	while (i < size) {
 		/* copying inactive chars into the output */
-		while (end < size
-		&& (action = rndr->active_char[(unsigned char)data[end]]) == 0)
-			end += 1;
-		if (rndr->make.normal_text) {
-			work.data = data + i;
-			work.size = end - i;
-			rndr->make.normal_text(ob, &work, rndr->make.opaque); }
+		if (rules->active_scan) {
+			end += scan_find(&rules->active_set,
+						data + end, size - end);
+			if (end < size)
+				action = rules->active_char
+						[(unsigned char)data[end]]; }
 		else
-			bufput(ob, data + i, end - i);
+			while (end < size && (action = rules->active_char
+					[(unsigned char)data[end]]) == 0)
+				end += 1;
+		put_text(ob, rndr, data + i, end - i);
 		if (end >= size) break;
 		i = end;
+		if (!BUDGET_OK(rndr)) {
+			budget_rest(ob, rndr, data + i, size - i);
+			break; }
 
 		/* calling the trigger */
-		end = action(ob, rndr, data + i, i, size - i);
-		if (!end) /* no action from the callback */
+		span.kind = SPAN_NONE;
+		span.work = 0;
+		PROFILE_ADD(rndr, triggers[trigger_kind(data[i])], 1);
+		end = action(ob, rndr, data + i, i, size - i, &span);
+		if (span.kind != SPAN_NONE) {
+			/* the frame may move when the stack grows */
+			frame->i = i;
+			if (!span.work) span.work = new_work_buffer(rndr);
+			if (inline_push(rndr, span.work, span.data, span.size,
+								&span))
+				return 0;
+			frame = arr_item(&rndr->spans, rndr->spans.size - 1);
+			span_close(rndr, frame, &span);
+			i = frame->i;
+			end = frame->end; }
+		else if (!end) /* no action from the callback */
 			end = i + 1;
 		else {
 			i += end;
-			end = i; } } }
+			end = i; } }
+	return 1; }
+
+
+/* parse_inline • parses inline markdown elements */
+/*	nested spans are kept on an explicit stack instead of recursing */
+static void
+parse_inline(struct buf *ob, struct render *rndr, char *data, size_t size) {
+	struct inline_frame *frame, *parent;
+	struct inline_span none;
+	int base = rndr->spans.size;
+
+	/* extractions output nothing, and only look for links */
+	if (rndr->extract && base == 0 && extract_none(data, size)) return;
+	none.kind = SPAN_NONE;
+	if (base == 0) index_reset(&rndr->index, data, size);
+	if (!inline_push(rndr, ob, data, size, &none)) return;
+	while (rndr->spans.size > base) {
+		frame = arr_item(&rndr->spans, rndr->spans.size - 1);
+		if (!inline_run(rndr, frame)) continue;
+		rndr->spans.size -= 1;
+		if (rndr->spans.size > base) {
+			parent = arr_item(&rndr->spans, rndr->spans.size - 1);
+			span_close(rndr, parent, &frame->span); } } }
 
 
 /* find_emph_char • looks for the next emph char, skipping other constructs */
+/*	kind is the parse_emphn bit of the scan, cf emph_landing */
 static size_t
-find_emph_char(char *data, size_t size, char c) {
-	size_t i = 1;
+find_emph_char(struct render *rndr, char *data, size_t size, char c,
+					int kind) {
+	size_t i = 1, close;
+	struct scan_set set;
+
+	scan_set_init(&set);
+	scan_set_add(&set, c);
+	scan_set_add(&set, '`');
+	scan_set_add(&set, '[');
 
 	while (i < size) {
-		while (i < size && data[i] != c
-		&& data[i] != '`' && data[i] != '[')
-			i += 1;
+		i += scan_find(&set, data + i, size - i);
 		if (i >= size) return 0;
+		if (emph_landing(rndr, data + i, data + size, c, kind))
+			return 0;
 		if (data[i] == c) return i;
 
 		/* not counting escaped chars */
@@ -332,7 +1308,7 @@ find_emph_char(char *data, size_t size, char c) {
 
 		/* skipping a code span */
 		if (data[i] == '`') {
-			size_t span_nb = 0, bt;
+			size_t span_nb = 0;
 			size_t tmp_i = 0;
 
 			/* counting the number of opening backticks */
@@ -342,12 +1318,10 @@ find_emph_char(char *data, size_t size, char c) {
 			if (i >= size) return 0;
 
 			/* finding the matching closing sequence */
-			bt = 0;
-			while (i < size && bt < span_nb) {
-				if (!tmp_i && data[i] == c) tmp_i = i;
-				if (data[i] == '`') bt += 1;
-				else bt = 0;
-				i += 1; }
+			close = tick_close(rndr, data, i, size, span_nb);
+			if (!close) close = size;
+			tmp_i = first_char(data, i, close, c);
+			i = close;
 			if (i >= size) return tmp_i;
 			i += 1; }
 
@@ -356,10 +1330,9 @@ find_emph_char(char *data, size_t size, char c) {
 			size_t tmp_i = 0;
 			char cc;
 			i += 1;
-			while (i < size && data[i] != ']') {
-				if (!tmp_i && data[i] == c) tmp_i = i;
-				i += 1; }
-			i += 1;
+			close = next_char(rndr, data, i, size, MEMO_RBRACKET);
+			tmp_i = first_char(data, i, close, c);
+			i = close + 1;
 			while (i < size && (data[i] == ' '
 			|| data[i] == '\t' || data[i] == '\n'))
 				i += 1;
@@ -369,85 +1342,94 @@ find_emph_char(char *data, size_t size, char c) {
 				else continue; }
 			cc = data[i];
 			i += 1;
-			while (i < size && data[i] != cc) {
-				if (!tmp_i && data[i] == c) tmp_i = i;
-				i += 1; }
+			close = next_char(rndr, data, i, size,
+				cc == '[' ? MEMO_LBRACKET : MEMO_LPAREN);
+			if (!tmp_i) tmp_i = first_char(data, i, close, c);
+			i = close;
 			if (i >= size) return tmp_i;
 			i += 1; } }
 	return 0; }
 
 
+/* emph_span • describes an emphasis span of the given kind */
+static void
+emph_span(struct inline_span *span, enum span_kind kind, char c,
+					char *data, size_t size) {
+	span->kind = kind;
+	span->c = c;
+	span->data = data;
+	span->size = size; }
+
+
 /* parse_emph1 • parsing single emphasis */
 /* closed by a symbol not preceded by whitespace and not followed by symbol */
+/*	returns the span length, which is only taken if the callback agrees */
 static size_t
-parse_emph1(struct buf *ob, struct render *rndr,
-			char *data, size_t size, char c) {
+parse_emph1(struct render *rndr, char *data, size_t size, char c,
+					struct inline_span *span) {
 	size_t i = 0, len;
-	struct buf *work = 0;
-	int r;
+	int base = emph_begin(rndr);
 
-	if (!rndr->make.emphasis) return 0;
+	if (!MAKE(rndr)->emphasis) return 0;
 
 	/* skipping one symbol if coming from emph3 */
 	if (size > 1 && data[0] == c && data[1] == c) i = 1;
 
 	while (i < size) {
-		len = find_emph_char(data + i, size - i, c);
-		if (!len) return 0;
+		len = find_emph_char(rndr, data + i, size - i, c, 1);
+		if (!len) break;
 		i += len;
-		if (i >= size) return 0;
+		if (i >= size) break;
 
 		if (i + 1 < size && data[i + 1] == c) {
 			i += 1;
 			continue; }
 		if (data[i] == c && data[i - 1] != ' '
 		&& data[i - 1] != '\t' && data[i - 1] != '\n') {
-			work = new_work_buffer(rndr);
-			parse_inline(work, rndr, data, i);
-			r = rndr->make.emphasis(ob, work, c, rndr->make.opaque);
-			release_work_buffer(rndr, work);
-			return r ? i + 1 : 0; } }
+			emph_end(rndr, base, data + size, c, 1, 0);
+			emph_span(span, SPAN_EMPH1, c, data, i);
+			return i + 1; } }
+	emph_end(rndr, base, data + size, c, 1, 1);
 	return 0; }
 
 
 /* parse_emph2 • parsing single emphasis */
 static size_t
-parse_emph2(struct buf *ob, struct render *rndr,
-			char *data, size_t size, char c) {
+parse_emph2(struct render *rndr, char *data, size_t size, char c,
+					struct inline_span *span) {
 	size_t i = 0, len;
-	struct buf *work = 0;
-	int r;
+	int base = emph_begin(rndr);
 
-	if (!rndr->make.double_emphasis) return 0;
+	if (!MAKE(rndr)->double_emphasis) return 0;
 
 	while (i < size) {
-		len = find_emph_char(data + i, size - i, c);
-		if (!len) return 0;
+		len = find_emph_char(rndr, data + i, size - i, c, 2);
+		if (!len) break;
 		i += len;
 		if (i + 1 < size && data[i] == c && data[i + 1] == c
 		&& i && data[i - 1] != ' '
 		&& data[i - 1] != '\t' && data[i - 1] != '\n') {
-			work = new_work_buffer(rndr);
-			parse_inline(work, rndr, data, i);
-			r = rndr->make.double_emphasis(ob, work, c,
-				rndr->make.opaque);
-			release_work_buffer(rndr, work);
-			return r ? i + 2 : 0; }
+			emph_end(rndr, base, data + size, c, 2, 0);
+			emph_span(span, SPAN_EMPH2, c, data, i);
+			return i + 2; }
 		i += 1; }
+	emph_end(rndr, base, data + size, c, 2, 1);
 	return 0; }
 
 
 /* parse_emph3 • parsing single emphasis */
 /* finds the first closing tag, and delegates to the other emph */
+/*	only scans running out of data are marked as failed, delegated */
+/*	ones depend on where the emphasis begins */
 static size_t
-parse_emph3(struct buf *ob, struct render *rndr,
-			char *data, size_t size, char c) {
+parse_emph3(struct render *rndr, char *data, size_t size, char c,
+					struct inline_span *span) {
 	size_t i = 0, len;
-	int r;
+	int base = emph_begin(rndr);
 
 	while (i < size) {
-		len = find_emph_char(data + i, size - i, c);
-		if (!len) return 0;
+		len = find_emph_char(rndr, data + i, size - i, c, 4);
+		if (!len) break;
 		i += len;
 
 		/* skip whitespace preceded symbols */
@@ -455,78 +1437,77 @@ parse_emph3(struct buf *ob, struct render *rndr,
 		|| data[i - 1] == '\t' || data[i - 1] == '\n')
 			continue;
 
+		emph_end(rndr, base, data + size, c, 4, 0);
 		if (i + 2 < size && data[i + 1] == c && data[i + 2] == c
-		&& rndr->make.triple_emphasis) {
+		&& MAKE(rndr)->triple_emphasis) {
 			/* triple symbol found */
-			struct buf *work = new_work_buffer(rndr);
-			parse_inline(work, rndr, data, i);
-			r = rndr->make.triple_emphasis(ob, work, c,
-							rndr->make.opaque);
-			release_work_buffer(rndr, work);
-			return r ? i + 3 : 0; }
+			emph_span(span, SPAN_EMPH3, c, data, i);
+			return i + 3; }
 		else if (i + 1 < size && data[i + 1] == c) {
 			/* double symbol found, handing over to emph1 */
-			len = parse_emph1(ob, rndr, data - 2, size + 2, c);
+			len = parse_emph1(rndr, data - 2, size + 2, c, span);
 			if (!len) return 0;
 			else return len - 2; }
 		else {
 			/* single symbol found, handing over to emph2 */
-			len = parse_emph2(ob, rndr, data - 1, size + 1, c);
+			len = parse_emph2(rndr, data - 1, size + 1, c, span);
 			if (!len) return 0;
 			else return len - 1; } }
+	emph_end(rndr, base, data + size, c, 4, 1);
 	return 0; }
 
 
 /* char_emphasis • single and double emphasis parsing */
+/*	the contents are parsed by the caller, from the span description */
 static size_t
 char_emphasis(struct buf *ob, struct render *rndr,
-				char *data, size_t offset, size_t size) {
+		char *data, size_t offset, size_t size,
+		struct inline_span *span) {
 	char c = data[0];
 	size_t ret;
 	if (size > 2 && data[1] != c) {
 		/* whitespace cannot follow an opening emphasis */
 		if (data[1] == ' ' || data[1] == '\t' || data[1] == '\n'
-		|| (ret = parse_emph1(ob, rndr, data + 1, size - 1, c)) == 0)
+		|| (ret = parse_emph1(rndr, data + 1, size - 1, c, span)) == 0)
 			return 0;
-		return ret + 1; }
-	if (size > 3 && data[1] == c && data[2] != c) {
+		span->len = ret + 1; }
+	else if (size > 3 && data[1] == c && data[2] != c) {
 		if (data[2] == ' ' || data[2] == '\t' || data[2] == '\n'
-		|| (ret = parse_emph2(ob, rndr, data + 2, size - 2, c)) == 0)
+		|| (ret = parse_emph2(rndr, data + 2, size - 2, c, span)) == 0)
 			return 0;
-		return ret + 2; }
-	if (size > 4 && data[1] == c && data[2] == c && data[3] != c) {
+		span->len = ret + 2; }
+	else if (size > 4 && data[1] == c && data[2] == c && data[3] != c) {
 		if (data[3] == ' ' || data[3] == '\t' || data[3] == '\n'
-		|| (ret = parse_emph3(ob, rndr, data + 3, size - 3, c)) == 0)
+		|| (ret = parse_emph3(rndr, data + 3, size - 3, c, span)) == 0)
 			return 0;
-		return ret + 3; }
+		span->len = ret + 3; }
 	return 0; }
 
 
 /* char_linebreak • '\n' preceded by two spaces (assuming linebreak != 0) */
 static size_t
 char_linebreak(struct buf *ob, struct render *rndr,
-				char *data, size_t offset, size_t size) {
+		char *data, size_t offset, size_t size,
+		struct inline_span *span) {
 	if (offset < 2 || data[-1] != ' ' || data[-2] != ' ') return 0;
 	/* removing the last space from ob and rendering */
 	if (ob->size && ob->data[ob->size - 1] == ' ') ob->size -= 1;
-	return rndr->make.linebreak(ob, rndr->make.opaque) ? 1 : 0; }
+	return MAKE(rndr)->linebreak(ob, rndr->make.opaque) ? 1 : 0; }
 
 
 /* char_codespan • '`' parsing a code span (assuming codespan != 0) */
 static size_t
 char_codespan(struct buf *ob, struct render *rndr,
-				char *data, size_t offset, size_t size) {
-	size_t end, nb = 0, i, f_begin, f_end;
+		char *data, size_t offset, size_t size,
+		struct inline_span *span) {
+	size_t end, nb = 0, f_begin, f_end;
 
 	/* counting the number of backticks in the delimiter */
 	while (nb < size && data[nb] == '`') nb += 1;
 
 	/* finding the next delimiter */
-	i = 0;
-	for (end = nb; end < size && i < nb; end += 1)
-		if (data[end] == '`') i += 1;
-		else i = 0;
-	if (i < nb && end >= size) return 0; /* no matching delimiter */
+	end = tick_close(rndr, data, nb, size, nb);
+	if (!end) return 0; /* no matching delimiter */
 
 	/* trimming outside whitespaces */
 	f_begin = nb;
@@ -537,12 +1518,16 @@ char_codespan(struct buf *ob, struct render *rndr,
 		f_end -= 1;
 
 	/* real code span */
-	if (f_begin < f_end) {
+	if (SPAN(rndr)->codespan) {
+		if (!SPAN(rndr)->codespan(ob, data + f_begin,
+		    f_begin < f_end ? f_end - f_begin : 0, rndr->make.opaque))
+			end = 0; }
+	else if (f_begin < f_end) {
 		struct buf work = { data + f_begin, f_end - f_begin, 0, 0, 0 };
-		if (!rndr->make.codespan(ob, &work, rndr->make.opaque))
+		if (!MAKE(rndr)->codespan(ob, &work, rndr->make.opaque))
 			end = 0; }
 	else {
-		if (!rndr->make.codespan(ob, 0, rndr->make.opaque))
+		if (!MAKE(rndr)->codespan(ob, 0, rndr->make.opaque))
 			end = 0; }
 	return end; }
 
@@ -550,14 +1535,9 @@ char_codespan(struct buf *ob, struct render *rndr,
 /* char_escape • '\\' backslash escape */
 static size_t
 char_escape(struct buf *ob, struct render *rndr,
-				char *data, size_t offset, size_t size) {
-	struct buf work = { 0, 0, 0, 0, 0 };
-	if (size > 1) {
-		if (rndr->make.normal_text) {
-			work.data = data + 1;
-			work.size = 1;
-			rndr->make.normal_text(ob, &work, rndr->make.opaque); }
-		else bufputc(ob, data[1]); }
+		char *data, size_t offset, size_t size,
+		struct inline_span *span) {
+	if (size > 1) put_text(ob, rndr, data + 1, 1);
 	return 2; }
 
 
@@ -565,9 +1545,9 @@ char_escape(struct buf *ob, struct render *rndr,
 /* valid entities are assumed to be anything matching &#?[A-Za-z0-9]+; */
 static size_t
 char_entity(struct buf *ob, struct render *rndr,
-				char *data, size_t offset, size_t size) {
+		char *data, size_t offset, size_t size,
+		struct inline_span *span) {
 	size_t end = 1;
-	struct buf work;
 	if (end < size && data[end] == '#') end += 1;
 	while (end < size
 	&& ((data[end] >= '0' && data[end] <= '9')
@@ -580,10 +1560,11 @@ char_entity(struct buf *ob, struct render *rndr,
 	else {
 		/* lone '&' */
 		return 0; }
-	if (rndr->make.entity) {
-		work.data = data;
-		work.size = end;
-		rndr->make.entity(ob, &work, rndr->make.opaque); }
+	if (SPAN(rndr)->entity)
+		SPAN(rndr)->entity(ob, data, end, rndr->make.opaque);
+	else if (MAKE(rndr)->entity) {
+		struct buf work = { data, end, 0, 0, 0 };
+		MAKE(rndr)->entity(ob, &work, rndr->make.opaque); }
 	else bufput(ob, data, end);
 	return end; }
 
@@ -591,20 +1572,30 @@ char_entity(struct buf *ob, struct render *rndr,
 /* char_langle_tag • '<' when tags or autolinks are allowed */
 static size_t
 char_langle_tag(struct buf *ob, struct render *rndr,
-				char *data, size_t offset, size_t size) {
+		char *data, size_t offset, size_t size,
+		struct inline_span *span) {
 	enum mkd_autolink altype = MKDA_NOT_AUTOLINK;
-	size_t end = tag_length(data, size, &altype);
+	size_t end = tag_length(rndr, data, size, &altype);
 	struct buf work = { data, end, 0, 0, 0 };
 	int ret = 0;
-	if (end) {
-		if (rndr->make.autolink && altype != MKDA_NOT_AUTOLINK) {
-			work.data = data + 1;
-			work.size = end - 2;
-			ret = rndr->make.autolink(ob, &work, altype,
-							rndr->make.opaque); }
-		else if (rndr->make.raw_html_tag)
-			ret = rndr->make.raw_html_tag(ob, &work,
-							rndr->make.opaque); }
+	if (!end) return 0;
+	if (rndr->extract && altype != MKDA_NOT_AUTOLINK
+	&& (MAKE(rndr)->autolink || SPAN(rndr)->autolink))
+		extract_link(rndr, MKD_LINK_AUTO, data, data + 1, end - 2,
+						0, 0, data + 1, end - 2);
+	if (altype != MKDA_NOT_AUTOLINK && SPAN(rndr)->autolink)
+		ret = SPAN(rndr)->autolink(ob, data + 1, end - 2, altype,
+						rndr->make.opaque);
+	else if (altype != MKDA_NOT_AUTOLINK && MAKE(rndr)->autolink) {
+		work.data = data + 1;
+		work.size = end - 2;
+		ret = MAKE(rndr)->autolink(ob, &work, altype,
+						rndr->make.opaque); }
+	else if (SPAN(rndr)->raw_html_tag)
+		ret = SPAN(rndr)->raw_html_tag(ob, data, end,
+						rndr->make.opaque);
+	else if (MAKE(rndr)->raw_html_tag)
+		ret = MAKE(rndr)->raw_html_tag(ob, &work, rndr->make.opaque);
 	if (!ret) return 0;
 	else return end; }
 
@@ -673,6 +1664,11 @@ get_link_inline(struct buf *link, struct buf *title, char *data, size_t size) {
 	return 0; }
 
 
+/* resolve_refs • stores the references kept by a lazy first pass */
+static void
+resolve_refs(struct render *rndr);
+
+
 /* get_link_ref • extract referenced link and title from id */
 static int
 get_link_ref(struct render *rndr, struct buf *link, struct buf *title,
@@ -680,10 +1676,13 @@ get_link_ref(struct render *rndr, struct buf *link, struct buf *title,
 	struct link_ref *lr;
 
 	/* find the link from its id (stored temporarily in link) */
+	/*	ids are only built up to the longest defined one */
 	link->size = 0;
-	if (build_ref_id(link, data, size) < 0)
+	if ((!rndr->refs.size && !rndr->ref_lines.size)
+	|| build_ref_id(link, data, size, rndr->ref_id_max) < 0)
 		return -1;
-	lr = arr_sorted_find(&rndr->refs, link, cmp_link_ref);
+	if (rndr->ref_lines.size) resolve_refs(rndr);
+	lr = find_link_ref(rndr, link, ref_hash(link->data, link->size));
 	if (!lr) return -1;
 
 	/* fill the output buffers */
@@ -699,26 +1698,21 @@ get_link_ref(struct render *rndr, struct buf *link, struct buf *title,
 /* char_link • '[': parsing a link or an image */
 static size_t
 char_link(struct buf *ob, struct render *rndr,
-				char *data, size_t offset, size_t size) {
-	int is_img = (offset && data[-1] == '!'), level;
-	size_t i = 1, txt_e;
+		char *data, size_t offset, size_t size,
+		struct inline_span *span) {
+	int is_img = (offset && data[-1] == '!'), is_ref = 1;
+	size_t i, txt_e;
 	struct buf *content = 0;
 	struct buf *link = 0;
 	struct buf *title = 0;
 	int ret;
 
 	/* checking whether the correct renderer exists */
-	if ((is_img && !rndr->make.image) || (!is_img && !rndr->make.link))
+	if ((is_img && !MAKE(rndr)->image) || (!is_img && !MAKE(rndr)->link))
 		return 0;
 
 	/* looking for the matching closing bracket */
-	for (level = 1; i < size; i += 1)
-		if (data[i - 1] == '\\') continue;
-		else if (data[i] == '[') level += 1;
-		else if (data[i] == ']') {
-			level -= 1;
-			if (level <= 0) break; }
-	if (i >= size) return 0;
+	if ((i = bracket_close(rndr, data, size)) == 0) return 0;
 	txt_e = i;
 	i += 1;
 
@@ -736,25 +1730,21 @@ char_link(struct buf *ob, struct render *rndr,
 
 	/* inline style link */
 	if (i < size && data[i] == '(') {
-		size_t span_end = i;
-		while (span_end < size
-		&& !(data[span_end] == ')'
-		 && (span_end == i || data[span_end - 1] != '\\')))
-			span_end += 1;
+		size_t span_end = next_char(rndr, data, i, size, MEMO_RPAREN);
 
 		if (span_end >= size
 		|| get_link_inline(link, title,
 					data + i+1, span_end - (i+1)) < 0)
 			goto char_link_cleanup;
 
-		i = span_end + 1; }
+		i = span_end + 1;
+		is_ref = 0; }
 
 	/* reference style link */
 	else if (i < size && data[i] == '[') {
 		char *id_data;
-		size_t id_size, id_end = i;
-		while (id_end < size && data[id_end] != ']')
-			id_end += 1;
+		size_t id_size;
+		size_t id_end = next_char(rndr, data, i, size, MEMO_RBRACKET);
 
 		if (id_end >= size)
 			goto char_link_cleanup;
@@ -781,17 +1771,33 @@ char_link(struct buf *ob, struct render *rndr,
 		/* rewinding the whitespace */
 		i = txt_e + 1; }
 
+	if (rndr->extract)
+		extract_link(rndr, (is_img ? MKD_LINK_IMAGE : 0)
+			| (is_ref ? MKD_LINK_REF : 0), data - is_img,
+			link->data, link->size, title->data, title->size,
+			data + 1, txt_e - 1);
+
 	/* building content: img alt is escaped, link content is parsed */
+	/*	by the caller, which then calls the link callback */
 	if (txt_e > 1) {
 		if (is_img) bufput(content, data + 1, txt_e - 1);
-		else parse_inline(content, rndr, data + 1, txt_e - 1); }
+		else {
+			span->kind = SPAN_LINK;
+			span->data = data + 1;
+			span->size = txt_e - 1;
+			span->len = i;
+			span->work = content;
+			span->link = link;
+			span->title = title;
+			return 0; } }
 
 	/* calling the relevant rendering function */
 	if (is_img) {
 		if (ob->size && ob->data[ob->size - 1] == '!') ob->size -= 1;
-		ret = rndr->make.image(ob, link, title, content,
+		ret = MAKE(rndr)->image(ob, link, title, content,
 							rndr->make.opaque); }
-	else ret = rndr->make.link(ob, link, title, content, rndr->make.opaque);
+	else ret = MAKE(rndr)->link(ob, link, title, content,
+							rndr->make.opaque);
 
 	/* cleanup */
 char_link_cleanup:
@@ -872,9 +1878,12 @@ is_table_sep(char *data, size_t pos) {
 /* is_tableline • returns the number of column tables in the given line */
 static int
 is_tableline(char *data, size_t size) {
-	size_t i = 0;
+	size_t i = 0, end = line_end(data, 0, size);
 	int n_sep = 0, outer_sep = 0;
 
+	/* most lines have no pipe at all, found without a loop */
+	if (!memchr(data, '|', end)) return 0;
+
 	/* skip initial blanks */
 	while (i < size && (data[i] == ' ' || data[i] == '\t'))
 		i += 1;
@@ -953,23 +1962,53 @@ prefix_uli(char *data, size_t size) {
 	return i; }
 
 
-/* parse_block • parsing of one block, returning next char to parse */
-static void parse_block(struct buf *ob, struct render *rndr,
-			char *data, size_t size);
+/* block_push • pushes a new construct on the block stack */
+/*	the returned frame is only valid until the next push */
+static struct block_frame *
+block_push(struct render *rndr, enum frame_kind kind, struct buf *ob,
+					char *data, size_t size) {
+	struct block_frame *frame;
 
+	if ((frame = arr_push(&rndr->frames)) == 0) return 0;
+	memset(frame, 0, sizeof *frame);
+	frame->kind = kind;
+	frame->ob = ob;
+	frame->data = data;
+	frame->size = size;
+	return frame; }
 
-/* parse_blockquote • handles parsing of a blockquote fragment */
-static size_t
-parse_blockquote(struct buf *ob, struct render *rndr,
-			char *data, size_t size) {
-	size_t beg, end = 0, pre, work_size = 0;
-	char *work_data = 0;
+
+/* blocks_open • starts parsing a sequence of blocks */
+/*	too deep sequences are copied verbatim; returns 0 when nothing is pushed */
+static int
+blocks_open(struct render *rndr, struct buf *ob, char *data, size_t size,
+					size_t stop) {
+	struct block_frame *frame;
+
+	if (rndr->work.size > rndr->make.max_work_stack) {
+		PROFILE_ADD(rndr, fallbacks, 1);
+		if (stop) bufput(ob, data, stop);
+		return 0; }
+	if ((frame = block_push(rndr, FRAME_BLOCKS, ob, data, size)) == 0)
+		return 0;
+	frame->stop = stop;
+	return 1; }
+
+
+/* quote_open • gathers a blockquote fragment and pushes its frame */
+/*	returns 0 when nothing is pushed */
+static int
+quote_open(struct render *rndr, struct buf *ob, char *data, size_t size) {
+	size_t beg, end = 0, pre;
+	struct buf *work = new_quote_buffer(rndr);
 	struct buf *out = new_work_buffer(rndr);
+	struct block_frame *frame;
+	size_t map = rndr->nest_map.size;
 
+	PROFILE_BLOCK(rndr, MKD_BLOCK_BLOCKQUOTE);
 	beg = 0;
 	while (beg < size) {
-		for (end = beg + 1; end < size && data[end - 1] != '\n';
-							end += 1);
+		end = line_end(data, beg, size);
 		pre = prefix_quote(data + beg, end - beg);
 		if (pre) beg += pre; /* skipping prefix */
 		else if (is_empty(data + beg, end - beg)
@@ -977,21 +2016,24 @@ parse_blockquote(struct buf *ob, struct render *rndr,
 					&& !is_empty(data + end, size - end))))
 			/* empty line followed by non-quote line */
 			break;
-		if (beg < end) { /* copy into the in-place working buffer */
-			/* bufput(work, data + beg, end - beg); */
-			if (!work_data)
-				work_data = data + beg;
-			else if (data + beg != work_data + work_size)
-				memmove(work_data + work_size, data + beg,
-						end - beg);
-			work_size += end - beg; }
+		/* the source is left untouched, as other threads may read it */
+		if (beg < end) {
+			nest_add(rndr, map, work->size, beg);
+			bufput(work, data + beg, end - beg); }
 		beg = end; }
 
-	parse_block(out, rndr, work_data, work_size);
-	if (rndr->make.blockquote)
-		rndr->make.blockquote(ob, out, rndr->make.opaque);
-	release_work_buffer(rndr, out);
-	return end; }
+	if ((frame = block_push(rndr, FRAME_QUOTE, ob, data, size)) == 0) {
+		rndr->nest_map.size = map;
+		release_work_buffer(rndr, out);
+		release_quote_buffer(rndr, work);
+		return 0; }
+	frame->beg = end;
+	frame->work = work;
+	frame->out = out;
+	frame->from = data;
+	frame->map_beg = map;
+	frame->map_end = rndr->nest_map.size;
+	return 1; }
 
 
 /* parse_paragraph • handles parsing of a regular paragraph */
@@ -1002,9 +2044,9 @@ parse_paragraph(struct buf *ob, struct render *rndr,
 	int level = 0;
 	struct buf work = { data, 0, 0, 0, 0 }; /* volatile working buffer */
 
+	PROFILE_BLOCK(rndr, MKD_BLOCK_PARAGRAPH);
 	while (i < size) {
-		for (end = i + 1; end < size && data[end - 1] != '\n';
-								end += 1);
+		end = line_end(data, i, size);
 		if (is_empty(data + i, size - i)
 		|| (level = is_headerline(data + i, size - i)) != 0)
 			break;
@@ -1020,8 +2062,9 @@ parse_paragraph(struct buf *ob, struct render *rndr,
 	if (!level) {
 		struct buf *tmp = new_work_buffer(rndr);
 		parse_inline(tmp, rndr, work.data, work.size);
-		if (rndr->make.paragraph)
-			rndr->make.paragraph(ob, tmp, rndr->make.opaque);
+		if (MAKE(rndr)->paragraph) {
+			block_source(rndr, ob, MKD_BLOCK_PARAGRAPH, data, i);
+			MAKE(rndr)->paragraph(ob, tmp, rndr->make.opaque); }
 		release_work_buffer(rndr, tmp); }
 	else {
 		if (work.size) {
@@ -1036,17 +2079,24 @@ parse_paragraph(struct buf *ob, struct render *rndr,
 			if (work.size) {
 				struct buf *tmp = new_work_buffer(rndr);
 				parse_inline(tmp, rndr, work.data, work.size);
-				if (rndr->make.paragraph)
-					rndr->make.paragraph(ob, tmp,
-							rndr->make.opaque);
+				if (MAKE(rndr)->paragraph) {
+					block_source(rndr, ob,
+						MKD_BLOCK_PARAGRAPH, data, beg);
+					MAKE(rndr)->paragraph(ob, tmp,
+							rndr->make.opaque); }
 				release_work_buffer(rndr, tmp);
 				work.data += beg;
 				work.size = i - beg; }
 			else work.size = i; }
-		if (rndr->make.header) {
+		if (MAKE(rndr)->header) {
 			struct buf *span = new_work_buffer(rndr);
+			if (rndr->extract)
+				extract_heading(rndr, level, work.data,
+						work.data, work.size);
 			parse_inline(span, rndr, work.data, work.size);
-			rndr->make.header(ob, span, level,rndr->make.opaque);
+			block_source(rndr, ob, MKD_BLOCK_PARAGRAPH, work.data,
+						data + end - work.data);
+			MAKE(rndr)->header(ob, span, level,rndr->make.opaque);
 			release_work_buffer(rndr, span); } }
 	return end; }
 
@@ -1058,10 +2108,10 @@ parse_blockcode(struct buf *ob, struct render *rndr,
 	size_t beg, end, pre;
 	struct buf *work = new_work_buffer(rndr);
 
+	PROFILE_BLOCK(rndr, MKD_BLOCK_BLOCKCODE);
 	beg = 0;
 	while (beg < size) {
-		for (end = beg + 1; end < size && data[end - 1] != '\n';
-							end += 1);
+		end = line_end(data, beg, size);
 		pre = prefix_code(data + beg, end - beg);
 		if (pre) beg += pre; /* skipping prefix */
 		else if (!is_empty(data + beg, end - beg))
@@ -1078,20 +2128,24 @@ parse_blockcode(struct buf *ob, struct render *rndr,
 	while (work->size && work->data[work->size - 1] == '\n')
 		work->size -= 1;
 	bufputc(work, '\n');
-	if (rndr->make.blockcode)
-		rndr->make.blockcode(ob, work, rndr->make.opaque);
+	if (MAKE(rndr)->blockcode) {
+		block_source(rndr, ob, MKD_BLOCK_BLOCKCODE, data, beg);
+		MAKE(rndr)->blockcode(ob, work, rndr->make.opaque); }
 	release_work_buffer(rndr, work);
 	return beg; }
 
 
-/* parse_listitem • parsing of a single list item */
-/*	assuming initial prefix is already removed */
-static size_t
-parse_listitem(struct buf *ob, struct render *rndr,
-			char *data, size_t size, int *flags) {
-	struct buf *work = 0, *inter = 0;
+/* item_open • gathers the next item of a list and pushes its frame */
+/*	returns 0 when the list has no more items */
+static int
+item_open(struct render *rndr, struct block_frame *list) {
+	struct block_frame *frame;
+	struct buf *work = 0, *inter = 0, *ob = list->work;
+	char *data = list->data + list->beg;
+	size_t size = list->size - list->beg;
 	size_t beg = 0, end, pre, sublist = 0, orgpre = 0, i;
-	int in_empty = 0, has_inside_empty = 0;
+	size_t map = rndr->nest_map.size;
+	int in_empty = 0, has_inside_empty = 0, *flags = &list->flags;
 
 	/* keeping book of the first indentation prefix */
 	if (size > 1 && data[0] == ' ') { orgpre = 1;
@@ -1100,6 +2154,7 @@ parse_listitem(struct buf *ob, struct render *rndr,
 	beg = prefix_uli(data, size);
 	if (!beg) beg = prefix_oli(data, size);
 	if (!beg) return 0;
+	PROFILE_BLOCK(rndr, MKD_BLOCK_LISTITEM);
 	/* skipping to the beginning of the following line */
 	end = beg;
 	while (end < size && data[end - 1] != '\n') end += 1;
@@ -1109,13 +2164,13 @@ parse_listitem(struct buf *ob, struct render *rndr,
 	inter = new_work_buffer(rndr);
 
 	/* putting the first line into the working buffer */
+	nest_add(rndr, map, 0, beg);
 	bufput(work, data + beg, end - beg);
 	beg = end;
 
 	/* process the following lines */
 	while (beg < size) {
-		end += 1;
-		while (end < size && data[end - 1] != '\n') end += 1;
+		end = line_end(data, beg, size);
 
 		/* process an empty line */
 		if (is_empty(data + beg, end - beg)) {
@@ -1152,52 +2207,42 @@ parse_listitem(struct buf *ob, struct render *rndr,
 		in_empty = 0;
 
 		/* adding the line without prefix into the working buffer */
+		nest_add(rndr, map, work->size, beg + i);
 		bufput(work, data + beg + i, end - beg - i);
 		beg = end; }
 
-	/* render of li contents */
+	/* the contents are rendered by item_run */
 	if (has_inside_empty) *flags |= MKD_LI_BLOCK;
-	if (*flags & MKD_LI_BLOCK) {
-		/* intermediate render of block li */
-		if (sublist && sublist < work->size) {
-			parse_block(inter, rndr, work->data, sublist);
-			parse_block(inter, rndr, work->data + sublist,
-						work->size - sublist); }
-		else
-			parse_block(inter, rndr, work->data, work->size); }
-	else {
-		/* intermediate render of inline li */
-		if (sublist && sublist < work->size) {
-			parse_inline(inter, rndr, work->data, sublist);
-			parse_block(inter, rndr, work->data + sublist,
-						work->size - sublist); }
-		else
-			parse_inline(inter, rndr, work->data, work->size); }
-
-	/* render of li itself */
-	if (rndr->make.listitem)
-		rndr->make.listitem(ob, inter, *flags, rndr->make.opaque);
-	release_work_buffer(rndr, inter);
-	release_work_buffer(rndr, work);
-	return beg; }
-
+	i = *flags;
+	if ((frame = block_push(rndr, FRAME_ITEM, ob, 0, 0)) == 0) {
+		rndr->nest_map.size = map;
+		release_work_buffer(rndr, inter);
+		release_work_buffer(rndr, work);
+		return 0; }
+	frame->beg = beg;
+	frame->flags = i;
+	frame->sublist = sublist;
+	frame->work = work;
+	frame->out = inter;
+	frame->from = data;
+	frame->map_beg = map;
+	frame->map_end = rndr->nest_map.size;
+	return 1; }
 
-/* parse_list • parsing ordered or unordered list block */
-static size_t
-parse_list(struct buf *ob, struct render *rndr,
-			char *data, size_t size, int flags) {
-	struct buf *work = new_work_buffer(rndr);
-	size_t i = 0, j;
 
-	while (i < size) {
-		j = parse_listitem(work, rndr, data + i, size - i, &flags);
-		i += j;
-		if (!j || (flags & MKD_LI_END)) break; }
+/* list_open • pushes the frame of an ordered or unordered list block */
+/*	returns 0 when nothing is pushed */
+static int
+list_open(struct render *rndr, struct buf *ob, char *data, size_t size,
+					int flags) {
+	struct block_frame *frame;
 
-	if (rndr->make.list)
-		rndr->make.list(ob, work, flags, rndr->make.opaque);
-	release_work_buffer(rndr, work);
-	return i; }
+	PROFILE_BLOCK(rndr, MKD_BLOCK_LIST);
+	if ((frame = block_push(rndr, FRAME_LIST, ob, data, size)) == 0)
+		return 0;
+	frame->flags = flags;
+	frame->work = new_work_buffer(rndr);
+	return 1; }
 
 
 /* parse_atxheader • parsing of atx-style headers */
@@ -1208,6 +2253,7 @@ parse_atxheader(struct buf *ob, struct render *rndr,
 	size_t i, end, skip, span_beg, span_size;
 
 	if (!size || data[0] != '#') return 0;
+	PROFILE_BLOCK(rndr, MKD_BLOCK_ATXHEADER);
 
 	while (level < size && level < 6 && data[level] == '#') level += 1;
 	for (i = level; i < size && (data[i] == ' ' || data[i] == '\t');
@@ -1224,10 +2270,15 @@ parse_atxheader(struct buf *ob, struct render *rndr,
 		return parse_paragraph(ob, rndr, data, size);
 
 	span_size = end - span_beg;
-	if (rndr->make.header) {
+	if (MAKE(rndr)->header) {
 		struct buf *span = new_work_buffer(rndr);
+		if (rndr->extract)
+			extract_heading(rndr, level, data,
+					data + span_beg, span_size);
 		parse_inline(span, rndr, data + span_beg, span_size);
-		rndr->make.header(ob, span, level, rndr->make.opaque);
+		block_source(rndr, ob, MKD_BLOCK_ATXHEADER, data,
+					skip < size ? skip + 1 : skip);
+		MAKE(rndr)->header(ob, span, level, rndr->make.opaque);
 		release_work_buffer(rndr, span); }
 	return skip; }
 
@@ -1258,55 +2309,67 @@ htmlblock_end(struct html_tag *tag, char *data, size_t size) {
 	return i + w; }
 
 
-/* parse_htmlblock • parsing of inline HTML block */
+/* close_tag_start • offset of the '/' of the next "</" from i, or size */
+/*	i > 0, as the '<' may be at i - 1 */
 static size_t
-parse_htmlblock(struct buf *ob, struct render *rndr,
-			char *data, size_t size) {
+close_tag_start(char *data, size_t i, size_t size) {
+	char *p = data + i - 1, *end = data + size - 1;
+	while (p < end && (p = memchr(p, '<', end - p)) != 0) {
+		if (p[1] == '/') return p + 1 - data;
+		p += 1; }
+	return size; }
+
+
+/* htmlblock_length • returns the length of the HTML block at data, or 0 */
+/*	when more is given, it is set when appending data could end a block */
+/*	not found yet (the length is then 0 or reaches the end of data); */
+/*	when seen is given, the search for the end starts from it and it is */
+/*	set to where a search with more data can start */
+static size_t
+htmlblock_length(char *data, size_t size, int *more, size_t *seen) {
 	size_t i, j = 0;
 	struct html_tag *curtag;
 	int found;
-	struct buf work = { data, 0, 0, 0, 0 };
 
 	/* identification of the opening tag */
+	if (more) *more = 0;
 	if (size < 2 || data[0] != '<') return 0;
 	curtag = find_block_tag(data + 1, size - 1);
 
 	/* handling of special cases */
 	if (!curtag) {
 		/* HTML comment, laxist form */
-		if (size > 5 && data[1] == '!'
+		if (size > 3 && data[1] == '!'
 		&& data[2] == '-' && data[3] == '-') {
-			i = 5;
+			i = (seen && *seen > 5) ? *seen : 5;
 			while (i < size
 			&& !(data[i - 2] == '-' && data[i - 1] == '-'
 						&& data[i] == '>'))
 				i += 1;
+			if (seen) *seen = i;
 			i += 1;
 			if (i < size) {
 				j = is_empty(data + i, size - i);
 				if (j) {
-					work.size = i + j;
-					if (rndr->make.blockhtml)
-						rndr->make.blockhtml(ob, &work,
-							rndr->make.opaque);
-					return work.size; } } }
+					if (more) *more = (i + j >= size);
+					return i + j; } }
+			else if (more) *more = 1; }
 
 		/* HR, which is the only self-closing block tag considered */
-		if (size > 4
+		if (size > 2
 		&& (data[1] == 'h' || data[1] == 'H')
 		&& (data[2] == 'r' || data[2] == 'R')) {
-			i = 3;
+			i = (seen && *seen > 3) ? *seen : 3;
 			while (i < size && data[i] != '>')
 				i += 1;
+			if (seen) *seen = i;
 			if (i + 1 < size) {
 				i += 1;
 				j = is_empty(data + i, size - i);
 				if (j) {
-					work.size = i + j;
-					if (rndr->make.blockhtml)
-						rndr->make.blockhtml(ob, &work,
-							rndr->make.opaque);
-					return work.size; } } }
+					if (more) *more = (i + j >= size);
+					return i + j; } }
+			else if (more) *more = 1; }
 
 		/* no special case recognised */
 		return 0; }
@@ -1332,47 +2395,78 @@ parse_htmlblock(struct buf *ob, struct render *rndr,
 	/* if not found, trying a second pass looking for indented match */
 	/* but not if tag is "ins" or "del" (following original Markdown.pl) */
 	if (!found && curtag != INS_TAG && curtag != DEL_TAG) {
-		i = 1;
+		i = (seen && *seen > 1) ? *seen : 1;
 		while (i < size) {
-			i += 1;
-			while (i < size
-			&& !(data[i - 1] == '<' && data[i] == '/'))
-				i += 1;
-		if (i + 2 + curtag->size >= size) break;
+			i = close_tag_start(data, i + 1, size);
+		if (i + 2 + curtag->size >= size) {
+			if (seen) *seen = i - 1;
+			break; }
 		j = htmlblock_end(curtag, data + i - 1, size - i + 1);
 		if (j) {
 			i += j - 1;
 			found = 1;
 			break; } } }
 
-	if (!found) return 0;
+	if (more) *more = found ? (i >= size)
+			: (curtag != INS_TAG && curtag != DEL_TAG);
+	return found ? i : 0; }
 
-	/* the end of the block has been found */
-	work.size = i;
-	if (rndr->make.blockhtml)
-		rndr->make.blockhtml(ob, &work, rndr->make.opaque);
-	return i; }
+
+/* parse_htmlblock • parsing of inline HTML block */
+/*	more is set as in htmlblock_length, and seen to where the search */
+/*	for the end went, even when no block is found */
+static size_t
+parse_htmlblock(struct buf *ob, struct render *rndr,
+			char *data, size_t size, int *more, size_t *seen) {
+	struct buf work = { data, 0, 0, 0, 0 };
+
+	/* streams do not wait for the end of longer blocks */
+	if (rndr->html_max && size > rndr->html_max) size = rndr->html_max;
+	*seen = 0;
+	work.size = htmlblock_length(data, size, more, seen);
+	if (!work.size) return 0;
+	PROFILE_BLOCK(rndr, MKD_BLOCK_HTML);
+	block_source(rndr, ob, MKD_BLOCK_HTML, data, work.size);
+	if (SPAN(rndr)->blockhtml)
+		SPAN(rndr)->blockhtml(ob, data, work.size, rndr->make.opaque);
+	else if (MAKE(rndr)->blockhtml)
+		MAKE(rndr)->blockhtml(ob, &work, rndr->make.opaque);
+	return work.size; }
 
 
 /* parse_table_cell • parse a cell inside a table */
 static void
 parse_table_cell(struct buf *ob, struct render *rndr, char *data, size_t size,
 				int flags) {
-	struct buf *span = new_work_buffer(rndr);
+	struct buf *span;
+	if (!TABLE_BUFFERED(rndr)) {
+		SPAN(rndr)->cell_begin(ob, flags, rndr->make.opaque);
+		parse_inline(ob, rndr, data, size);
+		SPAN(rndr)->cell_end(ob, flags, rndr->make.opaque);
+		return; }
+	span = new_work_buffer(rndr);
 	parse_inline(span, rndr, data, size);
-	rndr->make.table_cell(ob, span, flags, rndr->make.opaque);
+	MAKE(rndr)->table_cell(ob, span, flags, rndr->make.opaque);
 	release_work_buffer(rndr, span); }
 
 
 /* parse_table_row • parse an input line into a table row */
+/*	streamed rows are written straight into ob */
 static size_t
 parse_table_row(struct buf *ob, struct render *rndr, char *data, size_t size,
 				int *aligns, size_t align_size, int flags) {
 	size_t i = 0, col = 0;
 	size_t beg, end, total = 0;
-	struct buf *cells = new_work_buffer(rndr);
+	struct buf *cells = ob;
 	int align;
 
+	PROFILE_BLOCK(rndr, MKD_BLOCK_TABLE_ROW);
+	if (TABLE_BUFFERED(rndr)) cells = new_work_buffer(rndr);
+	else {
+		if (MAKE(rndr)->block_source)
+			block_source(rndr, ob, MKD_BLOCK_TABLE_ROW, data,
+						line_end(data, 0, size));
+		SPAN(rndr)->row_begin(ob, flags, rndr->make.opaque); }
 	/* skip leading blanks and separator */
 	while (i < size && (data[i] == ' ' || data[i] == '\t'))
 		i += 1;
@@ -1402,7 +2496,7 @@ parse_table_row(struct buf *ob, struct render *rndr, char *data, size_t size,
 				total = i; }
 
 		/* check optional right/center align marker */
-		if (i > beg && data[end - 1] == ':') {
+		if (end > beg && data[end - 1] == ':') {
 			align |= MKD_CELL_ALIGN_RIGHT;
 			end -= 1; }
 
@@ -1426,19 +2520,47 @@ parse_table_row(struct buf *ob, struct render *rndr, char *data, size_t size,
 		col += 1; }
 
 	/* render the whole row and clean up */
-	rndr->make.table_row(ob, cells, flags, rndr->make.opaque);
-	release_work_buffer(rndr, cells);
+	if (cells == ob)
+		SPAN(rndr)->row_end(ob, flags, rndr->make.opaque);
+	else {
+		block_source(rndr, ob, MKD_BLOCK_TABLE_ROW, data,
+						total ? total : size);
+		MAKE(rndr)->table_row(ob, cells, flags, rndr->make.opaque);
+		release_work_buffer(rndr, cells); }
 	return total ? total : size; }
 
 
+/* table_length • size of the table parsed by parse_table */
+/*	needed before the rows when they are streamed */
+static size_t
+table_length(char *data, size_t size) {
+	size_t i = line_end(data, 0, size), rule;
+
+	if (i >= size) return size;
+	for (rule = i; rule < size && (data[rule] == ' ' || data[rule] == '\t'
+	|| data[rule] == '-' || data[rule] == ':' || data[rule] == '|');
+								rule += 1);
+	i = (rule < size && data[rule] == '\n') ? rule + 1 : 0;
+	while (i < size && is_tableline(data + i, size - i))
+		i = line_end(data, i, size);
+	return i; }
+
+
 /* parse_table • parsing of a whole table */
+/*	streamed tables write their rows and cells straight into ob, */
+/*	others render them into work buffers for the mkd_renderer callbacks */
 static size_t
 parse_table(struct buf *ob, struct render *rndr, char *data, size_t size) {
 	size_t i = 0, head_end, col;
 	size_t align_size = 0;
-	int *aligns = 0;
+	int *aligns = 0, streamed = !TABLE_BUFFERED(rndr);
 	struct buf *head = 0;
-	struct buf *rows = new_work_buffer(rndr);
+	struct buf *rows = streamed ? ob : new_work_buffer(rndr);
+
+	PROFILE_BLOCK(rndr, MKD_BLOCK_TABLE);
+	if (streamed && MAKE(rndr)->block_source)
+		block_source(rndr, ob, MKD_BLOCK_TABLE, data,
+						table_length(data, size));
 
 	/* skip the first (presumably header) line */
 	while (i < size && data[i] != '\n')
@@ -1447,9 +2569,13 @@ parse_table(struct buf *ob, struct render *rndr, char *data, size_t size) {
 
 	/* fallback on end of input */
 	if (i >= size) {
+		if (streamed) SPAN(rndr)->table_begin(ob, 0, rndr->make.opaque);
 		parse_table_row(rows, rndr, data, size, 0, 0, 0);
-		rndr->make.table(ob, 0, rows, rndr->make.opaque);
-		release_work_buffer(rndr, rows);
+		if (streamed) SPAN(rndr)->table_end(ob, 0, rndr->make.opaque);
+		else {
+			block_source(rndr, ob, MKD_BLOCK_TABLE, data, i);
+			MAKE(rndr)->table(ob, 0, rows, rndr->make.opaque);
+			release_work_buffer(rndr, rows); }
 		return i; }
 
 	/* attempt to parse a table rule, i.e. blanks, dash, colons and sep */
@@ -1465,12 +2591,17 @@ parse_table(struct buf *ob, struct render *rndr, char *data, size_t size) {
 		align_size += 1;
 
 		/* render the header row */
-		head = new_work_buffer(rndr);
+		if (!streamed) head = new_work_buffer(rndr);
+		else {
+			head = ob;
+			SPAN(rndr)->table_begin(ob, MKD_CELL_HEAD,
+							rndr->make.opaque); }
 		parse_table_row(head, rndr, data, head_end, 0, 0,
 		    MKD_CELL_HEAD);
 
 		/* parse alignments if provided */
-		if (col && (aligns = malloc(align_size * sizeof *aligns)) != 0){
+		if (col && (aligns = arena_alloc(&rndr->arena,
+					align_size * sizeof *aligns)) != 0) {
 			for (i = 0; i < align_size; i += 1)
 				aligns[i] = 0;
 			col = 0;
@@ -1499,65 +2630,249 @@ parse_table(struct buf *ob, struct render *rndr, char *data, size_t size) {
 
 	else {
 		/* there is no valid ruler, continuing without header */
-		i = 0; }
+		i = 0;
+		if (streamed)
+			SPAN(rndr)->table_begin(ob, 0, rndr->make.opaque); }
 
 	/* render the table body lines */
-	while (i < size && is_tableline(data + i, size - i))
+	while (i < size && is_tableline(data + i, size - i) && BUDGET_OK(rndr))
 		i += parse_table_row(rows, rndr, data + i, size - i,
 		    aligns, align_size, 0);
 
 	/* render the full table */
-	rndr->make.table(ob, head, rows, rndr->make.opaque);
+	if (streamed) {
+		SPAN(rndr)->table_end(ob, head ? MKD_CELL_HEAD : 0,
+							rndr->make.opaque);
+		return i; }
+	block_source(rndr, ob, MKD_BLOCK_TABLE, data, i);
+	MAKE(rndr)->table(ob, head, rows, rndr->make.opaque);
 
 	/* cleanup */
 	if (head) release_work_buffer(rndr, head);
 	release_work_buffer(rndr, rows);
-	free(aligns);
 	return i; }
 
 
-/* parse_block • parsing of one block, returning next char to parse */
+/* flush_output • sends all but the last byte of the top-level output */
+/*	the byte is kept so that renderers still see a non-empty buffer */
 static void
-parse_block(struct buf *ob, struct render *rndr,
-			char *data, size_t size) {
-	size_t beg, end, i;
-	char *txt_data;
-	int has_table = (rndr->make.table && rndr->make.table_row
-	    && rndr->make.table_cell);
+flush_output(struct render *rndr, struct buf *ob) {
+	rndr->flush(ob->data, ob->size - 1, rndr->flush_opaque);
+	ob->data[0] = ob->data[ob->size - 1];
+	ob->size = 1; }
 
-	if (rndr->work.size > rndr->make.max_work_stack) {
-		if (size) bufput(ob, data, size);
-		return; }
 
-	beg = 0;
-	while (beg < size) {
+/* mark_block • records a top-level block and its output */
+/*	besides the block itself, its parse reads the lines up to the first */
+/*	non-blank one after it and the line of seen, where the search for the */
+/*	end of an HTML block stopped, while a block running to the end of the */
+/*	text or after an open HTML tag (open) may depend on anything after it */
+static void
+mark_block(struct render *rndr, struct buf *ob, char *data, size_t size,
+		size_t beg, size_t end, size_t out, int open, size_t seen) {
+	struct doc_block *blk;
+	size_t dep = 0, line, next;
+
+	if ((blk = arr_push(rndr->blocks)) == 0) return;
+	for (next = end; !open && !dep && next < size; ) {
+		line = next;
+		next = line_end(data, line, size);
+		if (!is_empty(data + line, next - line)) dep = next; }
+	if (dep && seen >= dep) dep = line_end(data, seen, size);
+	blk->beg = beg;
+	blk->end = end;
+	blk->dep = dep;
+	blk->out = out;
+	blk->out_end = ob->size; }
+
+
+/* blocks_run • parses blocks until stop or a nested construct */
+/*	returns 0 when a nested construct has been pushed */
+static int
+blocks_run(struct render *rndr, struct block_frame *frame) {
+	struct buf *ob = frame->ob;
+	char *data = frame->data, *txt_data;
+	size_t size = frame->size, beg = frame->beg, end, i, org, out, seen;
+	int has_table = HAS_TABLE(rndr);
+	int open;
+
+	while (beg < frame->stop) {
+		if (ob == rndr->flush_ob && ob->size > rndr->flush_mark
+		&& ob->size > 1)
+			flush_output(rndr, ob);
+		if (!BUDGET_OK(rndr)) {
+			budget_rest(ob, rndr, data + beg, frame->stop - beg);
+			beg = frame->stop;
+			break; }
 		txt_data = data + beg;
 		end = size - beg;
+		org = beg;
+		out = ob->size;
+		open = 0;
+		seen = 0;
+		frame->org = org; /* for block_return, when a frame is pushed */
+		frame->mark = out;
 		if (data[beg] == '#')
 			beg += parse_atxheader(ob, rndr, txt_data, end);
-		else if (data[beg] == '<' && rndr->make.blockhtml
-			&& (i = parse_htmlblock(ob, rndr, txt_data, end)) != 0)
+		else if (data[beg] == '<' && HAS_BLOCKHTML(rndr)
+			&& (i = parse_htmlblock(ob, rndr, txt_data, end,
+							&open, &seen)) != 0)
 			beg += i;
 		else if ((i = is_empty(txt_data, end)) != 0)
 			beg += i;
 		else if (is_hrule(txt_data, end)) {
-			if (rndr->make.hrule)
-				rndr->make.hrule(ob, rndr->make.opaque);
+			PROFILE_BLOCK(rndr, MKD_BLOCK_HRULE);
 			while (beg < size && data[beg] != '\n') beg += 1;
-			beg += 1; }
-		else if (prefix_quote(txt_data, end))
-			beg += parse_blockquote(ob, rndr, txt_data, end);
+			beg += 1;
+			if (MAKE(rndr)->hrule) {
+				block_source(rndr, ob, MKD_BLOCK_HRULE,
+						txt_data, beg - org);
+				MAKE(rndr)->hrule(ob, rndr->make.opaque); } }
+		else if (prefix_quote(txt_data, end)) {
+			if (quote_open(rndr, ob, txt_data, end)) return 0;
+			beg = size; }
 		else if (prefix_code(txt_data, end))
 			beg += parse_blockcode(ob, rndr, txt_data, end);
-		else if (prefix_uli(txt_data, end))
-			beg += parse_list(ob, rndr, txt_data, end, 0);
-		else if (prefix_oli(txt_data, end))
-			beg += parse_list(ob, rndr, txt_data, end,
-						MKD_LIST_ORDERED);
+		else if (prefix_uli(txt_data, end)) {
+			if (list_open(rndr, ob, txt_data, end, 0)) return 0;
+			beg = size; }
+		else if (prefix_oli(txt_data, end)) {
+			if (list_open(rndr, ob, txt_data, end,
+						MKD_LIST_ORDERED)) return 0;
+			beg = size; }
 		else if (has_table && is_tableline(txt_data, end))
 			beg += parse_table(ob, rndr, txt_data, end);
 		else
-			beg += parse_paragraph(ob, rndr, txt_data, end); } }
+			beg += parse_paragraph(ob, rndr, txt_data, end);
+		if (frame->top)
+			mark_block(rndr, ob, data, size, org, beg, out, open,
+								org + seen); }
+	frame->beg = beg;
+	return 1; }
+
+
+/* quote_run • renders a blockquote once its contents are parsed */
+static int
+quote_run(struct render *rndr, struct block_frame *frame) {
+	if (frame->step == 0) {
+		frame->step = 1;
+		if (blocks_open(rndr, frame->out, frame->work->data,
+				frame->work->size, frame->work->size))
+			return 0; }
+	if (MAKE(rndr)->blockquote) {
+		block_source(rndr, frame->ob, MKD_BLOCK_BLOCKQUOTE,
+						frame->data, frame->beg);
+		MAKE(rndr)->blockquote(frame->ob, frame->out,
+						rndr->make.opaque); }
+	rndr->nest_map.size = frame->map_beg;
+	release_work_buffer(rndr, frame->out);
+	release_quote_buffer(rndr, frame->work);
+	return 1; }
+
+
+/* list_run • parses the items of a list, then renders it */
+static int
+list_run(struct render *rndr, struct block_frame *frame) {
+	if (frame->step == 0 && frame->beg < frame->size && BUDGET_OK(rndr)) {
+		if (item_open(rndr, frame)) return 0;
+		frame->step = 1; }
+	if (MAKE(rndr)->list) {
+		block_source(rndr, frame->ob, MKD_BLOCK_LIST, frame->data,
+							frame->beg);
+		MAKE(rndr)->list(frame->ob, frame->work, frame->flags,
+							rndr->make.opaque); }
+	release_work_buffer(rndr, frame->work);
+	return 1; }
+
+
+/* item_run • parses the contents of a list item, then renders it */
+static int
+item_run(struct render *rndr, struct block_frame *frame) {
+	struct block_frame *list;
+	struct buf *work = frame->work;
+	size_t sub = frame->sublist;
+	size_t first = (sub && sub < work->size) ? sub : work->size;
+
+	if (frame->step == 0) {
+		frame->step = first < work->size ? 1 : 2;
+		if (!(frame->flags & MKD_LI_BLOCK))
+			parse_inline(frame->out, rndr, work->data, first);
+		else if (blocks_open(rndr, frame->out, work->data, first,
+								first))
+			return 0; }
+	if (frame->step == 1) {
+		frame->step = 2;
+		if (blocks_open(rndr, frame->out, work->data + sub,
+				work->size - sub, work->size - sub))
+			return 0; }
+	if (MAKE(rndr)->listitem) {
+		list = arr_item(&rndr->frames, rndr->frames.size - 2);
+		block_source(rndr, frame->ob, MKD_BLOCK_LISTITEM,
+				list->data + list->beg, frame->beg);
+		MAKE(rndr)->listitem(frame->ob, frame->out, frame->flags,
+							rndr->make.opaque); }
+	rndr->nest_map.size = frame->map_beg;
+	release_work_buffer(rndr, frame->out);
+	release_work_buffer(rndr, work);
+	return 1; }
+
+
+/* block_return • hands the result of a finished construct to its parent */
+static void
+block_return(struct render *rndr, struct block_frame *parent, size_t ret) {
+	switch (parent->kind) {
+	    case FRAME_BLOCKS:
+		parent->beg = parent->org + ret;
+		if (parent->top)
+			mark_block(rndr, parent->ob, parent->data,
+				parent->size, parent->org, parent->beg,
+				parent->mark, 0, 0);
+		break;
+	    case FRAME_LIST:
+		parent->beg += ret;
+		if (!ret || (parent->flags & MKD_LI_END))
+			parent->step = 1;
+		break;
+	    default:
+		break; } }
+
+
+/* parse_block_until • parsing of the blocks starting before stop */
+/*	blocks still see the data up to size, the returned offset is the end */
+/*	of the last parsed block, which is after stop when it spans over it */
+/*	nested constructs live on rndr->frames instead of the C stack */
+static size_t
+parse_block_until(struct buf *ob, struct render *rndr,
+			char *data, size_t size, size_t stop) {
+	struct block_frame *frame;
+	int base = rndr->frames.size, done = 1;
+	size_t ret = stop;
+
+	if (!blocks_open(rndr, ob, data, size, stop)) return stop;
+	frame = arr_item(&rndr->frames, rndr->frames.size - 1);
+	frame->top = (rndr->blocks && rndr->work.size == 0);
+
+	while (rndr->frames.size > base) {
+		frame = arr_item(&rndr->frames, rndr->frames.size - 1);
+		switch (frame->kind) {
+		    case FRAME_BLOCKS: done = blocks_run(rndr, frame); break;
+		    case FRAME_QUOTE: done = quote_run(rndr, frame); break;
+		    case FRAME_LIST: done = list_run(rndr, frame); break;
+		    case FRAME_ITEM: done = item_run(rndr, frame); break; }
+		if (!done) continue;
+		ret = frame->beg;
+		rndr->frames.size -= 1;
+		if (rndr->frames.size > base)
+			block_return(rndr, arr_item(&rndr->frames,
+					rndr->frames.size - 1), ret); }
+	return ret; }
+
+
+/* parse_block • parsing of a whole fragment of block data */
+static void
+parse_block(struct buf *ob, struct render *rndr,
+			char *data, size_t size) {
+	parse_block_until(ob, rndr, data, size, size); }
 
 
 
@@ -1566,8 +2881,10 @@ parse_block(struct buf *ob, struct render *rndr,
  *********************/
 
 /* is_ref • returns whether a line is a reference or not */
+/*	when rndr is given the reference is stored in its arena and refs, */
+/*	or only its offset in ref_lines with MKD_LAZY_REFS */
 static int
-is_ref(char *data, size_t beg, size_t end, size_t *last, struct array *refs) {
+is_ref(char *data, size_t beg, size_t end, size_t *last, struct render *rndr){
 	size_t i = 0;
 	size_t id_offset, id_end;
 	size_t link_offset, link_end;
@@ -1575,6 +2892,8 @@ is_ref(char *data, size_t beg, size_t end, size_t *last, struct array *refs) {
 	size_t line_end;
 	struct link_ref *lr;
 	struct buf *id;
+	unsigned hash;
+	size_t *pos;
 
 	/* up to 3 optional leading spaces */
 	if (beg + 3 >= end) return 0;
@@ -1593,6 +2912,12 @@ is_ref(char *data, size_t beg, size_t end, size_t *last, struct array *refs) {
 	if (i >= end || data[i] != ']') return 0;
 	id_end = i;
 
+	/* a blank id makes no reference */
+	for (i = id_offset; i < id_end && (data[i] == ' ' || data[i] == '\t');
+								i += 1);
+	if (i >= id_end) return 0;
+	i = id_end;
+
 	/* spacer: colon (space | tab)* newline? (space | tab)* */
 	i += 1;
 	if (i >= end || data[i] != ':') return 0;
@@ -1652,110 +2977,1397 @@ is_ref(char *data, size_t beg, size_t end, size_t *last, struct array *refs) {
 
 	/* a valid ref has been found, filling-in return structures */
 	if (last) *last = line_end;
-	if (!refs) return 1;
-	id = bufnew(WORK_UNIT);
-	if (build_ref_id(id, data + id_offset, id_end - id_offset) < 0) {
-		bufrelease(id);
+	if (!rndr) return 1;
+	if (rndr->make.flags & MKD_LAZY_REFS) {
+		/* kept for resolve_refs, when a ref is first looked up */
+		if ((pos = arr_push(&rndr->ref_lines)) != 0) *pos = beg;
+		if (id_end - id_offset > rndr->ref_id_max)
+			rndr->ref_id_max = id_end - id_offset;
+		return 1; }
+	id = new_work_buffer(rndr);
+	if (build_ref_id(id, data + id_offset, id_end - id_offset,
+						id_end - id_offset) < 0) {
+		release_work_buffer(rndr, id);
 		return 0; }
-	lr = arr_item(refs, arr_newitem(refs));
-	lr->id = id;
-	lr->link = bufnew(link_end - link_offset);
-	bufput(lr->link, data + link_offset, link_end - link_offset);
-	if (title_end > title_offset) {
-		lr->title = bufnew(title_end - title_offset);
-		bufput(lr->title, data + title_offset,
-					title_end - title_offset); }
-	else lr->title = 0;
+	hash = ref_hash(id->data, id->size);
+
+	/* the first definition of an id wins */
+	if (!find_link_ref(rndr, id, hash)
+	&& (lr = arr_push(&rndr->refs)) != 0) {
+		lr->hash = hash;
+		lr->id = arena_bufdup(&rndr->arena, id->data, id->size);
+		lr->link = arena_bufdup(&rndr->arena, data + link_offset,
+						link_end - link_offset);
+		lr->title = (title_end > title_offset)
+			? arena_bufdup(&rndr->arena, data + title_offset,
+						title_end - title_offset)
+			: 0;
+		if (!lr->id || !lr->link) rndr->refs.size -= 1;
+		else {
+			index_link_ref(rndr);
+			if (id->size > rndr->ref_id_max)
+				rndr->ref_id_max = id->size; } }
+	release_work_buffer(rndr, id);
 	return 1; }
 
 
+/* resolve_refs • stores the references kept by a lazy first pass */
+static void
+resolve_refs(struct render *rndr) {
+	size_t *pos = rndr->ref_lines.base;
+	int i, n = rndr->ref_lines.size;
+	int flags = rndr->make.flags;
 
-/**********************
- * EXPORTED FUNCTIONS *
- **********************/
+	rndr->ref_lines.size = 0;
+	rndr->make.flags &= ~MKD_LAZY_REFS;
+	for (i = 0; i < n; i += 1)
+		is_ref(rndr->ref_data, pos[i], rndr->ref_size, 0, rndr);
+	rndr->make.flags = flags; }
 
-/* markdown • parses the input buffer and renders it into the output buffer */
-void
-markdown(struct buf *ob, struct buf *ib, const struct mkd_renderer *rndrer) {
-	struct link_ref *lr;
-	struct buf *text;
-	size_t i, beg, end;
-	struct render rndr;
 
-	/* filling the render structure */
-	if (!rndrer) return;
-	rndr.make = *rndrer;
-	if (rndr.make.max_work_stack < 1)
-		rndr.make.max_work_stack = 1;
-	arr_init(&rndr.refs, sizeof (struct link_ref));
-	parr_init(&rndr.work);
-	for (i = 0; i < 256; i += 1) rndr.active_char[i] = 0;
-	if ((rndr.make.emphasis || rndr.make.double_emphasis
-						|| rndr.make.triple_emphasis)
-	&& rndr.make.emph_chars)
-		for (i = 0; rndr.make.emph_chars[i]; i += 1)
-			rndr.active_char[(unsigned char)rndr.make.emph_chars[i]]
-				= char_emphasis;
-	if (rndr.make.codespan) rndr.active_char['`'] = char_codespan;
-	if (rndr.make.linebreak) rndr.active_char['\n'] = char_linebreak;
-	if (rndr.make.image || rndr.make.link)
-		rndr.active_char['['] = char_link;
-	rndr.active_char['<'] = char_langle_tag;
-	rndr.active_char['\\'] = char_escape;
-	rndr.active_char['&'] = char_entity;
+/* next_ref_line • beginning of the next line holding "]:", or size */
+/*	a reference needs one after its id, hence on its first line */
+static size_t
+next_ref_line(char *data, size_t beg, size_t size) {
+	char *colon;
+	size_t i = beg;
+
+	while (i < size && (colon = memchr(data + i, ':', size - i)) != 0) {
+		i = colon - data;
+		if (i > beg && data[i - 1] == ']') {
+			while (i > beg && data[i - 1] != '\n') i -= 1;
+			return i; }
+		i += 1; }
+	return size; }
 
-	/* first pass: looking for references, copying everything else */
-	text = bufnew(TEXT_UNIT);
-	beg = 0;
-	while (beg < ib->size) /* iterating over lines */
-		if (is_ref(ib->data, beg, ib->size, &end, &rndr.refs))
+
+/* parse_refs • stores references and copies the other lines into text */
+/*	only lines beginning before stop are handled, the returned offset is */
+/*	where the next line begins */
+static size_t
+parse_refs(struct render *rndr, struct buf *text,
+				char *data, size_t size, size_t stop) {
+	size_t beg = 0, end;
+
+	while (beg < stop) /* iterating over lines */
+		if (is_ref(data, beg, size, &end, rndr))
 			beg = end;
 		else { /* skipping to the next line */
 			end = beg;
-			while (end < ib->size
-			&& ib->data[end] != '\n' && ib->data[end] != '\r')
+			while (end < size
+			&& data[end] != '\n' && data[end] != '\r')
 				end += 1;
 			/* adding the line body if present */
-			if (end > beg) bufput(text, ib->data + beg, end - beg);
-			while (end < ib->size
-			&& (ib->data[end] == '\n' || ib->data[end] == '\r')) {
+			if (end > beg) {
+				source_add(rndr, text->size, beg);
+				bufput(text, data + beg, end - beg); }
+			while (end < size
+			&& (data[end] == '\n' || data[end] == '\r')) {
 				/* add one \n per newline */
-				if (ib->data[end] == '\n'
-				|| (end + 1 < ib->size
-						&& ib->data[end + 1] != '\n'))
-					bufputc(text, '\n');
+				if (data[end] == '\n'
+				|| (end + 1 < size && data[end + 1] != '\n')) {
+					source_add(rndr, text->size, end);
+					bufputc(text, '\n'); }
 				end += 1; }
 			beg = end; }
+	return beg; }
 
-	/* sorting the reference array */
-	if (rndr.refs.size)
-		qsort(rndr.refs.base, rndr.refs.size, rndr.refs.unit,
-					cmp_link_ref_sort);
 
-	/* adding a final newline if not already present */
-	if (text->size
-	&&  text->data[text->size - 1] != '\n'
-	&&  text->data[text->size - 1] != '\r')
-		bufputc(text, '\n');
+/* strip_refs • first pass on input without CR, copying whole segments */
+/*	returns 0 when data holds no reference and ends with a newline, so */
+/*	that it can be parsed in place, otherwise text is filled as a copy of */
+/*	data without its references */
+static int
+strip_refs(struct render *rndr, struct buf *text, char *data, size_t size) {
+	size_t beg = 0, end, seg = 0;
+
+	while ((beg = next_ref_line(data, beg, size)) < size) {
+		if (is_ref(data, beg, size, &end, rndr)) {
+			/* the newline after the reference stays in text */
+			source_add(rndr, text->size, seg);
+			bufput(text, data + seg, beg - seg);
+			seg = beg = end; }
+		else beg = line_end(data, beg, size); }
+	if (!seg && data[size - 1] == '\n') return 0;
+	source_add(rndr, text->size, seg);
+	bufput(text, data + seg, size - seg);
+	return 1; }
+
+
+
+/**********************
+ * PARALLEL RENDERING *
+ **********************/
+
+#ifdef MKD_PROFILE
+/* stats_merge • adds the counters of src to dst */
+static void
+stats_merge(struct mkd_stats *dst, const struct mkd_stats *src) {
+	int i;
+	for (i = 0; i < MKD_TRIGGER_NB; i += 1)
+		dst->triggers[i] += src->triggers[i];
+	for (i = 0; i < MKD_BLOCK_NB; i += 1)
+		dst->blocks[i] += src->blocks[i];
+	if (src->work_peak > dst->work_peak) dst->work_peak = src->work_peak;
+	dst->reallocs += src->reallocs;
+	dst->grown_bytes += src->grown_bytes;
+	dst->fallbacks += src->fallbacks; }
+
+
+/* stats_time • seconds of the monotonic clock */
+static double
+stats_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9; }
+#endif
+
+
+/* render_copy • shallow copy of a render structure for another thread */
+/*	references and tables are shared read-only, while the buffer stacks */
+/*	and the arena are private to the copy */
+static void
+render_copy(struct render *dst, const struct render *src) {
+	*dst = *src;
+	parr_init(&dst->work);
+	parr_init(&dst->quote);
+	arr_init(&dst->spans, sizeof (struct inline_frame));
+	arr_init(&dst->frames, sizeof (struct block_frame));
+	arr_init(&dst->nest_map, sizeof (struct src_seg));
+	index_init(&dst->index);
+#ifdef MKD_PROFILE
+	memset(&dst->stats, 0, sizeof dst->stats);
+#endif
+	arena_init(&dst->arena, ARENA_UNIT); }
+
+
+/* render_release • frees the stacks and the arena of a render */
+static void
+render_release(struct render *rndr) {
+	int i;
+	assert(rndr->work.size == 0 && rndr->quote.size == 0);
+	for (i = 0; i < rndr->work.asize; i += 1)
+		bufrelease(rndr->work.item[i]);
+	parr_free(&rndr->work);
+	for (i = 0; i < rndr->quote.asize; i += 1)
+		bufrelease(rndr->quote.item[i]);
+	parr_free(&rndr->quote);
+	arr_free(&rndr->spans);
+	arr_free(&rndr->frames);
+	arr_free(&rndr->nest_map);
+	index_free(&rndr->index);
+	arena_free(&rndr->arena); }
+
+
+/* is_block_cut • whether a top-level block is likely to begin at data */
+/*	data is a non-blank line following a blank one, which must not */
+/*	continue a code block, a blockquote, a list or a table; blocks */
+/*	spanning over it anyway (e.g. HTML) have to be caught by the caller */
+static int
+is_block_cut(struct render *rndr, char *data, size_t size) {
+	int has_table = HAS_TABLE(rndr);
+	return data[0] != ' ' && data[0] != '\t' && data[0] != '>'
+	    && !prefix_uli(data, size) && !prefix_oli(data, size)
+	    && !(has_table && is_tableline(data, size)); }
+
+
+/* find_splits • cuts the text into at most max chunks of similar sizes */
+/*	mis-guessed cuts are caught by parallel_join */
+static int
+find_splits(struct render *rndr, char *data, size_t size,
+					size_t *split, int max) {
+	size_t beg = 0, end, step = size / max, next = step;
+	int nb = 0, blank = 0;
+
+	split[0] = 0;
+	while (beg < size && next < size && nb + 1 < max) {
+		/* jumping to the line before the next wanted boundary */
+		if (beg + 1 < next) {
+			end = next - 1;
+			while (end > beg && data[end - 1] != '\n') end -= 1;
+			if (end > beg) {
+				beg = end;
+				blank = 0; } }
+
+		end = line_end(data, beg, size);
+		if (is_empty(data + beg, end - beg))
+			blank = 1;
+		else {
+			if (blank && beg >= next
+			&& is_block_cut(rndr, data + beg, end - beg)) {
+				split[++nb] = beg;
+				next = beg + step; }
+			blank = 0; }
+		beg = end; }
+	split[++nb] = size;
+	return nb; }
+
+
+/* parallel_next • takes the next chunk to render, -1 when none is left */
+static int
+parallel_next(struct parallel_job *job) {
+	int ret;
+	JOB_LOCK(job);
+	ret = (job->next < job->nb) ? job->next++ : -1;
+	JOB_UNLOCK(job);
+	return ret; }
+
+
+/* parallel_worker • renders chunks until none is left */
+/*	every chunk output is seeded with one byte, standing for the output */
+/*	of the previous chunks, so that renderers see a non-empty buffer */
+static void *
+parallel_worker(void *arg) {
+	struct parallel_job *job = arg;
+	struct render rndr;
+	struct buf *out;
+	size_t beg, stop;
+	int i;
+
+	render_copy(&rndr, job->rndr);
+	while ((i = parallel_next(job)) >= 0) {
+		beg = job->split[i];
+		stop = job->split[i + 1] - beg;
+		if ((out = bufnew(WORK_UNIT)) == 0) continue;
+		bufsetgrowth(out, GROWTH, 0);
+		bufgrow(out, stop + stop / 10 * 3 + 1);
+		if (i > 0) bufputc(out, '\n');
+		else if (job->seed_first) bufputc(out, job->seed);
+		job->reached[i] = beg + parse_block_until(out, &rndr,
+				job->data + beg, job->size - beg, stop);
+		job->out[i] = out; }
+	render_release(&rndr);
+#ifdef MKD_PROFILE
+	JOB_LOCK(job);
+	stats_merge(&job->stats, &rndr.stats);
+	JOB_UNLOCK(job);
+#endif
+	return 0; }
+
+
+#if defined(MKD_PROFILE) && !defined(MKD_NO_THREADS)
+/* parallel_thread • worker thread, adding its buffer growths to the job */
+/*	counters of a new thread start at zero, so they cover only the job */
+static void *
+parallel_thread(void *arg) {
+	struct parallel_job *job = arg;
+
+	parallel_worker(job);
+	JOB_LOCK(job);
+	job->stats.reallocs += buffer_prof_grow_nb;
+	job->stats.grown_bytes += buffer_prof_grow_bytes;
+	JOB_UNLOCK(job);
+	return 0; }
+
+#define PARALLEL_THREAD parallel_thread
+#else
+#define PARALLEL_THREAD parallel_worker
+#endif
+
+
+/* parallel_join • appends chunk outputs in order, fixing wrong guesses */
+/*	a chunk is kept only when the previous parse stopped exactly at its */
+/*	beginning, and when its seed matches the emptiness of the output */
+static void
+parallel_join(struct parallel_job *job, struct buf *ob) {
+	size_t pos = 0, seeded;
+	struct buf *out;
+	int i;
+
+	for (i = 0; i < job->nb; i += 1) {
+		out = job->out[i];
+		seeded = (i > 0 || job->seed_first) ? 1 : 0;
+		if (job->split[i] == pos && out && out->size >= seeded
+		&& (ob->size != 0) == (seeded != 0)) {
+			bufput(ob, out->data + seeded, out->size - seeded);
+			pos = job->reached[i]; }
+		else if (job->split[i + 1] > pos)
+			/* sequential render from the actual block boundary */
+			pos += parse_block_until(ob, job->rndr,
+				job->data + pos, job->size - pos,
+				job->split[i + 1] - pos);
+		bufrelease(out); } }
+
+
+/* render_parallel • renders text chunks on several threads */
+static void
+render_parallel(struct render *rndr, struct buf *ob,
+				char *data, size_t size, int nthreads) {
+	struct parallel_job job;
+#ifndef MKD_NO_THREADS
+	pthread_t *tid;
+	int nb_tid = 0;
+#endif
+	int i, max = nthreads * PARALLEL_SPLIT;
+
+	if (size / max < PARALLEL_MIN) max = size / PARALLEL_MIN;
+	job.split = arena_alloc(&rndr->arena, (max + 1) * sizeof *job.split);
+	job.reached = arena_alloc(&rndr->arena, max * sizeof *job.reached);
+	job.out = arena_alloc(&rndr->arena, max * sizeof *job.out);
+	if (max < 2 || !job.split || !job.reached || !job.out
+	|| (job.nb = find_splits(rndr, data, size, job.split, max)) < 2) {
+		parse_block(ob, rndr, data, size);
+		return; }
+
+	/* workers share the references read-only */
+	if (rndr->ref_lines.size) resolve_refs(rndr);
+	job.rndr = rndr;
+	job.data = data;
+	job.size = size;
+	job.seed_first = ob->size ? 1 : 0;
+	job.seed = ob->size ? ob->data[ob->size - 1] : 0;
+	job.next = 0;
+#ifdef MKD_PROFILE
+	memset(&job.stats, 0, sizeof job.stats);
+#endif
+	for (i = 0; i < job.nb; i += 1) {
+		job.reached[i] = 0;
+		job.out[i] = 0; }
+
+	/* the calling thread works along with the others */
+#ifndef MKD_NO_THREADS
+	tid = arena_alloc(&rndr->arena, nthreads * sizeof *tid);
+	if (!tid || pthread_mutex_init(&job.lock, 0) != 0) {
+		parse_block(ob, rndr, data, size);
+		return; }
+	for (i = 1; i < nthreads && i < job.nb; i += 1)
+		if (pthread_create(tid + nb_tid, 0, PARALLEL_THREAD, &job) == 0)
+			nb_tid += 1;
+	parallel_worker(&job);
+	for (i = 0; i < nb_tid; i += 1)
+		pthread_join(tid[i], 0);
+	pthread_mutex_destroy(&job.lock);
+#else
+	parallel_worker(&job);
+#endif
+#ifdef MKD_PROFILE
+	stats_merge(&rndr->stats, &job.stats);
+#endif
+	parallel_join(&job, ob); }
+
+
+
+/*****************************
+ * RENDER STRUCTURE HANDLING *
+ *****************************/
+
+/* special_find • parser specialized for a renderer, or 0 */
+static special_render *
+special_find(const struct mkd_renderer *rndrer) {
+#ifndef MKD_NO_SPECIAL
+	if (rndrer == &mkd_html) return special_mkd_html;
+	if (rndrer == &discount_html) return special_discount_html;
+	if (rndrer == &nat_html) return special_nat_html;
+#endif
+	return 0; }
+
+
+/* compile_init • copies a renderer and builds the tables derived from it */
+static void
+compile_init(struct mkd_compiled *cr, const struct mkd_renderer *rndrer) {
+	size_t i;
+	int streamed;
+
+	cr->make = *rndrer;
+	cr->special = special_find(rndrer);
+	if (rndrer->spans) cr->span = *rndrer->spans;
+	else memset(&cr->span, 0, sizeof cr->span);
+	if (cr->make.max_work_stack < 1)
+		cr->make.max_work_stack = 1;
+
+	for (i = 0; i < 256; i += 1) cr->active_char[i] = 0;
+	if ((cr->make.emphasis || cr->make.double_emphasis
+						|| cr->make.triple_emphasis)
+	&& cr->make.emph_chars)
+		for (i = 0; cr->make.emph_chars[i]; i += 1)
+			cr->active_char
+				[(unsigned char)cr->make.emph_chars[i]]
+				= char_emphasis;
+	if (cr->make.codespan || cr->span.codespan)
+		cr->active_char['`'] = char_codespan;
+	if (cr->make.linebreak) cr->active_char['\n'] = char_linebreak;
+	if (cr->make.image || cr->make.link)
+		cr->active_char['['] = char_link;
+	cr->active_char['<'] = char_langle_tag;
+	cr->active_char['\\'] = char_escape;
+	cr->active_char['&'] = char_entity;
+
+	/* vectorized search of active chars, when it fits in a set */
+	scan_set_init(&cr->active_set);
+	cr->active_scan = 0;
+#ifdef SCAN_VECTOR
+	cr->active_scan = 1;
+	for (i = 0; i < 256; i += 1)
+		if (cr->active_char[i]
+		&& !scan_set_add(&cr->active_set, (char)i))
+			cr->active_scan = 0;
+#endif
+
+	/* block kinds with a callback, tables streamed whenever possible */
+	cr->has_blockhtml = cr->make.blockhtml || cr->span.blockhtml;
+	streamed = cr->span.table_begin && cr->span.table_end
+	    && cr->span.row_begin && cr->span.row_end
+	    && cr->span.cell_begin && cr->span.cell_end;
+	cr->table_buffered = !streamed && cr->make.table
+	    && cr->make.table_row && cr->make.table_cell;
+	cr->has_table = streamed || cr->table_buffered; }
+
+
+/* context_share • fills the render structure around compiled tables */
+/*	rules are only read, so that they can be shared by several threads */
+static void
+context_share(struct mkd_context *ctx, const struct mkd_compiled *rules) {
+	struct render *rndr = &ctx->rndr;
+
+	rndr->rules = rules;
+	rndr->make = rules->make;
+	rndr->span = rules->span;
+	arr_init(&rndr->refs, sizeof (struct link_ref));
+	rndr->ref_slot = 0;
+	rndr->ref_slot_size = 0;
+	arr_init(&rndr->ref_lines, sizeof (size_t));
+	rndr->ref_data = 0;
+	rndr->ref_size = 0;
+	rndr->ref_id_max = 0;
+	parr_init(&rndr->work);
+	parr_init(&rndr->quote);
+	arr_init(&rndr->spans, sizeof (struct inline_frame));
+	arr_init(&rndr->frames, sizeof (struct block_frame));
+	arr_init(&rndr->nest_map, sizeof (struct src_seg));
+	index_init(&rndr->index);
+	rndr->flush_ob = 0;
+	rndr->blocks = 0;
+	rndr->html_max = 0;
+	rndr->budget = 0;
+	rndr->over = MKD_OK;
+	rndr->extract = 0;
+	rndr->src_map = 0;
+	rndr->src_text = 0;
+	rndr->src_size = 0;
+	rndr->src_input = 0;
+	arena_init(&rndr->arena, ARENA_UNIT);
+	arr_init(&ctx->src_map, sizeof (struct src_seg));
+	ctx->text = 0; }
+
+
+/* context_init • fills the render structure and its own compiled tables */
+static void
+context_init(struct mkd_context *ctx, const struct mkd_renderer *rndrer) {
+	compile_init(&ctx->own, rndrer);
+	context_share(ctx, &ctx->own); }
+
+
+/* context_reset • releases the references of the previous document */
+static void
+context_reset(struct mkd_context *ctx) {
+	/* link_ref buffers live in the arena */
+	if (ctx->rndr.refs.size)
+		memset(ctx->rndr.ref_slot, 0,
+			ctx->rndr.ref_slot_size * sizeof *ctx->rndr.ref_slot);
+	ctx->rndr.refs.size = 0;
+	ctx->rndr.ref_lines.size = 0;
+	ctx->rndr.ref_id_max = 0;
+	ctx->rndr.src_map = 0;
+	ctx->rndr.src_text = 0;
+	arena_reset(&ctx->rndr.arena);
+	if (ctx->text) ctx->text->size = 0; }
+
+
+/* context_release • frees every resource held by the render structure */
+static void
+context_release(struct mkd_context *ctx) {
+	context_reset(ctx);
+	arr_free(&ctx->rndr.refs);
+	arr_free(&ctx->rndr.ref_lines);
+	arr_free(&ctx->src_map);
+	free(ctx->rndr.ref_slot);
+	ctx->rndr.ref_slot = 0;
+	ctx->rndr.ref_slot_size = 0;
+	render_release(&ctx->rndr);
+	bufrelease(ctx->text);
+	ctx->text = 0; }
+
+
+/* context_text • first pass, looking for references */
+/*	the other lines are copied into ctx->text, except for input without */
+/*	CR nor reference which is returned in place; returns 0 on failure */
+static int
+context_text(struct mkd_context *ctx, struct buf *ib,
+					char **data, size_t *size) {
+	struct render *rndr = &ctx->rndr;
+	struct buf *text;
+	int copied = 0;
+
+	/* most input has no "]:" at all, and needs neither a copy nor refs */
+	*data = ib->data;
+	*size = ib->size;
+	rndr->ref_data = ib->data;
+	rndr->ref_size = ib->size;
+	if (!*size || (ib->data[ib->size - 1] == '\n'
+	&& next_ref_line(ib->data, 0, ib->size) >= ib->size
+	&& !memchr(ib->data, '\r', ib->size)))
+		return 1;
+
+	if (!ctx->text) {
+		if ((ctx->text = bufnew(TEXT_UNIT)) == 0) return 0;
+		bufsetgrowth(ctx->text, GROWTH, 0); }
+	text = ctx->text;
+	text->size = 0;
+	/* the copy is never longer than the input and its final newline */
+	bufgrow(text, ib->size + 1);
+
+	if (memchr(*data, '\r', *size)) {
+		parse_refs(rndr, text, *data, *size, *size);
+		copied = 1; }
+	else
+		copied = strip_refs(rndr, text, *data, *size);
+	if (copied) {
+		/* adding a final newline if not already present */
+		if (text->size
+		&&  text->data[text->size - 1] != '\n'
+		&&  text->data[text->size - 1] != '\r')
+			bufputc(text, '\n');
+		*data = text->data;
+		*size = text->size; }
+	return 1; }
+
+
+/* context_render • parses a whole document using the given context */
+static void
+context_render(struct mkd_context *ctx, struct buf *ob, struct buf *ib,
+							int nthreads) {
+	struct render *rndr = &ctx->rndr;
+	char *data;
+	size_t size, hint;
+#ifdef MKD_PROFILE
+	unsigned long grow_nb = buffer_prof_grow_nb;
+	size_t grow_bytes = buffer_prof_grow_bytes;
+	double t0 = stats_time(), t1;
+
+	memset(&rndr->stats, 0, sizeof rndr->stats);
+#endif
+
+#ifndef MKD_SPECIAL
+	/* built-in renderers have a parser calling them directly */
+	if (rndr->rules->special) {
+		rndr->rules->special(ctx, ob, ib, nthreads);
+#ifdef MKD_PROFILE
+		last_stats = rndr->stats;
+#endif
+		return; }
+#endif
+
+	/* output is usually a bit larger than the input, unless dropped */
+	hint = ib->size + ib->size / 10 * 3;
+	if (rndr->budget && rndr->budget->max_output
+	&& hint > rndr->budget->max_output)
+		hint = rndr->budget->max_output;
+	if (rndr->budget && rndr->budget->max_memory
+	&& hint > rndr->budget->max_memory / 2)
+		hint = rndr->budget->max_memory / 2;
+	if (ob != rndr->flush_ob && !rndr->extract)
+		bufgrow(ob, ob->size + hint);
+
+	/* first pass: looking for references, copying everything else */
+	/*	with the input offsets of the copy when ranges are needed */
+	rndr->src_map = 0;
+	if (MAKE(rndr)->block_source || rndr->extract) {
+		ctx->src_map.size = 0;
+		rndr->nest_map.size = 0;
+		rndr->src_map = &ctx->src_map; }
+	if (!context_text(ctx, ib, &data, &size)) return;
+	rndr->src_text = data;
+	rndr->src_size = size;
+	rndr->src_input = ib->size;
+#ifdef MKD_PROFILE
+	t1 = stats_time();
+	rndr->stats.pass1_time = t1 - t0;
+#endif
 
 	/* second pass: actual rendering */
-	if (rndr.make.prolog)
-		rndr.make.prolog(ob, rndr.make.opaque);
-	parse_block(ob, &rndr, text->data, text->size);
-	if (rndr.make.epilog)
-		rndr.make.epilog(ob, rndr.make.opaque);
+	if (MAKE(rndr)->prolog)
+		MAKE(rndr)->prolog(ob, rndr->make.opaque);
+	if (nthreads > 1 && size >= 2 * PARALLEL_MIN)
+		render_parallel(rndr, ob, data, size, nthreads);
+	else
+		parse_block(ob, rndr, data, size);
+	if (MAKE(rndr)->epilog)
+		MAKE(rndr)->epilog(ob, rndr->make.opaque);
+#ifdef MKD_PROFILE
+	rndr->stats.pass2_time = stats_time() - t1;
+	rndr->stats.reallocs += buffer_prof_grow_nb - grow_nb;
+	rndr->stats.grown_bytes += buffer_prof_grow_bytes - grow_bytes;
+	last_stats = rndr->stats;
+#endif
 
 	/* clean-up */
-	bufrelease(text);
-	lr = rndr.refs.base;
-	for (i = 0; i < rndr.refs.size; i += 1) {
-		bufrelease(lr[i].id);
-		bufrelease(lr[i].link);
-		bufrelease(lr[i].title); }
-	arr_free(&rndr.refs);
-	assert(rndr.work.size == 0);
-	for (i = 0; i < rndr.work.asize; i += 1)
-		bufrelease(rndr.work.item[i]);
-	parr_free(&rndr.work); }
+	assert(rndr->work.size == 0);
+	context_reset(ctx); }
+
+
+
+/* specialized parsers only keep context_render, for their entry point */
+#ifndef MKD_SPECIAL
+
+/**********************
+ * STREAMED RENDERING *
+ **********************/
+
+/* stream_seed • prepares the output buffer for the next blocks */
+/*	returns the size of the seed standing for the output already sent */
+static size_t
+stream_seed(struct mkd_stream *st) {
+	st->out->size = 0;
+	if (!st->emitted) return 0;
+	bufputc(st->out, st->last);
+	return st->out->size; }
+
+
+/* stream_emit • sends the output buffer, minus its seed, to the sink */
+static void
+stream_emit(struct mkd_stream *st, size_t seeded) {
+	if (st->out->size > seeded) {
+		st->sink(st->out->data + seeded, st->out->size - seeded,
+							st->opaque);
+		st->emitted = 1;
+		st->last = st->out->data[st->out->size - 1]; }
+	st->out->size = 0; }
+
+
+/* stream_start • sends the prolog of a new document */
+static void
+stream_start(struct mkd_stream *st) {
+	struct render *rndr = &st->ctx.rndr;
+	size_t seeded;
+
+	if (st->started) return;
+	st->started = 1;
+	seeded = stream_seed(st);
+	if (MAKE(rndr)->prolog)
+		MAKE(rndr)->prolog(st->out, rndr->make.opaque);
+	stream_emit(st, seeded); }
+
+
+/* stream_refs • runs the reference pass on the lines seen in full */
+/*	a line is handled only when enough newlines follow it for is_ref, */
+/*	and a trailing CR is kept until it is known whether LF follows */
+static void
+stream_refs(struct mkd_stream *st, int final) {
+	struct buf *in = st->in;
+	size_t size = in->size, limit, n = 0;
+
+	if (!final && size && in->data[size - 1] == '\r') size -= 1;
+	limit = size;
+	if (!final) {
+		while (limit > 0 && n < STREAM_LOOKAHEAD) {
+			limit -= 1;
+			if (in->data[limit] == '\n' || in->data[limit] == '\r')
+				n += 1; }
+		if (n < STREAM_LOOKAHEAD) return; }
+	if (limit)
+		bufslurp(in, parse_refs(&st->ctx.rndr, st->ctx.text,
+						in->data, size, limit)); }
+
+
+/* stream_blocks • renders the text up to the last certain block boundary */
+/*	HTML blocks may end anywhere in the input, so the boundary search */
+/*	waits at an HTML block opening until its end is known, looking for */
+/*	it only in the new text, and up to html_max bytes */
+static void
+stream_blocks(struct mkd_stream *st) {
+	struct render *rndr = &st->ctx.rndr;
+	struct buf *text = st->ctx.text;
+	size_t beg, end, len, seeded, window;
+	int more;
+
+	while (st->scan < text->size) {
+		beg = st->scan;
+		end = line_end(text->data, beg, text->size);
+		if (is_empty(text->data + beg, end - beg)) {
+			st->blank = 1;
+			st->scan = end;
+			continue; }
+		if (st->blank && beg > 0 && beg >= st->html_end
+		&& is_block_cut(rndr, text->data + beg, end - beg))
+			st->cut = beg;
+		if (text->data[beg] == '<' && HAS_BLOCKHTML(rndr)) {
+			if (beg != st->html_beg) st->html_seen = 0;
+			st->html_beg = beg;
+			window = text->size - beg;
+			if (window > rndr->html_max) window = rndr->html_max;
+			len = htmlblock_length(text->data + beg, window, &more,
+							&st->html_seen);
+			if (more && window < rndr->html_max) break;
+			st->html_seen = 0;
+			if (beg + len > st->html_end)
+				st->html_end = beg + len; }
+		st->blank = 0;
+		st->scan = end; }
+	if (!st->cut) return;
+
+	/* rendering, and dropping the output of mis-guessed boundaries */
+	seeded = stream_seed(st);
+	if (parse_block_until(st->out, rndr, text->data, text->size, st->cut)
+							== st->cut) {
+		stream_emit(st, seeded);
+		bufslurp(text, st->cut);
+		st->scan -= st->cut;
+		st->html_end = (st->html_end > st->cut)
+				? st->html_end - st->cut : 0;
+		st->html_beg = (st->html_beg > st->cut)
+				? st->html_beg - st->cut : 0; }
+	else st->out->size = 0;
+	st->cut = 0; }
+
+
+/* stream_end • renders the rest of the document and resets the stream */
+static void
+stream_end(struct mkd_stream *st) {
+	struct render *rndr = &st->ctx.rndr;
+	struct buf *text = st->ctx.text;
+	size_t seeded;
+
+	stream_start(st);
+	stream_refs(st, 1);
+	st->in->size = 0;
+	if (text->size && text->data[text->size - 1] != '\n')
+		bufputc(text, '\n');
+	seeded = stream_seed(st);
+	parse_block(st->out, rndr, text->data, text->size);
+	if (MAKE(rndr)->epilog)
+		MAKE(rndr)->epilog(st->out, rndr->make.opaque);
+	stream_emit(st, seeded);
+
+	/* getting ready for the next document */
+	assert(rndr->work.size == 0);
+	context_reset(&st->ctx);
+	st->scan = st->cut = st->html_end = 0;
+	st->html_beg = st->html_seen = 0;
+	st->blank = st->started = st->emitted = 0; }
+
+
+
+/*************************
+ * INCREMENTAL RENDERING *
+ *************************/
+
+/* document_buf • allocates one of the buffers of a document */
+static struct buf *
+document_buf(void) {
+	struct buf *ret = bufnew(TEXT_UNIT);
+	if (ret) bufsetgrowth(ret, GROWTH, 0);
+	return ret; }
+
+
+/* common_head • length of the common beginning of two arrays */
+static size_t
+common_head(const char *a, const char *b, size_t size) {
+	size_t i = 0;
+	while (i + TEXT_UNIT <= size && memcmp(a + i, b + i, TEXT_UNIT) == 0)
+		i += TEXT_UNIT;
+	while (i < size && a[i] == b[i]) i += 1;
+	return i; }
+
+
+/* common_tail • length of the common end of two arrays */
+/*	a and b point just after the last byte of each array */
+static size_t
+common_tail(const char *a, const char *b, size_t size) {
+	size_t i = 0;
+	while (i + TEXT_UNIT <= size
+	&& memcmp(a - i - TEXT_UNIT, b - i - TEXT_UNIT, TEXT_UNIT) == 0)
+		i += TEXT_UNIT;
+	while (i < size && a[-i - 1] == b[-i - 1]) i += 1;
+	return i; }
+
+
+/* document_swap • keeps the current render as the old one */
+static void
+document_swap(struct mkd_document *doc) {
+	struct buf *tmp;
+	struct array blocks;
+
+	tmp = doc->old_text;
+	doc->old_text = doc->text;
+	doc->text = tmp;
+	tmp = doc->old_out;
+	doc->old_out = doc->out;
+	doc->out = tmp;
+	tmp = doc->old_refs;
+	doc->old_refs = doc->refs;
+	doc->refs = tmp;
+	blocks = doc->old_blocks;
+	doc->old_blocks = doc->blocks;
+	doc->blocks = blocks;
+	doc->text->size = doc->out->size = doc->refs->size = 0;
+	doc->blocks.size = 0; }
+
+
+/* document_field • appends a length-prefixed copy of a buffer */
+static void
+document_field(struct buf *ob, struct buf *field) {
+	if (!field) {
+		bufputc(ob, '-');
+		return; }
+	bufputi(ob, (long)field->size);
+	bufputc(ob, ':');
+	bufput(ob, field->data, field->size); }
+
+
+/* document_refs • serializes the references, in definition order */
+static void
+document_refs(struct mkd_document *doc) {
+	struct link_ref *lr;
+	int i;
+	if (doc->ctx.rndr.ref_lines.size) resolve_refs(&doc->ctx.rndr);
+	lr = doc->ctx.rndr.refs.base;
+	for (i = 0; i < doc->ctx.rndr.refs.size; i += 1) {
+		document_field(doc->refs, lr[i].id);
+		document_field(doc->refs, lr[i].link);
+		document_field(doc->refs, lr[i].title); } }
+
+
+/* document_copy • appends the old blocks from..to-1, with their output */
+/*	shift moves the text offsets, wrapping around for a negative one */
+static void
+document_copy(struct mkd_document *doc, int from, int to, size_t shift) {
+	struct doc_block *old, *blk;
+	size_t org, out = doc->out->size;
+	int i;
+
+	if (from >= to) return;
+	old = arr_item(&doc->old_blocks, from);
+	org = old->out;
+	old = arr_item(&doc->old_blocks, to - 1);
+	bufput(doc->out, doc->old_out->data + org, old->out_end - org);
+	for (i = from; i < to; i += 1) {
+		if ((blk = arr_push(&doc->blocks)) == 0) return;
+		old = arr_item(&doc->old_blocks, i);
+		blk->beg = old->beg + shift;
+		blk->end = old->end + shift;
+		blk->dep = old->dep ? old->dep + shift : 0;
+		blk->out = old->out - org + out;
+		blk->out_end = old->out_end - org + out; } }
+
+
+/* document_blocks • renders the text, reusing the blocks left untouched */
+/*	old blocks are kept before the edit as long as their parse did not */
+/*	read the edited text, and after the edit as soon as a block parsed */
+/*	anew ends where an old block of the unchanged tail begins, since */
+/*	a top-level block only depends on the text following its beginning */
+static void
+document_blocks(struct mkd_document *doc, char *data, size_t size) {
+	struct render *rndr = &doc->ctx.rndr;
+	struct buf *old = doc->old_text, *out = doc->out;
+	struct doc_block *blk;
+	size_t head = 0, tail = 0, common, shift, pos, stop, beg;
+	int i = 0, j, k, n, nb = doc->valid ? doc->old_blocks.size : 0;
+
+	/* common head and tail of the old and new texts */
+	if (doc->valid) {
+		common = size < old->size ? size : old->size;
+		head = common_head(data, old->data, common);
+		tail = common_tail(data + size, old->data + old->size,
+							common - head); }
+	shift = size - old->size;
+
+	/* blocks before the edit */
+	while (i < nb && (blk = arr_item(&doc->old_blocks, i))->dep
+	&& blk->dep <= head)
+		i += 1;
+	if (i && (((struct doc_block *)doc->old_blocks.base)->out != 0)
+							!= (out->size != 0))
+		i = 0;
+	document_copy(doc, 0, i, 0);
+	pos = i ? ((struct doc_block *)arr_item(&doc->old_blocks, i - 1))->end
+		: 0;
+
+	/* parsing until an old block of the tail can be used again */
+	rndr->blocks = &doc->blocks;
+	j = i;
+	while (pos < size) {
+		while (j < nb && ((blk = arr_item(&doc->old_blocks, j))->beg
+						< old->size - tail
+				|| blk->beg + shift < pos))
+			j += 1;
+		stop = (j < nb) ? blk->beg + shift : size;
+		n = doc->blocks.size;
+		beg = pos;
+		pos += parse_block_until(out, rndr, data + pos, size - pos,
+								stop - pos);
+		for (k = n; k < doc->blocks.size; k += 1) {
+			blk = arr_item(&doc->blocks, k);
+			blk->beg += beg;
+			blk->end += beg;
+			if (blk->dep) blk->dep += beg; }
+		if (j < nb && pos == stop) {
+			blk = arr_item(&doc->old_blocks, j);
+			if ((blk->out != 0) == (out->size != 0)) {
+				document_copy(doc, j, nb, shift);
+				break; }
+			j += 1; } }
+	rndr->blocks = 0; }
+
+
+/* document_render • renders a new version of the document */
+static void
+document_render(struct mkd_document *doc, struct buf *ob, struct buf *ib) {
+	struct render *rndr = &doc->ctx.rndr;
+	struct buf *text;
+	char *data;
+	size_t size;
+	int seeded = (ob->size != 0);
+	char seed = seeded ? ob->data[ob->size - 1] : 0;
+
+	document_swap(doc);
+	if (!context_text(&doc->ctx, ib, &data, &size)) {
+		doc->valid = 0;
+		return; }
+	if (doc->ctx.text && data == doc->ctx.text->data) {
+		/* keeping the copy made by the first pass */
+		text = doc->text;
+		doc->text = doc->ctx.text;
+		doc->ctx.text = text; }
+	else bufput(doc->text, data, size);
+	document_refs(doc);
+
+	/* a change of references or of seed invalidates every block */
+	if (doc->refs->size != doc->old_refs->size
+	|| (doc->refs->size && memcmp(doc->refs->data, doc->old_refs->data,
+						doc->refs->size) != 0)
+	|| seeded != doc->seeded || seed != doc->seed)
+		doc->valid = 0;
+	doc->seeded = seeded;
+	doc->seed = seed;
+
+	/* rendering into out, seeded like ob */
+	if (seeded) bufputc(doc->out, seed);
+	if (MAKE(rndr)->prolog)
+		MAKE(rndr)->prolog(doc->out, rndr->make.opaque);
+	document_blocks(doc, doc->text->data, doc->text->size);
+	if (MAKE(rndr)->epilog)
+		MAKE(rndr)->epilog(doc->out, rndr->make.opaque);
+	bufput(ob, doc->out->data + seeded, doc->out->size - seeded);
+
+	/* clean-up */
+	assert(rndr->work.size == 0);
+	context_reset(&doc->ctx);
+	doc->valid = 1; }
+
+
+
+/***********************
+ * METADATA EXTRACTION *
+ ***********************/
+
+/* extract_skip_header • header callback, recorded by the parser */
+static void
+extract_skip_header(struct buf *ob, struct buf *text, int level,
+							void *opaque) {
+	return; }
+
+
+/* extract_skip_flags • table callback outputting nothing */
+static void
+extract_skip_flags(struct buf *ob, int flags, void *opaque) {
+	return; }
+
+
+/* extract_skip_text • slice callback dropping the text */
+static void
+extract_skip_text(struct buf *ob, const char *text, size_t size,
+							void *opaque) {
+	return; }
+
+
+/* extract_skip_span • codespan and raw_html_tag callback, dropping them */
+static int
+extract_skip_span(struct buf *ob, const char *text, size_t size,
+							void *opaque) {
+	return 1; }
+
+
+/* extract_skip_autolink • autolink callback, recorded by char_langle_tag */
+static int
+extract_skip_autolink(struct buf *ob, const char *link, size_t size,
+					enum mkd_autolink type, void *opaque) {
+	return 1; }
+
+
+/* extract_skip_emphasis • emphasis callback, dropping the span */
+static int
+extract_skip_emphasis(struct buf *ob, struct buf *text, char c,
+							void *opaque) {
+	return 1; }
+
+
+/* extract_skip_link • link and image callback, recorded by char_link */
+static int
+extract_skip_link(struct buf *ob, struct buf *link, struct buf *title,
+					struct buf *content, void *opaque) {
+	return 1; }
+
+
+/* extract_renderer • renderer parsing the blocks and links of syntax */
+/*	blocks and spans keep the syntax of syn, except for line breaks */
+/*	left as text, but nothing is output and no span is refused */
+static void
+extract_renderer(struct mkd_renderer *rndr, struct mkd_span_renderer *spans,
+				const struct mkd_renderer *syn) {
+	const struct mkd_span_renderer *ss = syn->spans;
+
+	memset(rndr, 0, sizeof *rndr);
+	memset(spans, 0, sizeof *spans);
+
+	/* block kinds found by the parser depend on these */
+	if (syn->header) rndr->header = extract_skip_header;
+	if (syn->blockhtml || (ss && ss->blockhtml))
+		spans->blockhtml = extract_skip_text;
+	if ((syn->table && syn->table_row && syn->table_cell)
+	|| (ss && ss->table_begin && ss->table_end && ss->row_begin
+	    && ss->row_end && ss->cell_begin && ss->cell_end)) {
+		spans->table_begin = spans->table_end = extract_skip_flags;
+		spans->row_begin = spans->row_end = extract_skip_flags;
+		spans->cell_begin = spans->cell_end = extract_skip_flags; }
+
+	/* spans, never refused */
+	if (syn->autolink || (ss && ss->autolink))
+		spans->autolink = extract_skip_autolink;
+	if (syn->codespan || (ss && ss->codespan))
+		spans->codespan = extract_skip_span;
+	if (syn->double_emphasis)
+		rndr->double_emphasis = extract_skip_emphasis;
+	if (syn->emphasis) rndr->emphasis = extract_skip_emphasis;
+	if (syn->image) rndr->image = extract_skip_link;
+	if (syn->link) rndr->link = extract_skip_link;
+	if (syn->raw_html_tag || (ss && ss->raw_html_tag))
+		spans->raw_html_tag = extract_skip_span;
+	if (syn->triple_emphasis)
+		rndr->triple_emphasis = extract_skip_emphasis;
+	spans->entity = spans->normal_text = extract_skip_text;
+
+	rndr->max_work_stack = syn->max_work_stack;
+	rndr->emph_chars = syn->emph_chars;
+	rndr->flags = syn->flags;
+	rndr->spans = spans; }
+
+
+
+/**********************
+ * EXPORTED FUNCTIONS *
+ **********************/
+
+/* markdown • parses the input buffer and renders it into the output buffer */
+void
+markdown(struct buf *ob, struct buf *ib, const struct mkd_renderer *rndrer) {
+	struct mkd_context ctx;
+	if (!rndrer) return;
+	context_init(&ctx, rndrer);
+	context_render(&ctx, ob, ib, 1);
+	context_release(&ctx); }
+
+
+/* markdown_compiled • renders a document with shared compiled tables */
+void
+markdown_compiled(struct buf *ob, struct buf *ib,
+				const struct mkd_compiled *rules) {
+	struct mkd_context ctx;
+	if (!rules) return;
+	context_share(&ctx, rules);
+	context_render(&ctx, ob, ib, 1);
+	context_release(&ctx); }
+
+
+/* markdown_parallel • renders a large document using several threads */
+void
+markdown_parallel(struct buf *ob, struct buf *ib,
+			const struct mkd_renderer *rndrer, int nthreads) {
+	struct mkd_context ctx;
+	if (!rndrer) return;
+	context_init(&ctx, rndrer);
+	context_render(&ctx, ob, ib, nthreads);
+	context_release(&ctx); }
+
+
+/* mkd_compile • builds the shared tables of a renderer */
+struct mkd_compiled *
+mkd_compile(const struct mkd_renderer *rndrer) {
+	struct mkd_compiled *cr;
+	if (!rndrer) return 0;
+	cr = malloc(sizeof *cr);
+	if (cr) compile_init(cr, rndrer);
+	return cr; }
+
+
+/* mkd_compiled_free • releases compiled tables */
+void
+mkd_compiled_free(struct mkd_compiled *rules) {
+	free(rules); }
+
+
+/* mkd_context_free • releases a context and all its pooled buffers */
+void
+mkd_context_free(struct mkd_context *ctx) {
+	if (!ctx) return;
+	context_release(ctx);
+	free(ctx); }
+
+
+/* mkd_context_new • allocates a parser context for the given renderer */
+struct mkd_context *
+mkd_context_new(const struct mkd_renderer *rndrer) {
+	struct mkd_context *ctx;
+	if (!rndrer) return 0;
+	ctx = malloc(sizeof *ctx);
+	if (ctx) context_init(ctx, rndrer);
+	return ctx; }
+
+
+/* mkd_document_free • releases an incremental document */
+void
+mkd_document_free(struct mkd_document *doc) {
+	if (!doc) return;
+	context_release(&doc->ctx);
+	bufrelease(doc->text);
+	bufrelease(doc->out);
+	bufrelease(doc->refs);
+	bufrelease(doc->old_text);
+	bufrelease(doc->old_out);
+	bufrelease(doc->old_refs);
+	arr_free(&doc->blocks);
+	arr_free(&doc->old_blocks);
+	free(doc); }
+
+
+/* mkd_document_new • allocates an incremental document */
+struct mkd_document *
+mkd_document_new(const struct mkd_renderer *rndrer) {
+	struct mkd_document *doc;
+	if (!rndrer || (doc = malloc(sizeof *doc)) == 0) return 0;
+	context_init(&doc->ctx, rndrer);
+	arr_init(&doc->blocks, sizeof (struct doc_block));
+	arr_init(&doc->old_blocks, sizeof (struct doc_block));
+	doc->text = document_buf();
+	doc->out = document_buf();
+	doc->refs = document_buf();
+	doc->old_text = document_buf();
+	doc->old_out = document_buf();
+	doc->old_refs = document_buf();
+	if (!doc->text || !doc->out || !doc->refs
+	|| !doc->old_text || !doc->old_out || !doc->old_refs) {
+		mkd_document_free(doc);
+		return 0; }
+	doc->valid = doc->seeded = 0;
+	doc->seed = 0;
+	return doc; }
+
+
+/* mkd_document_render • renders the current version of a document */
+void
+mkd_document_render(struct mkd_document *doc, struct buf *ob,
+							struct buf *ib) {
+	if (doc && ob && ib) document_render(doc, ob, ib); }
+
+
+/* mkd_estimate_output • guesses the size of the rendering of a document */
+size_t
+mkd_estimate_output(const struct buf *ib, const struct mkd_renderer *rndr) {
+	size_t i, lines = 0, marks = 0, escaped = 0;
+
+	if (!ib || !ib->size) return 0;
+	for (i = 0; i < ib->size; i += 1)
+		switch (ib->data[i]) {
+			case '\n': lines += 1; break;
+			case '*': case '_': case '`': case '[':
+				marks += 1;
+				break;
+			case '<': case '>': case '&': case '"':
+				escaped += 1;
+				break; }
+
+	/* entities only come from a text callback */
+	if (!rndr || (!rndr->normal_text
+	&& (!rndr->spans || !rndr->spans->normal_text)))
+		escaped = 0;
+
+	/* tags of the blocks around the lines and of the spans, entities */
+	return ib->size + ib->size / 8 + lines * 10 + marks * 6
+						+ escaped * 4 + 64; }
+
+
+/* mkd_extract_free • releases the result of mkd_extract_new */
+void
+mkd_extract_free(struct mkd_extract *ex) {
+	if (!ex) return;
+	free(ex->heading);
+	free(ex->link);
+	bufrelease(ex->text);
+	free(ex); }
+
+
+/* mkd_extract_new • finds headings and links without rendering, or NULL */
+struct mkd_extract *
+mkd_extract_new(struct buf *ib, const struct mkd_renderer *syntax) {
+	struct mkd_renderer rndr;
+	struct mkd_span_renderer spans;
+	struct extract_state ex;
+	struct mkd_context ctx;
+	struct mkd_extract *ret;
+	struct buf *ob;
+
+	if (!ib || !syntax || (ret = malloc(sizeof *ret)) == 0) return 0;
+	arr_init(&ex.heading, sizeof (struct mkd_heading));
+	arr_init(&ex.link, sizeof (struct mkd_link));
+	ex.text = bufnew(EXTRACT_UNIT);
+	ex.failed = 0;
+	ob = bufnew(WORK_UNIT);
+	if (ex.text) bufsetgrowth(ex.text, GROWTH, 0);
+
+	extract_renderer(&rndr, &spans, syntax);
+	context_init(&ctx, &rndr);
+	ctx.rndr.extract = &ex;
+	if (ex.text && ob) context_render(&ctx, ob, ib, 1);
+	context_release(&ctx);
+	bufrelease(ob);
+
+	if (ex.failed || !ex.text || !ob) {
+		arr_free(&ex.heading);
+		arr_free(&ex.link);
+		bufrelease(ex.text);
+		free(ret);
+		return 0; }
+	ret->heading = ex.heading.base;
+	ret->heading_nb = ex.heading.size;
+	ret->link = ex.link.base;
+	ret->link_nb = ex.link.size;
+	ret->text = ex.text;
+	return ret; }
+
+
+/* mkd_render • renders a document, reusing the context from previous ones */
+void
+mkd_render(struct mkd_context *ctx, struct buf *ob, struct buf *ib) {
+	if (!ctx || !ob || !ib) return;
+	context_render(ctx, ob, ib, 1); }
+
+
+/* mkd_render_budget • renders a document within the given limits */
+enum mkd_status
+mkd_render_budget(struct mkd_context *ctx, struct buf *ob, struct buf *ib,
+					const struct mkd_budget *budget) {
+	struct render *rndr;
+	enum mkd_status ret;
+
+	if (!ctx || !ob || !ib) return MKD_OK;
+	rndr = &ctx->rndr;
+	rndr->budget = budget;
+	rndr->over = MKD_OK;
+	rndr->steps = 0;
+	rndr->out_ob = ob;
+	rndr->out_base = ob->size;
+	context_render(ctx, ob, ib, 1);
+	ret = rndr->over;
+	rndr->budget = 0;
+	rndr->over = MKD_OK;
+	return ret; }
+
+
+/* mkd_render_parallel • renders a document on several threads */
+void
+mkd_render_parallel(struct mkd_context *ctx, struct buf *ob, struct buf *ib,
+							int nthreads) {
+	if (!ctx || !ob || !ib) return;
+	context_render(ctx, ob, ib, nthreads); }
+
+
+/* mkd_render_sink • renders a document, sending its output to a sink */
+void
+mkd_render_sink(struct mkd_context *ctx, struct buf *ib,
+			mkd_sink sink, void *opaque, size_t mark) {
+	struct buf *ob;
+	if (!ctx || !ib || !sink || (ob = bufnew(WORK_UNIT)) == 0) return;
+	bufsetgrowth(ob, GROWTH, 0);
+	ctx->rndr.flush_ob = ob;
+	ctx->rndr.flush_mark = mark;
+	ctx->rndr.flush = sink;
+	ctx->rndr.flush_opaque = opaque;
+	context_render(ctx, ob, ib, 1);
+	if (ob->size) sink(ob->data, ob->size, opaque);
+	ctx->rndr.flush_ob = 0;
+	bufrelease(ob); }
+
+
+/* mkd_stats • fills the counters of the last rendering of this thread */
+void
+mkd_stats(struct mkd_stats *stats) {
+#ifdef MKD_PROFILE
+	if (stats) *stats = last_stats; }
+#else
+	if (stats) memset(stats, 0, sizeof *stats); }
+#endif
+
+
+/* mkd_stream_end • finishes the current document of a stream */
+void
+mkd_stream_end(struct mkd_stream *st) {
+	if (st) stream_end(st); }
+
+
+/* mkd_stream_free • releases a stream, without finishing its document */
+void
+mkd_stream_free(struct mkd_stream *st) {
+	if (!st) return;
+	context_release(&st->ctx);
+	bufrelease(st->in);
+	bufrelease(st->out);
+	free(st); }
+
+
+/* mkd_stream_new • allocates a stream rendering into the given sink */
+struct mkd_stream *
+mkd_stream_new(const struct mkd_renderer *rndrer, mkd_sink sink,
+							void *opaque) {
+	struct mkd_stream *st;
+	if (!rndrer || !sink || (st = malloc(sizeof *st)) == 0) return 0;
+	context_init(&st->ctx, rndrer);
+	/* the input of a stream moves, so its refs are always stored */
+	st->ctx.rndr.make.flags &= ~MKD_LAZY_REFS;
+	st->ctx.rndr.html_max = STREAM_HTML_MAX;
+	st->ctx.text = bufnew(STREAM_UNIT);
+	st->in = bufnew(STREAM_UNIT);
+	st->out = bufnew(STREAM_UNIT);
+	if (!st->ctx.text || !st->in || !st->out) {
+		mkd_stream_free(st);
+		return 0; }
+	bufsetgrowth(st->ctx.text, GROWTH, 0);
+	bufsetgrowth(st->in, GROWTH, 0);
+	bufsetgrowth(st->out, GROWTH, 0);
+	st->sink = sink;
+	st->opaque = opaque;
+	st->scan = st->cut = st->html_end = 0;
+	st->html_beg = st->html_seen = 0;
+	st->blank = st->started = st->emitted = 0;
+	st->last = 0;
+	return st; }
+
+
+/* mkd_stream_push • feeds input data, rendering the completed blocks */
+void
+mkd_stream_push(struct mkd_stream *st, const char *data, size_t size) {
+	if (!st || !size) return;
+	stream_start(st);
+	bufput(st->in, data, size);
+	stream_refs(st, 0);
+	stream_blocks(st); }
+
+#else /* def MKD_SPECIAL */
+
+/* MKD_SPECIAL_RENDER • entry point of the specialized parser */
+void
+MKD_SPECIAL_RENDER(struct mkd_context *ctx, struct buf *ob, struct buf *ib,
+							int nthreads) {
+	context_render(ctx, ob, ib, nthreads); }
+
+#endif /* ndef MKD_SPECIAL */
 
 /* vim: set filetype=c: */
@@ -34,6 +34,44 @@ enum mkd_autolink {
 	MKDA_IMPLICIT_EMAIL	/* e-mail link without mailto: */
 };
 
+/* mkd_sink • receives the output of a stream as it is rendered */
+typedef void (*mkd_sink)(const char *data, size_t size, void *opaque);
+
+/* mkd_span_renderer • callbacks taking slices of the input as they are */
+/*	the text is passed without wrapping it in a struct buf, each callback */
+/*	is used instead of its mkd_renderer counterpart when it is set, so a */
+/*	copy of a renderer overriding one of those also clears it here */
+struct mkd_span_renderer {
+	/* block level callbacks */
+	void (*blockhtml)(struct buf *ob, const char *text, size_t size,
+							void *opaque);
+
+	/* table callbacks, writing around cells parsed straight into ob */
+	/*	used instead of table, table_row and table_cell when all of */
+	/*	them are set; flags is MKD_CELL_HEAD for a table with a head */
+	/*	row and for that row, and the alignment is added for cells */
+	void (*table_begin)(struct buf *ob, int flags, void *opaque);
+	void (*table_end)(struct buf *ob, int flags, void *opaque);
+	void (*row_begin)(struct buf *ob, int flags, void *opaque);
+	void (*row_end)(struct buf *ob, int flags, void *opaque);
+	void (*cell_begin)(struct buf *ob, int flags, void *opaque);
+	void (*cell_end)(struct buf *ob, int flags, void *opaque);
+
+	/* span level callbacks - return 0 prints the span verbatim */
+	int (*autolink)(struct buf *ob, const char *link, size_t size,
+					enum mkd_autolink type, void *opaque);
+	int (*codespan)(struct buf *ob, const char *text, size_t size,
+							void *opaque);
+	int (*raw_html_tag)(struct buf *ob, const char *tag, size_t size,
+							void *opaque);
+
+	/* low level callbacks */
+	void (*entity)(struct buf *ob, const char *entity, size_t size,
+							void *opaque);
+	void (*normal_text)(struct buf *ob, const char *text, size_t size,
+							void *opaque);
+};
+
 /* mkd_renderer • functions for rendering parsed data */
 struct mkd_renderer {
 	/* document level callbacks */
@@ -79,11 +117,119 @@ struct mkd_renderer {
 	void (*normal_text)(struct buf *ob, struct buf *text, void *opaque);
 
 	/* renderer data */
-	int max_work_stack; /* prevent arbitrary deep recursion, cf README */
+	int max_work_stack; /* maximum nesting of blocks and spans */
 	const char *emph_chars; /* chars that trigger emphasis rendering */
 	void *opaque; /* opaque data send to every rendering callback */
+	const struct mkd_span_renderer *spans; /* slice callbacks, or NULL */
+	int flags; /* parser options, MKD_LAZY_REFS */
+
+	/* source callback - called before the first callback of each block */
+	/*	kind is the enum mkd_block counted for it by mkd_stats, and the */
+	/*	block comes from [beg, end) in the input, including its last */
+	/*	newline; blocks inside blockquotes and list items get the range */
+	/*	of their own text, prefixes of lines after the first included; */
+	/*	streams and documents ignore it */
+	void (*block_source)(struct buf *ob, int kind, size_t beg, size_t end,
+							void *opaque);
+};
+
+
+/* mkd_compiled • renderer with its precomputed tables (opaque) */
+struct mkd_compiled;
+
+/* mkd_context • parser state reusable across documents (opaque) */
+struct mkd_context;
+
+/* mkd_document • document re-rendered incrementally after edits (opaque) */
+struct mkd_document;
+
+/* mkd_stream • document renderer fed with input chunks (opaque) */
+struct mkd_stream;
+
+
+/* mkd_budget • limits of a render, 0 standing for no limit */
+struct mkd_budget {
+	size_t		max_output;	/* bytes added to the output */
+	unsigned long	max_steps;	/* span triggers, blocks, list items */
+					/* and table rows */
+	size_t		max_memory;	/* bytes held by work buffers, arena */
+					/* and output buffer */
+};
+
+/* mkd_status • outcome of a render with a budget */
+enum mkd_status {
+	MKD_OK,
+	MKD_OUTPUT_LIMIT,	/* the rest of the input is dropped */
+	MKD_STEP_LIMIT,		/* the rest of the input is output as text */
+	MKD_MEMORY_LIMIT	/* the rest of the input is output as text */
+};
+
+/* mkd_trigger • chars starting the parsing of a span, cf mkd_stats */
+enum mkd_trigger {
+	MKD_TRIGGER_EMPHASIS,	/* emph_chars */
+	MKD_TRIGGER_LINEBREAK,	/* '\n' */
+	MKD_TRIGGER_CODESPAN,	/* '`' */
+	MKD_TRIGGER_LINK,	/* '[' */
+	MKD_TRIGGER_LANGLE,	/* '<', for tags and autolinks */
+	MKD_TRIGGER_ESCAPE,	/* '\\' */
+	MKD_TRIGGER_ENTITY,	/* '&' */
+	MKD_TRIGGER_NB
+};
+
+/* mkd_block • kinds of parsed blocks, cf mkd_stats */
+enum mkd_block {
+	MKD_BLOCK_ATXHEADER,
+	MKD_BLOCK_BLOCKCODE,
+	MKD_BLOCK_BLOCKQUOTE,
+	MKD_BLOCK_HRULE,
+	MKD_BLOCK_HTML,
+	MKD_BLOCK_LIST,
+	MKD_BLOCK_LISTITEM,
+	MKD_BLOCK_PARAGRAPH,	/* including setext headers */
+	MKD_BLOCK_TABLE,
+	MKD_BLOCK_TABLE_ROW,
+	MKD_BLOCK_NB
+};
+
+/* mkd_stats • counters of a rendering, kept when built with MKD_PROFILE */
+struct mkd_stats {
+	unsigned long	triggers[MKD_TRIGGER_NB]; /* calls of span parsers */
+	unsigned long	blocks[MKD_BLOCK_NB];	/* blocks parsed by kind */
+	double		pass1_time;	/* seconds spent looking for refs */
+	double		pass2_time;	/* seconds spent rendering */
+	int		work_peak;	/* deepest nesting of work buffers */
+	unsigned long	reallocs;	/* buffer growths */
+	size_t		grown_bytes;	/* bytes added by them */
+	unsigned long	fallbacks;	/* contents too deep for max_work_stack */
 };
 
+/* mkd_slice • part of a text, by offset and size */
+struct mkd_slice {
+	size_t	offset;
+	size_t	size; };
+
+/* mkd_heading • header found by mkd_extract_new */
+struct mkd_heading {
+	int			level;
+	size_t			offset;	/* of its first char in the input */
+	struct mkd_slice	text; };	/* markdown of its contents */
+
+/* mkd_link • link, image or autolink found by mkd_extract_new */
+struct mkd_link {
+	int			flags;	/* MKD_LINK_IMAGE, _REF or _AUTO */
+	size_t			offset;	/* of its '[', '!' or '<' in the input */
+	struct mkd_slice	link;	/* target, references resolved */
+	struct mkd_slice	title;
+	struct mkd_slice	text; };	/* markdown of its contents or alt */
+
+/* mkd_extract • headings and links of a document, in input order */
+struct mkd_extract {
+	struct mkd_heading *	heading;
+	int			heading_nb;
+	struct mkd_link *	link;
+	int			link_nb;
+	struct buf *		text; };	/* contents of every slice */
+
 
 
 /*********
@@ -102,6 +248,14 @@ struct mkd_renderer {
 #define MKD_CELL_ALIGN_MASK	3
 #define MKD_CELL_HEAD		4
 
+/* parser flags */
+#define MKD_LAZY_REFS		1  /* references stored on first lookup */
+
+/* extracted link flags */
+#define MKD_LINK_IMAGE		1
+#define MKD_LINK_REF		2  /* target from a reference */
+#define MKD_LINK_AUTO		4  /* autolink, text is the link */
+
 
 
 /**********************
@@ -112,6 +266,134 @@ struct mkd_renderer {
 void
 markdown(struct buf *ob, struct buf *ib, const struct mkd_renderer *rndr);
 
+/* markdown_compiled • renders a document with tables from mkd_compile */
+/*	rules are only read, so one of them can serve any number of threads */
+/*	at once without locking, as long as the renderer callbacks allow it */
+void
+markdown_compiled(struct buf *ob, struct buf *ib,
+				const struct mkd_compiled *rules);
+
+/* markdown_parallel • renders a large document using several threads */
+/*	top-level blocks are split into chunks rendered concurrently, so the */
+/*	renderer callbacks must be safe to call from several threads at once */
+/*	with the same opaque pointer; the output is the same as markdown() */
+void
+markdown_parallel(struct buf *ob, struct buf *ib,
+			const struct mkd_renderer *rndr, int nthreads);
+
+/* mkd_compile • builds the trigger table and flags of a renderer */
+/*	the renderer is copied, and the result can be shared across threads */
+/*	until mkd_compiled_free; returns NULL when out of memory */
+struct mkd_compiled *
+mkd_compile(const struct mkd_renderer *rndr);
+
+/* mkd_compiled_free • releases tables built by mkd_compile */
+void
+mkd_compiled_free(struct mkd_compiled *rules);
+
+/* mkd_context_free • releases a context and all its pooled buffers */
+void
+mkd_context_free(struct mkd_context *ctx);
+
+/* mkd_context_new • allocates a parser context for the given renderer */
+/*	the active char table and working buffers are built once and kept */
+/*	until mkd_context_free, only references are reset between documents */
+struct mkd_context *
+mkd_context_new(const struct mkd_renderer *rndr);
+
+/* mkd_document_free • releases an incremental document */
+void
+mkd_document_free(struct mkd_document *doc);
+
+/* mkd_document_new • allocates an incremental document */
+/*	it keeps the text, top-level blocks and output of its last render, */
+/*	so that the next one only parses again the blocks around the edits; */
+/*	when the references change, the whole document is parsed again */
+struct mkd_document *
+mkd_document_new(const struct mkd_renderer *rndr);
+
+/* mkd_document_render • renders the current version of a document */
+/*	ib is the whole new input, the output is the same as markdown() */
+void
+mkd_document_render(struct mkd_document *doc, struct buf *ob,
+							struct buf *ib);
+
+/* mkd_estimate_output • guesses the size of the rendering of a document */
+/*	from one pass over the input, counting lines, span marks and */
+/*	escaped chars; it is meant to presize the output, and is above */
+/*	the actual size for most documents */
+size_t
+mkd_estimate_output(const struct buf *ib, const struct mkd_renderer *rndr);
+
+/* mkd_extract_free • releases the result of mkd_extract_new */
+void
+mkd_extract_free(struct mkd_extract *ex);
+
+/* mkd_extract_new • finds headings and links without rendering, or NULL */
+/*	syntax is the renderer whose parsing is reproduced, as in */
+/*	mkd_tree_new, except that spans are only parsed in data holding a */
+/*	'[' or a '<'; offsets are those of the heading or link itself in */
+/*	the input, inside blockquotes and list items too */
+struct mkd_extract *
+mkd_extract_new(struct buf *ib, const struct mkd_renderer *syntax);
+
+/* mkd_render • renders a document, reusing the context from previous ones */
+void
+mkd_render(struct mkd_context *ctx, struct buf *ob, struct buf *ib);
+
+/* mkd_render_budget • renders a document within the given limits */
+/*	limits are checked between steps, so they can be exceeded by what */
+/*	a single step adds; once one is reached, the open blocks and spans */
+/*	are closed and the rest of each of them goes through normal_text, */
+/*	cut to the room left under max_output before escaping, or dropped */
+/*	when the output is full; returns the limit reached, or MKD_OK */
+enum mkd_status
+mkd_render_budget(struct mkd_context *ctx, struct buf *ob, struct buf *ib,
+					const struct mkd_budget *budget);
+
+/* mkd_render_parallel • renders a document on several threads */
+/*	same constraints on the renderer as markdown_parallel */
+void
+mkd_render_parallel(struct mkd_context *ctx, struct buf *ob, struct buf *ib,
+							int nthreads);
+
+/* mkd_render_sink • renders a document, sending its output to a sink */
+/*	the output is flushed between top-level blocks once it is larger */
+/*	than mark bytes (0 flushing after every block), so that it can be */
+/*	written out while the rest of the document is rendered */
+void
+mkd_render_sink(struct mkd_context *ctx, struct buf *ib,
+			mkd_sink sink, void *opaque, size_t mark);
+
+/* mkd_stats • fills the counters of the last rendering of this thread */
+/*	for markdown(), mkd_render() and their variants, including the worker */
+/*	threads of parallel renders; all zero without MKD_PROFILE */
+void
+mkd_stats(struct mkd_stats *stats);
+
+/* mkd_stream_end • finishes the current document of a stream */
+/*	the remaining output and the epilog are sent to the sink, and the */
+/*	stream is ready for a new document */
+void
+mkd_stream_end(struct mkd_stream *st);
+
+/* mkd_stream_free • releases a stream, without finishing its document */
+void
+mkd_stream_free(struct mkd_stream *st);
+
+/* mkd_stream_new • allocates a stream rendering into the given sink */
+/*	the output is sent as soon as its top-level blocks are complete, so */
+/*	only the pending blocks are kept in memory; references must be */
+/*	defined before they are used, other links are rendered as text; */
+/*	the input after an HTML block opening is kept until its end is */
+/*	found, and HTML blocks over 256 KiB are parsed as other blocks */
+struct mkd_stream *
+mkd_stream_new(const struct mkd_renderer *rndr, mkd_sink sink, void *opaque);
+
+/* mkd_stream_push • feeds input data, rendering the completed blocks */
+void
+mkd_stream_push(struct mkd_stream *st, const char *data, size_t size);
+
 
 #endif /* ndef LITHIUM_MARKDOWN_H */
 
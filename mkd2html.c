@@ -16,6 +16,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "cache.h"
 #include "markdown.h"
 #include "renderers.h"
 
@@ -24,17 +25,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef MKD_NO_THREADS
+#include <pthread.h>
+#endif
 
 #define READ_UNIT 1024
 #define OUTPUT_UNIT 64
+#define OUTPUT_MARK 16384
+#define NAME_UNIT 256
+#define CACHE_MEMORY (64 << 20)
+#define CACHE_DISK (256 << 20)
+
+
+/* batch • list of files converted by a pool of workers */
+struct batch {
+	char **				files;
+	char **				outputs; /* 0 for a skipped file */
+	int				nb;
+	int				next;	/* first file not taken yet */
+	int				errors;
+	const char *			outdir;	/* 0 to write next to input */
+	const struct mkd_renderer *	rndr;
+	struct mkd_cache *		cache;	/* 0 when disabled */
+	const char *			id;	/* renderer id in the cache */
+#ifndef MKD_NO_THREADS
+	pthread_mutex_t			lock;
+#endif
+};
 
 
 /* usage • print the option list */
 static void
 usage(FILE *out, const char *name) {
-	fprintf(out, "Usage: %s [-h | -x] [-d | -m | -n] [input-file]\n\n",
-	    name);
-	fprintf(out, "\t-d, --discount\n"
+	fprintf(out, "Usage: %s [-h | -x] [-d | -m | -n] [-c dir] "
+	    "[-j jobs] [--stats] [input-file]\n"
+	    "       %s [-h | -x] [-d | -m | -n] -s [input-file]\n"
+	    "       %s [-h | -x] [-d | -m | -n] [-c dir] [-j jobs] [-l] "
+	    "[-o dir] [input-file ...]\n\n", name, name, name);
+	fprintf(out, "\t-c, --cache DIR\n"
+	    "\t\tKeep rendered documents in DIR, and reuse them when the\n"
+	    "\t\tsame input is rendered again with the same options\n"
+	    "\t-d, --discount\n"
 	    "\t\tEnable some Discount extensions (image size specification,\n"
 	    "\t\tclass blocks and 'abbr:', 'class:', 'id:' and 'raw:'\n"
 	    "\t\tpseudo-protocols)\n"
@@ -42,32 +76,403 @@ usage(FILE *out, const char *name) {
 	    "\t\tOutput HTML-style self-closing tags (e.g. <br>)\n"
 	    "\t-h, --help\n"
 	    "\t\tDisplay this help text and exit without further processing\n"
+	    "\t-j, --jobs N\n"
+	    "\t\tRender large documents using N threads, or convert N files\n"
+	    "\t\tat once in batch mode\n"
+	    "\t-l, --list\n"
+	    "\t\tRead the names of the files to convert from standard input\n"
 	    "\t-m, --markdown\n"
 	    "\t\tDisable all extensions and use strict markdown syntax\n"
 	    "\t-n, --natext\n"
 	    "\t\tEnable support Discount extensions and Natasha's own\n"
 	    "\t\textensions (id header attribute, class paragraph attribute,\n"
 	    "\t\t'ins' and 'del' elements, and plain span elements)\n"
+	    "\t-o, --output DIR\n"
+	    "\t\tWrite the converted files into DIR instead of next to their\n"
+	    "\t\tinput\n"
+	    "\t-s, --stream\n"
+	    "\t\tOutput blocks as the input is read, references must then\n"
+	    "\t\tbe defined before they are used\n"
+	    "\t--stats\n"
+	    "\t\tPrint the parser counters of the rendering on standard\n"
+	    "\t\terror, when built with -DMKD_PROFILE; the cache is then\n"
+	    "\t\tnot used\n"
 	    "\t-x, --xhtml\n"
 	    "\t\tOutput XHTML-style self-closing tags (e.g. <br />)\n"); }
 
 
+/* renderer_id • name of a built-in renderer, identifying it in the cache */
+static const char *
+renderer_id(const struct mkd_renderer *rndr) {
+	if (rndr == &discount_html) return "discount_html";
+	if (rndr == &discount_xhtml) return "discount_xhtml";
+	if (rndr == &mkd_xhtml) return "mkd_xhtml";
+	if (rndr == &nat_html) return "nat_html";
+	if (rndr == &nat_xhtml) return "nat_xhtml";
+	return "mkd_html"; }
+
+
+/* read_input • reads the whole input into a buffer */
+/*	a regular file is mapped into map when given, as a read-only buffer */
+/*	(unit == 0), otherwise it is read once with a size from fstat if known */
+static struct buf *
+read_input(FILE *in, struct buf *map) {
+	struct stat st;
+	struct buf *ib;
+	size_t ret, hint = READ_UNIT;
+	void *data;
+	int fd = fileno(in);
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		if (map && (off_t)(size_t)st.st_size == st.st_size
+		&& lseek(fd, 0, SEEK_CUR) == 0
+		&& (data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+							!= MAP_FAILED) {
+			memset(map, 0, sizeof *map);
+			map->data = data;
+			map->size = map->asize = st.st_size;
+			map->ref = 1;
+			return map; }
+		hint = st.st_size + 1; }
+
+	/* reading everything */
+	if ((ib = bufnew(READ_UNIT)) == 0) return 0;
+	bufsetgrowth(ib, 100, 0);
+	bufgrow(ib, hint);
+	while ((ret = fread(ib->data + ib->size, 1,
+			ib->asize - ib->size, in)) > 0) {
+		ib->size += ret;
+		bufgrow(ib, ib->size + READ_UNIT); }
+	return ib; }
+
+
+/* release_input • frees a buffer from read_input */
+static void
+release_input(struct buf *ib, struct buf *map) {
+	if (ib == map) munmap(map->data, map->size);
+	else bufrelease(ib); }
+
+
+/* write_sink • stream sink writing to the given FILE */
+static void
+write_sink(const char *data, size_t size, void *opaque) {
+	size_t ret = fwrite(data, 1, size, opaque);
+	if (ret < size)
+		fprintf(stderr, "Warning: only %zu output byte written, "
+				"out of %zu\n", ret, size); }
+
+
+/* stream • renders the input while reading it */
+static int
+stream(FILE *in, const struct mkd_renderer *rndr) {
+	struct mkd_stream *st;
+	char data[READ_UNIT];
+	size_t ret;
+
+	if ((st = mkd_stream_new(rndr, write_sink, stdout)) == 0) {
+		fprintf(stderr, "Unable to allocate the stream\n");
+		return EXIT_FAILURE; }
+	while ((ret = fread(data, 1, sizeof data, in)) > 0)
+		mkd_stream_push(st, data, ret);
+	mkd_stream_end(st);
+	mkd_stream_free(st);
+	return EXIT_SUCCESS; }
+
+
+/* output_name • builds the name of the converted file */
+/*	the extension of the input is replaced by .html */
+static void
+output_name(struct buf *name, const char *file, const char *outdir) {
+	const char *base = strrchr(file, '/'), *ext;
+	base = base ? base + 1 : file;
+	ext = strrchr(base, '.');
+	if (!ext || ext == base) ext = base + strlen(base);
+	name->size = 0;
+	if (outdir) {
+		bufputs(name, outdir);
+		bufputc(name, '/');
+		bufput(name, base, ext - base); }
+	else	bufput(name, file, ext - file);
+	BUFPUTSL(name, ".html");
+	bufnullterm(name); }
+
+
+/* output_cmp • order of pointers into batch outputs, for qsort */
+static int
+output_cmp(const void *a, const void *b) {
+	return strcmp(**(char *const *const *)a, **(char *const *const *)b); }
+
+
+/* batch_outputs • names the output of every file before any is written */
+/*	a file is skipped, and counted as an error, when its output would */
+/*	overwrite it or is also the output of another file */
+static int
+batch_outputs(struct batch *bt) {
+	struct buf *name;
+	struct stat sin, sout;
+	char ***sorted, *skip;
+	int i, j, k;
+
+	if (!bt->nb) return 0;
+	name = bufnew(NAME_UNIT);
+	sorted = malloc(bt->nb * sizeof *sorted);
+	skip = calloc(bt->nb, 1);
+	bt->outputs = calloc(bt->nb, sizeof *bt->outputs);
+	if (!name || !sorted || !skip || !bt->outputs) {
+		bufrelease(name);
+		free(sorted);
+		free(skip);
+		return -1; }
+	for (i = 0; i < bt->nb; i += 1) {
+		output_name(name, bt->files[i], bt->outdir);
+		if ((bt->outputs[i] = malloc(name->size + 1)) == 0) break;
+		memcpy(bt->outputs[i], name->data, name->size + 1);
+		sorted[i] = bt->outputs + i; }
+	bufrelease(name);
+	if (i < bt->nb) {
+		free(sorted);
+		free(skip);
+		return -1; }
+
+	/* outputs shared by several files */
+	qsort(sorted, bt->nb, sizeof *sorted, output_cmp);
+	for (i = 0; i < bt->nb; i = j) {
+		for (j = i + 1; j < bt->nb && !strcmp(*sorted[i], *sorted[j]);
+									j += 1);
+		if (j - i > 1)
+			for (k = i; k < j; k += 1) {
+				fprintf(stderr, "Unable to convert \"%s\": "
+					"\"%s\" is the output of %d files\n",
+					bt->files[sorted[k] - bt->outputs],
+					*sorted[k], j - i);
+				skip[sorted[k] - bt->outputs] = 1; } }
+
+	/* outputs replacing their input */
+	for (i = 0; i < bt->nb; i += 1)
+		if (!skip[i] && stat(bt->files[i], &sin) == 0
+		&& stat(bt->outputs[i], &sout) == 0
+		&& sin.st_dev == sout.st_dev && sin.st_ino == sout.st_ino) {
+			fprintf(stderr, "Unable to convert \"%s\": "
+				"it is its own output\n", bt->files[i]);
+			skip[i] = 1; }
+
+	for (i = 0; i < bt->nb; i += 1)
+		if (skip[i]) {
+			free(bt->outputs[i]);
+			bt->outputs[i] = 0;
+			bt->errors += 1; }
+	free(sorted);
+	free(skip);
+	return 0; }
+
+
+/* batch_next • takes the next file to convert, -1 when none is left */
+static int
+batch_next(struct batch *bt) {
+	int ret;
+#ifndef MKD_NO_THREADS
+	pthread_mutex_lock(&bt->lock);
+#endif
+	ret = (bt->next < bt->nb) ? bt->next++ : -1;
+#ifndef MKD_NO_THREADS
+	pthread_mutex_unlock(&bt->lock);
+#endif
+	return ret; }
+
+
+/* batch_error • reports a file that could not be converted */
+static void
+batch_error(struct batch *bt, const char *action, const char *file) {
+	const char *err = strerror(errno);
+#ifndef MKD_NO_THREADS
+	pthread_mutex_lock(&bt->lock);
+#endif
+	fprintf(stderr, "Unable to %s \"%s\": %s\n", action, file, err);
+	bt->errors += 1;
+#ifndef MKD_NO_THREADS
+	pthread_mutex_unlock(&bt->lock);
+#endif
+}
+
+
+/* batch_worker • converts files until none is left */
+/*	each worker keeps its own parser context and buffers for all files */
+static void *
+batch_worker(void *arg) {
+	struct batch *bt = arg;
+	struct mkd_context *ctx;
+	struct buf *ib, *ob, map;
+	const char *file, *name;
+	FILE *in, *out;
+	int i;
+
+	ctx = mkd_context_new(bt->rndr);
+	ob = bufnew(OUTPUT_UNIT);
+	if (!ctx || !ob) {
+		batch_error(bt, "allocate a worker for", "batch");
+		mkd_context_free(ctx);
+		bufrelease(ob);
+		return 0; }
+	bufsetgrowth(ob, 50, 0);
+
+	while ((i = batch_next(bt)) >= 0) {
+		file = bt->files[i];
+		if ((name = bt->outputs[i]) == 0) continue;
+
+		/* reading */
+		if ((in = fopen(file, "r")) == 0) {
+			batch_error(bt, "open input file", file);
+			continue; }
+		ib = read_input(in, &map);
+		fclose(in);
+		if (!ib) {
+			batch_error(bt, "read input file", file);
+			continue; }
+
+		/* rendering */
+		ob->size = 0;
+		bufgrow(ob, mkd_estimate_output(ib, bt->rndr));
+		mkd_cache_render(bt->cache, ctx, ob, ib, bt->id);
+		release_input(ib, &map);
+
+		/* writing */
+		if ((out = fopen(name, "w")) == 0) {
+			batch_error(bt, "open output file", name);
+			continue; }
+		if (fwrite(ob->data, 1, ob->size, out) < ob->size)
+			batch_error(bt, "write output file", name);
+		if (fclose(out) != 0)
+			batch_error(bt, "close output file", name); }
+
+	mkd_context_free(ctx);
+	bufrelease(ob);
+	return 0; }
+
+
+/* batch • converts many files on jobs threads */
+/*	the file names are taken from the command line, then from stdin, */
+/*	the other fields of bt being already filled */
+static int
+batch(struct batch *bt, char **files, int nb, int listed, int jobs) {
+	struct buf *list = 0;
+	size_t i, beg;
+	int n;
+#ifndef MKD_NO_THREADS
+	pthread_t *tid;
+	int nb_tid = 0;
+#endif
+
+	bt->files = files;
+	bt->outputs = 0;
+	bt->nb = nb;
+	bt->next = bt->errors = 0;
+
+	/* reading the file list, one name per line */
+	if (listed) {
+		if ((list = read_input(stdin, 0)) == 0) {
+			fprintf(stderr, "Unable to read the file list\n");
+			return EXIT_FAILURE; }
+		bufputc(list, '\n');
+		for (n = 0, i = 0; i < list->size; i += 1)
+			if (list->data[i] == '\n') n += 1;
+		bt->files = malloc((nb + n) * sizeof *bt->files);
+		if (!bt->files) {
+			bufrelease(list);
+			return EXIT_FAILURE; }
+		memcpy(bt->files, files, nb * sizeof *files);
+		for (beg = i = 0; i < list->size; i += 1)
+			if (list->data[i] == '\n') {
+				list->data[i] = 0;
+				if (i > beg) bt->files[bt->nb++] = list->data + beg;
+				beg = i + 1; } }
+
+	/* all the outputs are known before any of them is written */
+	if (batch_outputs(bt) < 0) {
+		fprintf(stderr, "Unable to allocate the output names\n");
+		bt->errors += 1;
+		bt->next = bt->nb; }
+
+	/* the calling thread works along with the others */
+#ifndef MKD_NO_THREADS
+	tid = malloc(jobs * sizeof *tid);
+	if (tid && pthread_mutex_init(&bt->lock, 0) == 0) {
+		for (n = 1; n < jobs && n < bt->nb; n += 1)
+			if (pthread_create(tid + nb_tid, 0,
+						batch_worker, bt) == 0)
+				nb_tid += 1;
+		batch_worker(bt);
+		for (n = 0; n < nb_tid; n += 1)
+			pthread_join(tid[n], 0);
+		pthread_mutex_destroy(&bt->lock); }
+	else {
+		fprintf(stderr, "Unable to start the workers\n");
+		bt->errors += 1; }
+	free(tid);
+#else
+	batch_worker(bt);
+#endif
+
+	if (bt->outputs)
+		for (n = 0; n < bt->nb; n += 1) free(bt->outputs[n]);
+	free(bt->outputs);
+	if (listed) {
+		free(bt->files);
+		bufrelease(list); }
+	return bt->errors ? EXIT_FAILURE : EXIT_SUCCESS; }
+
+
+
+/* print_stats • writes the counters of the last rendering to out */
+static void
+print_stats(FILE *out) {
+	static const char *triggers[MKD_TRIGGER_NB] = { "emphasis",
+	    "linebreak", "codespan", "link", "langle", "escape", "entity" };
+	static const char *blocks[MKD_BLOCK_NB] = { "atxheader", "blockcode",
+	    "blockquote", "hrule", "html", "list", "listitem", "paragraph",
+	    "table", "table_row" };
+	struct mkd_stats st;
+	int i;
+
+#ifndef MKD_PROFILE
+	fprintf(out, "Warning: counters need a build with -DMKD_PROFILE\n");
+#endif
+	mkd_stats(&st);
+	for (i = 0; i < MKD_TRIGGER_NB; i += 1)
+		fprintf(out, "trigger %-12s %lu\n", triggers[i], st.triggers[i]);
+	for (i = 0; i < MKD_BLOCK_NB; i += 1)
+		fprintf(out, "block   %-12s %lu\n", blocks[i], st.blocks[i]);
+	fprintf(out, "pass 1               %.3f ms\n", st.pass1_time * 1e3);
+	fprintf(out, "pass 2               %.3f ms\n", st.pass2_time * 1e3);
+	fprintf(out, "work peak            %d\n", st.work_peak);
+	fprintf(out, "reallocs             %lu (%zu bytes)\n",
+					st.reallocs, st.grown_bytes);
+	fprintf(out, "fallbacks            %lu\n", st.fallbacks); }
+
 
 /* main • main function, interfacing STDIO with the parser */
 int
 main(int argc, char **argv) {
-	struct buf *ib, *ob;
-	size_t ret;
+	struct buf *ib, *ob, map;
+	struct mkd_context *ctx;
+	struct batch bt;
 	FILE *in = stdin;
 	const struct mkd_renderer *hrndr, *xrndr;
 	const struct mkd_renderer **prndr;
-	int ch, argerr, help;
+	int ch, argerr, help, jobs, streamed, listed, stats, ret;
+	const char *outdir, *cachedir;
+	char *end;
 	struct option longopts[] = {
+	    { "cache",		required_argument, 0,	'c' },
 	    { "discount",	no_argument,	0,	'd' },
 	    { "html",		no_argument,	0,	'H' },
 	    { "help",		no_argument,	0,	'h' },
+	    { "jobs",		required_argument, 0,	'j' },
+	    { "list",		no_argument,	0,	'l' },
 	    { "markdown",	no_argument,	0,	'm' },
 	    { "natext",		no_argument,	0,	'n' },
+	    { "output",		required_argument, 0,	'o' },
+	    { "stats",		no_argument,	0,	'S' },
+	    { "stream",		no_argument,	0,	's' },
 	    { "xhtml",		no_argument,	0,	'x' },
 	    { 0,		0,		0,	0 } };
 
@@ -78,9 +483,15 @@ main(int argc, char **argv) {
 
 	/* argument parsing */
 	argerr = help = 0;
+	jobs = 0;
+	streamed = listed = stats = 0;
+	outdir = cachedir = 0;
 	while (!argerr &&
-	    (ch = getopt_long(argc, argv, "dHhmnx", longopts, 0)) != -1)
+	    (ch = getopt_long(argc, argv, "c:dHhj:lmno:sx", longopts, 0)) != -1)
 		switch (ch) {
+		    case 'c': /* rendered output cache */
+			cachedir = optarg;
+			break;
 		    case 'd': /* discount extension */
 			hrndr = &discount_html;
 			xrndr = &discount_xhtml;
@@ -91,6 +502,13 @@ main(int argc, char **argv) {
 		    case 'h': /* display help */
 			argerr = help = 1;
 			break;
+		    case 'j': /* number of rendering threads */
+			jobs = strtol(optarg, &end, 10);
+			if (*end || jobs < 1) argerr = 1;
+			break;
+		    case 'l': /* file list on stdin */
+			listed = 1;
+			break;
 		    case 'm': /* strict markdown */
 			hrndr = &mkd_html;
 			xrndr = &mkd_xhtml;
@@ -99,49 +517,108 @@ main(int argc, char **argv) {
 			hrndr = &nat_html;
 			xrndr = &nat_xhtml;
 			break;
+		    case 'o': /* output directory */
+			outdir = optarg;
+			break;
+		    case 'S': /* parser counters, long option only */
+			stats = 1;
+			break;
+		    case 's': /* streamed output */
+			streamed = 1;
+			break;
 		    case 'x': /* XHTML output */
 			prndr = &xrndr;
 			break;
 		    default:
 			argerr = 1; }
+
+	/* streaming is only for a single document, read in one thread */
+	if (streamed && (jobs || cachedir || outdir || listed
+					|| argc - optind > 1))
+		argerr = 1;
+	if (!jobs) jobs = 1;
+
+	/* counters are only printed for a single document */
+	if (stats && (streamed || outdir || listed || argc - optind > 1))
+		argerr = 1;
 	if (argerr) {
 		usage(help ? stdout : stderr, argv[0]);
 		return help ? EXIT_SUCCESS : EXIT_FAILURE; }
 	argc -= optind;
 	argv += optind;
 
+	/* opening the cache, in front of which documents are kept in memory */
+	/*	a document whose counters are printed is always parsed, a cache */
+	/*	hit having none to print */
+	bt.cache = 0;
+	bt.id = renderer_id(*prndr);
+	if (cachedir && !stats
+	&& (bt.cache = mkd_cache_new(CACHE_MEMORY, cachedir,
+						CACHE_DISK)) == 0) {
+		fprintf(stderr, "Unable to allocate the cache\n");
+		return EXIT_FAILURE; }
+
+	/* converting many files */
+	if (argc > 1 || listed || outdir) {
+		bt.outdir = outdir;
+		bt.rndr = *prndr;
+		ret = batch(&bt, argv, argc, listed, jobs);
+		mkd_cache_free(bt.cache);
+		return ret; }
+
 	/* opening the file if given from the command line */
 	if (argc > 0) {
 		in = fopen(argv[0], "r");
 		if (!in) {
 			fprintf(stderr,"Unable to open input file \"%s\": %s\n",
 				argv[0], strerror(errno));
+			mkd_cache_free(bt.cache);
 			return 1; } }
 
-	/* reading everything */
-	ib = bufnew(READ_UNIT);
-	bufgrow(ib, READ_UNIT);
-	while ((ret = fread(ib->data + ib->size, 1,
-			ib->asize - ib->size, in)) > 0) {
-		ib->size += ret;
-		bufgrow(ib, ib->size + READ_UNIT); }
+	/* rendering while reading */
+	if (streamed) {
+		ch = stream(in, *prndr);
+		if (in != stdin) fclose(in);
+		mkd_cache_free(bt.cache);
+		return ch; }
+
+	/* reading or mapping everything */
+	ib = read_input(in, &map);
 	if (in != stdin) fclose(in);
+	if (!ib) {
+		fprintf(stderr, "Unable to read the input\n");
+		mkd_cache_free(bt.cache);
+		return EXIT_FAILURE; }
 
-	/* performing markdown parsing */
-	ob = bufnew(OUTPUT_UNIT);
-	markdown(ob, ib, *prndr);
+	/* performing markdown parsing, writing the result to stdout */
+	if (bt.cache && (ctx = mkd_context_new(*prndr)) != 0) {
+		/* a cached document is only written once complete */
+		ob = bufnew_with_capacity(OUTPUT_UNIT,
+					mkd_estimate_output(ib, *prndr));
+		bufsetgrowth(ob, 50, 0);
+		mkd_cache_render(bt.cache, ctx, ob, ib, bt.id);
+		write_sink(ob->data, ob->size, stdout);
+		bufrelease(ob);
+		mkd_context_free(ctx); }
+	else if (jobs > 1) {
+		ob = bufnew_with_capacity(OUTPUT_UNIT,
+					mkd_estimate_output(ib, *prndr));
+		bufsetgrowth(ob, 50, 0);
+		markdown_parallel(ob, ib, *prndr, jobs);
+		write_sink(ob->data, ob->size, stdout);
+		bufrelease(ob); }
+	else if ((ctx = mkd_context_new(*prndr)) != 0) {
+		/* output is written while the rest is rendered */
+		mkd_render_sink(ctx, ib, write_sink, stdout, OUTPUT_MARK);
+		mkd_context_free(ctx); }
+	else
+		fprintf(stderr, "Unable to allocate the parser context\n");
 
-	/* writing the result to stdout */
-	ret = fwrite(ob->data, 1, ob->size, stdout);
-	if (ret < ob->size)
-		fprintf(stderr, "Warning: only %zu output byte written, "
-				"out of %zu\n",
-				ret,
-				ob->size);
+	if (stats) print_stats(stderr);
 
 	/* cleanup */
-	bufrelease(ib);
-	bufrelease(ob);
+	release_input(ib, &map);
+	mkd_cache_free(bt.cache);
 
 #ifdef BUFFER_STATS
 	/* memory checks */
@@ -18,52 +18,123 @@
 
 #include "renderers.h"
 
+#include "scan.h"
+
+#include <string.h>
 #include <strings.h>
 
+#define ESCAPE_VECTOR_MIN 32	/* minimal span size for vector search */
+
+/* RENDERER • defines an exported renderer structure */
+/*	a parser specialized by special.h gets a local copy of it instead */
+#ifdef MKD_SPECIAL
+#define RENDERER(name) static const struct mkd_renderer local_##name
+#else
+#define RENDERER(name) const struct mkd_renderer name
+#endif
+
+
+/********************
+ * GLOBAL VARIABLES *
+ ********************/
+
+/* escape_entity • replacement text of the chars escaped in HTML */
+static const char *const escape_entity[256] = {
+	['"'] = "&quot;",
+	['&'] = "&amp;",
+	['<'] = "&lt;",
+	['>'] = "&gt;" };
+
+/* attr_escape_len • length of the replacement text inside attributes */
+static const unsigned char attr_escape_len[256] = {
+	['"'] = 6, ['&'] = 5, ['<'] = 4, ['>'] = 4 };
+
+/* body_escape_len • length of the replacement text outside attributes */
+static const unsigned char body_escape_len[256] = {
+	['&'] = 5, ['<'] = 4, ['>'] = 4 };
+
+/* attr_escape_set, body_escape_set • chars to escape, for scan_find() */
+static const struct scan_set attr_escape_set = { 4, { '<', '>', '&', '"' } };
+static const struct scan_set body_escape_set = { 3, { '<', '>', '&' } };
+
+
+
+/***************************
+ * STATIC HELPER FUNCTIONS *
+ ***************************/
+
+/* escape_find • returns the offset of the next char to escape, or size */
+static size_t
+escape_find(const struct scan_set *set, const unsigned char *len,
+					const char *src, size_t size) {
+	size_t i = 0;
+#ifdef SCAN_VECTOR
+	/* short spans are faster with the table than with vector setup */
+	if (size >= ESCAPE_VECTOR_MIN) return scan_find(set, src, size);
+#else
+	(void)set;
+#endif
+	while (i < size && !len[(unsigned char)src[i]]) i += 1;
+	return i; }
+
+
+/* escape_html • copy the buffer entity-escaping chars with a non-zero len */
+/*	the output size is computed first, so that it is allocated only once */
+static void
+escape_html(struct buf *ob, const char *src, size_t size,
+			const struct scan_set *set, const unsigned char *len) {
+	size_t i, org, need = size;
+	char *out;
+
+	if (!ob || !size) return;
+
+	/* first pass: computing the size of the escaped output */
+	i = escape_find(set, len, src, size);
+	if (i >= size) {
+		bufput(ob, src, size);
+		return; }
+	while (i < size) {
+		need += len[(unsigned char)src[i]] - 1;
+		i += 1;
+		i += escape_find(set, len, src + i, size - i); }
+	/* second pass: writing directly into the reserved space */
+	out = bufreserve(ob, need);
+	if (!out) return;
+	i = 0;
+	while (i < size) {
+		org = i;
+		i += escape_find(set, len, src + i, size - i);
+		if (i > org) {
+			memcpy(out, src + org, i - org);
+			out += i - org; }
+		if (i >= size) break;
+		memcpy(out, escape_entity[(unsigned char)src[i]],
+						len[(unsigned char)src[i]]);
+		out += len[(unsigned char)src[i]];
+		i += 1; }
+	ob->size += need; }
+
+
 
 /*****************************
  * EXPORTED HELPER FUNCTIONS *
  *****************************/
 
+/* specialized parsers call those of the generic build */
+#ifndef MKD_SPECIAL
+
 /* lus_attr_escape • copy the buffer entity-escaping '<', '>', '&' and '"' */
 void
 lus_attr_escape(struct buf *ob, const char *src, size_t size) {
-	size_t  i = 0, org;
-	while (i < size) {
-		/* copying directly unescaped characters */
-		org = i;
-		while (i < size && src[i] != '<' && src[i] != '>'
-		&& src[i] != '&' && src[i] != '"')
-			i += 1;
-		if (i > org) bufput(ob, src + org, i - org);
-
-		/* escaping */
-		if (i >= size) break;
-		else if (src[i] == '<') BUFPUTSL(ob, "&lt;");
-		else if (src[i] == '>') BUFPUTSL(ob, "&gt;");
-		else if (src[i] == '&') BUFPUTSL(ob, "&amp;");
-		else if (src[i] == '"') BUFPUTSL(ob, "&quot;");
-		i += 1; } }
+	escape_html(ob, src, size, &attr_escape_set, attr_escape_len); }
 
 
 /* lus_body_escape • copy the buffer entity-escaping '<', '>' and '&' */
 void
 lus_body_escape(struct buf *ob, const char *src, size_t size) {
-	size_t  i = 0, org;
-	while (i < size) {
-		/* copying directly unescaped characters */
-		org = i;
-		while (i < size && src[i] != '<' && src[i] != '>'
-		&& src[i] != '&')
-			i += 1;
-		if (i > org) bufput(ob, src + org, i - org);
+	escape_html(ob, src, size, &body_escape_set, body_escape_len); }
 
-		/* escaping */
-		if (i >= size) break;
-		else if (src[i] == '<') BUFPUTSL(ob, "&lt;");
-		else if (src[i] == '>') BUFPUTSL(ob, "&gt;");
-		else if (src[i] == '&') BUFPUTSL(ob, "&amp;");
-		i += 1; } }
+#endif /* ndef MKD_SPECIAL */
 
 
 
@@ -72,16 +143,16 @@ lus_body_escape(struct buf *ob, const char *src, size_t size) {
  ********************/
 
 static int
-rndr_autolink(struct buf *ob, struct buf *link, enum mkd_autolink type,
-						void *opaque) {
-	if (!link || !link->size) return 0;
+rndr_autolink(struct buf *ob, const char *link, size_t size,
+				enum mkd_autolink type, void *opaque) {
+	if (!size) return 0;
 	BUFPUTSL(ob, "<a href=\"");
 	if (type == MKDA_IMPLICIT_EMAIL) BUFPUTSL(ob, "mailto:");
-	lus_attr_escape(ob, link->data, link->size);
+	lus_attr_escape(ob, link, size);
 	BUFPUTSL(ob, "\">");
-	if (type == MKDA_EXPLICIT_EMAIL && link->size > 7)
-		lus_body_escape(ob, link->data + 7, link->size - 7);
-	else	lus_body_escape(ob, link->data, link->size);
+	if (type == MKDA_EXPLICIT_EMAIL && size > 7)
+		lus_body_escape(ob, link + 7, size - 7);
+	else	lus_body_escape(ob, link, size);
 	BUFPUTSL(ob, "</a>");
 	return 1; }
 
@@ -100,9 +171,9 @@ rndr_blockquote(struct buf *ob, struct buf *text, void *opaque) {
 	BUFPUTSL(ob, "</blockquote>\n"); }
 
 static int
-rndr_codespan(struct buf *ob, struct buf *text, void *opaque) {
+rndr_codespan(struct buf *ob, const char *text, size_t size, void *opaque) {
 	BUFPUTSL(ob, "<code>");
-	if (text) lus_body_escape(ob, text->data, text->size);
+	lus_body_escape(ob, text, size);
 	BUFPUTSL(ob, "</code>");
 	return 1; }
 
@@ -125,9 +196,13 @@ rndr_emphasis(struct buf *ob, struct buf *text, char c, void *opaque) {
 static void
 rndr_header(struct buf *ob, struct buf *text, int level, void *opaque) {
 	if (ob->size) bufputc(ob, '\n');
-	bufprintf(ob, "<h%d>", level);
+	BUFPUTSL(ob, "<h");
+	bufputi(ob, level);
+	bufputc(ob, '>');
 	if (text) bufput(ob, text->data, text->size);
-	bufprintf(ob, "</h%d>\n", level); }
+	BUFPUTSL(ob, "</h");
+	bufputi(ob, level);
+	BUFPUTSL(ob, ">\n"); }
 
 static int
 rndr_link(struct buf *ob, struct buf *link, struct buf *title,
@@ -159,8 +234,8 @@ rndr_listitem(struct buf *ob, struct buf *text, int flags, void *opaque) {
 	BUFPUTSL(ob, "</li>\n"); }
 
 static void
-rndr_normal_text(struct buf *ob, struct buf *text, void *opaque) {
-	if (text) lus_body_escape(ob, text->data, text->size); }
+rndr_normal_text(struct buf *ob, const char *text, size_t size, void *opaque) {
+	lus_body_escape(ob, text, size); }
 
 static void
 rndr_paragraph(struct buf *ob, struct buf *text, void *opaque) {
@@ -170,21 +245,18 @@ rndr_paragraph(struct buf *ob, struct buf *text, void *opaque) {
 	BUFPUTSL(ob, "</p>\n"); }
 
 static void
-rndr_raw_block(struct buf *ob, struct buf *text, void *opaque) {
-	size_t org, sz;
-	if (!text) return;
-	sz = text->size;
-	while (sz > 0 && text->data[sz - 1] == '\n') sz -= 1;
-	org = 0;
-	while (org < sz && text->data[org] == '\n') org += 1;
-	if (org >= sz) return;
+rndr_raw_block(struct buf *ob, const char *text, size_t size, void *opaque) {
+	size_t org = 0;
+	while (size > 0 && text[size - 1] == '\n') size -= 1;
+	while (org < size && text[org] == '\n') org += 1;
+	if (org >= size) return;
 	if (ob->size) bufputc(ob, '\n');
-	bufput(ob, text->data + org, sz - org);
+	bufput(ob, text + org, size - org);
 	bufputc(ob, '\n'); }
 
 static int
-rndr_raw_inline(struct buf *ob, struct buf *text, void *opaque) {
-	bufput(ob, text->data, text->size);
+rndr_raw_inline(struct buf *ob, const char *text, size_t size, void *opaque) {
+	bufput(ob, text, size);
 	return 1; }
 
 static int
@@ -227,14 +299,59 @@ html_linebreak(struct buf *ob, void *opaque) {
 	return 1; }
 
 
+/* struct buf callbacks, over the span ones for direct callers */
+/*	the parser itself uses the span callbacks wherever they are set */
+static int
+buf_autolink(struct buf *ob, struct buf *link, enum mkd_autolink type,
+						void *opaque) {
+	if (!link) return 0;
+	return rndr_autolink(ob, link->data, link->size, type, opaque); }
+
+static int
+buf_codespan(struct buf *ob, struct buf *text, void *opaque) {
+	return text ? rndr_codespan(ob, text->data, text->size, opaque)
+		: rndr_codespan(ob, 0, 0, opaque); }
+
+static void
+buf_normal_text(struct buf *ob, struct buf *text, void *opaque) {
+	if (text) rndr_normal_text(ob, text->data, text->size, opaque); }
+
+static void
+buf_raw_block(struct buf *ob, struct buf *text, void *opaque) {
+	if (text) rndr_raw_block(ob, text->data, text->size, opaque); }
+
+static int
+buf_raw_inline(struct buf *ob, struct buf *text, void *opaque) {
+	return rndr_raw_inline(ob, text->data, text->size, opaque); }
+
+
+/* span callbacks shared by every renderer */
+static const struct mkd_span_renderer rndr_spans = {
+	rndr_raw_block,
+
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+
+	rndr_autolink,
+	rndr_codespan,
+	rndr_raw_inline,
+
+	NULL,
+	rndr_normal_text };
+
+
 /* exported renderer structure */
-const struct mkd_renderer mkd_html = {
+RENDERER(mkd_html) = {
 	NULL,
 	NULL,
 
 	rndr_blockcode,
 	rndr_blockquote,
-	rndr_raw_block,
+	buf_raw_block,
 	rndr_header,
 	html_hrule,
 	rndr_list,
@@ -244,22 +361,23 @@ const struct mkd_renderer mkd_html = {
 	NULL,
 	NULL,
 
-	rndr_autolink,
-	rndr_codespan,
+	buf_autolink,
+	buf_codespan,
 	rndr_double_emphasis,
 	rndr_emphasis,
 	html_image,
 	html_linebreak,
 	rndr_link,
-	rndr_raw_inline,
+	buf_raw_inline,
 	rndr_triple_emphasis,
 
 	NULL,
-	rndr_normal_text,
+	buf_normal_text,
 
 	64,
 	"*_",
-	NULL };
+	NULL,
+	&rndr_spans };
 
 
 
@@ -294,13 +412,13 @@ xhtml_linebreak(struct buf *ob, void *opaque) {
 
 
 /* exported renderer structure */
-const struct mkd_renderer mkd_xhtml = {
+RENDERER(mkd_xhtml) = {
 	NULL,
 	NULL,
 
 	rndr_blockcode,
 	rndr_blockquote,
-	rndr_raw_block,
+	buf_raw_block,
 	rndr_header,
 	xhtml_hrule,
 	rndr_list,
@@ -310,22 +428,23 @@ const struct mkd_renderer mkd_xhtml = {
 	NULL,
 	NULL,
 
-	rndr_autolink,
-	rndr_codespan,
+	buf_autolink,
+	buf_codespan,
 	rndr_double_emphasis,
 	rndr_emphasis,
 	xhtml_image,
 	xhtml_linebreak,
 	rndr_link,
-	rndr_raw_inline,
+	buf_raw_inline,
 	rndr_triple_emphasis,
 
 	NULL,
-	rndr_normal_text,
+	buf_normal_text,
 
 	64,
 	"*_",
-	NULL };
+	NULL,
+	&rndr_spans };
 
 
 
@@ -443,29 +562,30 @@ discount_blockquote(struct buf *ob, struct buf *text, void *opaque) {
 	BUFPUTSL(ob, "</div>\n"); }
 
 static void
-discount_table(struct buf *ob, struct buf *head_row, struct buf *rows,
-					void *opaque) {
+discount_table_begin(struct buf *ob, int flags, void *opaque) {
 	if (ob->size) bufputc(ob, '\n');
 	BUFPUTSL(ob, "<table>\n");
-	if (head_row) {
-		BUFPUTSL(ob, "<thead>\n");
-		bufput(ob, head_row->data, head_row->size);
-		BUFPUTSL(ob, "</thead>\n<tbody>\n"); }
-	if (rows)
-		bufput(ob, rows->data, rows->size);
-	if (head_row)
+	if (flags & MKD_CELL_HEAD)
+		BUFPUTSL(ob, "<thead>\n"); }
+
+static void
+discount_table_end(struct buf *ob, int flags, void *opaque) {
+	if (flags & MKD_CELL_HEAD)
 		BUFPUTSL(ob, "</tbody>\n");
 	BUFPUTSL(ob, "</table>\n"); }
 
 static void
-discount_table_row(struct buf *ob, struct buf *cells, int flags, void *opaque){
-	(void)flags;
-	BUFPUTSL(ob, "  <tr>\n");
-	if (cells) bufput(ob, cells->data, cells->size);
-	BUFPUTSL(ob, "  </tr>\n"); }
+discount_row_begin(struct buf *ob, int flags, void *opaque) {
+	BUFPUTSL(ob, "  <tr>\n"); }
 
 static void
-discount_table_cell(struct buf *ob, struct buf *text, int flags, void *opaque){
+discount_row_end(struct buf *ob, int flags, void *opaque) {
+	BUFPUTSL(ob, "  </tr>\n");
+	if (flags & MKD_CELL_HEAD)
+		BUFPUTSL(ob, "</thead>\n<tbody>\n"); }
+
+static void
+discount_cell_begin(struct buf *ob, int flags, void *opaque) {
 	if (flags & MKD_CELL_HEAD)
 		BUFPUTSL(ob, "    <th");
 	else
@@ -480,21 +600,65 @@ discount_table_cell(struct buf *ob, struct buf *text, int flags, void *opaque){
 		case MKD_CELL_ALIGN_CENTER:
 			BUFPUTSL(ob, " align=\"center\"");
 			break; }
-	bufputc(ob, '>');
-	if (text) bufput(ob, text->data, text->size);
+	bufputc(ob, '>'); }
+
+static void
+discount_cell_end(struct buf *ob, int flags, void *opaque) {
 	if (flags & MKD_CELL_HEAD)
 		BUFPUTSL(ob, "</th>\n");
 	else
 		BUFPUTSL(ob, "</td>\n"); }
 
+/* buffered table callbacks, over the streamed ones for direct callers */
+static void
+discount_table(struct buf *ob, struct buf *head_row, struct buf *rows,
+					void *opaque) {
+	int flags = head_row ? MKD_CELL_HEAD : 0;
+	discount_table_begin(ob, flags, opaque);
+	if (head_row) {
+		bufput(ob, head_row->data, head_row->size);
+		BUFPUTSL(ob, "</thead>\n<tbody>\n"); }
+	if (rows) bufput(ob, rows->data, rows->size);
+	discount_table_end(ob, flags, opaque); }
+
+static void
+discount_table_row(struct buf *ob, struct buf *cells, int flags, void *opaque){
+	discount_row_begin(ob, flags, opaque);
+	if (cells) bufput(ob, cells->data, cells->size);
+	discount_row_end(ob, flags & ~MKD_CELL_HEAD, opaque); }
+
+static void
+discount_table_cell(struct buf *ob, struct buf *text, int flags, void *opaque){
+	discount_cell_begin(ob, flags, opaque);
+	if (text) bufput(ob, text->data, text->size);
+	discount_cell_end(ob, flags, opaque); }
+
+/* span callbacks, with tables written straight into the output */
+static const struct mkd_span_renderer discount_spans = {
+	rndr_raw_block,
+
+	discount_table_begin,
+	discount_table_end,
+	discount_row_begin,
+	discount_row_end,
+	discount_cell_begin,
+	discount_cell_end,
+
+	rndr_autolink,
+	rndr_codespan,
+	rndr_raw_inline,
+
+	NULL,
+	rndr_normal_text };
+
 /* exported renderer structures */
-const struct mkd_renderer discount_html = {
+RENDERER(discount_html) = {
 	NULL,
 	NULL,
 
 	rndr_blockcode,
 	discount_blockquote,
-	rndr_raw_block,
+	buf_raw_block,
 	rndr_header,
 	html_hrule,
 	rndr_list,
@@ -504,29 +668,30 @@ const struct mkd_renderer discount_html = {
 	discount_table_cell,
 	discount_table_row,
 
-	rndr_autolink,
-	rndr_codespan,
+	buf_autolink,
+	buf_codespan,
 	rndr_double_emphasis,
 	rndr_emphasis,
 	html_discount_image,
 	html_linebreak,
 	discount_link,
-	rndr_raw_inline,
+	buf_raw_inline,
 	rndr_triple_emphasis,
 
 	NULL,
-	rndr_normal_text,
+	buf_normal_text,
 
 	64,
 	"*_",
-	NULL };
-const struct mkd_renderer discount_xhtml = {
+	NULL,
+	&discount_spans };
+RENDERER(discount_xhtml) = {
 	NULL,
 	NULL,
 
 	rndr_blockcode,
 	discount_blockquote,
-	rndr_raw_block,
+	buf_raw_block,
 	rndr_header,
 	xhtml_hrule,
 	rndr_list,
@@ -536,22 +701,23 @@ const struct mkd_renderer discount_xhtml = {
 	discount_table_cell,
 	discount_table_row,
 
-	rndr_autolink,
-	rndr_codespan,
+	buf_autolink,
+	buf_codespan,
 	rndr_double_emphasis,
 	rndr_emphasis,
 	xhtml_discount_image,
 	xhtml_linebreak,
 	discount_link,
-	rndr_raw_inline,
+	buf_raw_inline,
 	rndr_triple_emphasis,
 
 	NULL,
-	rndr_normal_text,
+	buf_normal_text,
 
 	64,
 	"*_",
-	NULL };
+	NULL,
+	&discount_spans };
 
 
 /****************************
@@ -560,9 +726,13 @@ const struct mkd_renderer discount_xhtml = {
 
 static void
 nat_span(struct buf *ob, struct buf *text, char *tag) {
-	bufprintf(ob, "<%s>", tag);
+	bufputc(ob, '<');
+	bufputs(ob, tag);
+	bufputc(ob, '>');
 	bufput(ob, text->data, text->size);
-	bufprintf(ob, "</%s>", tag); }
+	BUFPUTSL(ob, "</");
+	bufputs(ob, tag);
+	bufputc(ob, '>'); }
 
 static int
 nat_emphasis(struct buf *ob, struct buf *text, char c, void *opaque) {
@@ -597,15 +767,20 @@ nat_header(struct buf *ob, struct buf *text, int level, void *opaque) {
 			 || (text->data[i] >= 'A' && text->data[i] <= 'Z')
 			 || (text->data[i] >= '0' && text->data[i] <= '9')))
 		i += 1;
-	bufprintf(ob, "<h%d", level);
+	BUFPUTSL(ob, "<h");
+	bufputi(ob, level);
 	if (i < text->size && text->data[i] == '#') {
-		bufprintf(ob, " id=\"%.*s\">", (int)i, text->data);
+		BUFPUTSL(ob, " id=\"");
+		bufput(ob, text->data, i);
+		BUFPUTSL(ob, "\">");
 		i += 1; }
 	else {
 		bufputc(ob, '>');
 		i = 0; }
 	bufput(ob, text->data + i, text->size - i);
-	bufprintf(ob, "</h%d>\n", level); }
+	BUFPUTSL(ob, "</h");
+	bufputi(ob, level);
+	BUFPUTSL(ob, ">\n"); }
 
 static void
 nat_paragraph(struct buf *ob, struct buf *text, void *opaque) {
@@ -622,8 +797,9 @@ nat_paragraph(struct buf *ob, struct buf *text, void *opaque) {
 			 || (text->data[i] >= '0' && text->data[i] <= '9')))
 			i += 1;
 		if (i < text->size && text->data[i] == ')') {
-			bufprintf(ob, " class=\"%.*s\"",
-						(int)(i - 1), text->data + 1);
+			BUFPUTSL(ob, " class=\"");
+			bufput(ob, text->data + 1, i - 1);
+			bufputc(ob, '"');
 			i += 1; }
 		else i = 0; }
 	bufputc(ob, '>');
@@ -632,13 +808,13 @@ nat_paragraph(struct buf *ob, struct buf *text, void *opaque) {
 
 
 /* exported renderer structures */
-const struct mkd_renderer nat_html = {
+RENDERER(nat_html) = {
 	NULL,
 	NULL,
 
 	rndr_blockcode,
 	discount_blockquote,
-	rndr_raw_block,
+	buf_raw_block,
 	nat_header,
 	html_hrule,
 	rndr_list,
@@ -648,29 +824,30 @@ const struct mkd_renderer nat_html = {
 	NULL,
 	NULL,
 
-	rndr_autolink,
-	rndr_codespan,
+	buf_autolink,
+	buf_codespan,
 	nat_double_emphasis,
 	nat_emphasis,
 	html_discount_image,
 	html_linebreak,
 	discount_link,
-	rndr_raw_inline,
+	buf_raw_inline,
 	nat_triple_emphasis,
 
 	NULL,
-	rndr_normal_text,
+	buf_normal_text,
 
 	64,
 	"*_-+|",
-	NULL };
-const struct mkd_renderer nat_xhtml = {
+	NULL,
+	&rndr_spans };
+RENDERER(nat_xhtml) = {
 	NULL,
 	NULL,
 
 	rndr_blockcode,
 	discount_blockquote,
-	rndr_raw_block,
+	buf_raw_block,
 	nat_header,
 	xhtml_hrule,
 	rndr_list,
@@ -680,19 +857,20 @@ const struct mkd_renderer nat_xhtml = {
 	NULL,
 	NULL,
 
-	rndr_autolink,
-	rndr_codespan,
+	buf_autolink,
+	buf_codespan,
 	nat_double_emphasis,
 	nat_emphasis,
 	xhtml_discount_image,
 	xhtml_linebreak,
 	discount_link,
-	rndr_raw_inline,
+	buf_raw_inline,
 	nat_triple_emphasis,
 
 	NULL,
-	rndr_normal_text,
+	buf_normal_text,
 
 	64,
 	"*_-+|",
-	NULL };
+	NULL,
+	&rndr_spans };
@@ -0,0 +1,175 @@
+/* scan.c - vectorized search of a small set of bytes */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "scan.h"
+
+#if defined(SCAN_VECTOR) && defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_WIDTH 32
+#elif defined(SCAN_VECTOR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_WIDTH 16
+#elif defined(SCAN_VECTOR)
+#include <arm_neon.h>
+#define SCAN_WIDTH 16
+#endif
+
+
+/***************************
+ * STATIC HELPER FUNCTIONS *
+ ***************************/
+
+/* scan_bytes • portable search, used for short inputs and tails */
+static size_t
+scan_bytes(const struct scan_set *set, const char *data, size_t size) {
+	size_t i;
+	int k;
+	for (i = 0; i < size; i += 1)
+		for (k = 0; k < set->nb; k += 1)
+			if ((unsigned char)data[i] == set->byte[k])
+				return i;
+	return size; }
+
+
+#ifdef SCAN_VECTOR
+
+/* first_bit • index of the lowest bit set in a non-zero mask */
+static int
+first_bit(unsigned mask) {
+#ifdef __GNUC__
+	return __builtin_ctz(mask);
+#else
+	int i = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		i += 1; }
+	return i;
+#endif
+}
+
+
+#if defined(__AVX2__)
+
+/* match_mask • bit mask of the bytes of the block belonging to the set */
+static unsigned
+match_mask(const __m256i *needle, int nb, const char *data) {
+	__m256i block = _mm256_loadu_si256((const __m256i *)data);
+	__m256i hit = _mm256_cmpeq_epi8(block, needle[0]);
+	int k;
+	for (k = 1; k < nb; k += 1)
+		hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(block, needle[k]));
+	return (unsigned)_mm256_movemask_epi8(hit); }
+
+#define NEEDLE_TYPE __m256i
+#define NEEDLE_SET(c) _mm256_set1_epi8((char)(c))
+
+#elif defined(__SSE2__)
+
+/* match_mask • bit mask of the bytes of the block belonging to the set */
+static unsigned
+match_mask(const __m128i *needle, int nb, const char *data) {
+	__m128i block = _mm_loadu_si128((const __m128i *)data);
+	__m128i hit = _mm_cmpeq_epi8(block, needle[0]);
+	int k;
+	for (k = 1; k < nb; k += 1)
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, needle[k]));
+	return (unsigned)_mm_movemask_epi8(hit); }
+
+#define NEEDLE_TYPE __m128i
+#define NEEDLE_SET(c) _mm_set1_epi8((char)(c))
+
+#else
+
+/* match_mask • bit mask of the bytes of the block belonging to the set */
+static unsigned
+match_mask(const uint8x16_t *needle, int nb, const char *data) {
+	static const uint8_t weight[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+					1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t block = vld1q_u8((const uint8_t *)data);
+	uint8x16_t hit = vceqq_u8(block, needle[0]);
+	int k;
+	for (k = 1; k < nb; k += 1)
+		hit = vorrq_u8(hit, vceqq_u8(block, needle[k]));
+	if (vmaxvq_u8(hit) == 0) return 0;
+	hit = vandq_u8(hit, vld1q_u8(weight));
+	return vaddv_u8(vget_low_u8(hit))
+	    | ((unsigned)vaddv_u8(vget_high_u8(hit)) << 8); }
+
+#define NEEDLE_TYPE uint8x16_t
+#define NEEDLE_SET(c) vdupq_n_u8(c)
+
+#endif
+#endif /* def SCAN_VECTOR */
+
+
+
+/******************
+ * SCAN FUNCTIONS *
+ ******************/
+
+/* scan_find • returns the offset of the first byte in the set, or size */
+size_t
+scan_find(const struct scan_set *set, const char *data, size_t size) {
+#ifdef SCAN_VECTOR
+	NEEDLE_TYPE needle[SCAN_SET_MAX];
+	size_t i = 0, last;
+	unsigned mask;
+	int k;
+
+	if (set->nb <= 0) return size;
+	if (size < SCAN_WIDTH) return scan_bytes(set, data, size);
+	for (k = 0; k < set->nb; k += 1)
+		needle[k] = NEEDLE_SET(set->byte[k]);
+
+	/* whole blocks */
+	while (i + SCAN_WIDTH <= size) {
+		mask = match_mask(needle, set->nb, data + i);
+		if (mask) return i + first_bit(mask);
+		i += SCAN_WIDTH; }
+
+	/* overlapping last block, ignoring the bytes already checked */
+	if (i < size) {
+		last = size - SCAN_WIDTH;
+		mask = match_mask(needle, set->nb, data + last);
+		mask &= ~0u << (i - last);
+		if (mask) return last + first_bit(mask); }
+	return size;
+#else
+	return scan_bytes(set, data, size);
+#endif
+}
+
+
+/* scan_set_add • adds a byte to the set, returns 0 if the set is full */
+int
+scan_set_add(struct scan_set *set, char c) {
+	int k;
+	for (k = 0; k < set->nb; k += 1)
+		if (set->byte[k] == (unsigned char)c) return 1;
+	if (set->nb >= SCAN_SET_MAX) return 0;
+	set->byte[set->nb] = (unsigned char)c;
+	set->nb += 1;
+	return 1; }
+
+
+/* scan_set_init • initialization of an empty set */
+void
+scan_set_init(struct scan_set *set) {
+	set->nb = 0; }
+
+/* vim: set filetype=c: */
@@ -0,0 +1,72 @@
+/* scan.h - vectorized search of a small set of bytes */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LITHIUM_SCAN_H
+#define LITHIUM_SCAN_H
+
+#include <stddef.h>
+
+
+/*
+ * COMPILE TIME OPTIONS
+ *
+ * SCAN_VECTOR • defined when scan_find() uses SIMD instructions (SSE2,
+ *	AVX2 or AArch64 NEON), otherwise a portable byte loop is used and
+ *	callers with a lookup table of their own may prefer it
+ * SCAN_NO_VECTOR • if defined, forces the portable implementation
+ */
+
+#if !defined(SCAN_NO_VECTOR) && (defined(__SSE2__) \
+		|| (defined(__ARM_NEON) && defined(__aarch64__)))
+#define SCAN_VECTOR
+#endif
+
+#define SCAN_SET_MAX 16	/* maximum number of bytes in a set */
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* struct scan_set • set of bytes looked for in a single pass */
+struct scan_set {
+	int		nb;			/* number of bytes in the set */
+	unsigned char	byte[SCAN_SET_MAX]; };	/* bytes of the set */
+
+
+
+/******************
+ * SCAN FUNCTIONS *
+ ******************/
+
+/* scan_find • returns the offset of the first byte in the set, or size */
+size_t
+scan_find(const struct scan_set *, const char *data, size_t size);
+
+/* scan_set_add • adds a byte to the set, returns 0 if the set is full */
+int
+scan_set_add(struct scan_set *, char);
+
+/* scan_set_init • initialization of an empty set */
+void
+scan_set_init(struct scan_set *);
+
+
+#endif /* ndef LITHIUM_SCAN_H */
+
+/* vim: set filetype=c: */
@@ -0,0 +1,49 @@
+/* special.h - template of a parser specialized for a built-in renderer */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A special_*.c file defines MKD_SPECIAL to the name of a renderer of
+ * renderers.c, then includes this file. renderers.c and markdown.c are
+ * compiled again in it, with the renderer structure kept as a local
+ * constant and MAKE() and SPAN() reading it instead of the render, so that
+ * its callbacks are called directly and the tests of missing callbacks are
+ * resolved at compile time. The parser is reached from context_render,
+ * through the special field of the compiled renderer.
+ */
+
+#ifndef MKD_NO_SPECIAL
+
+#define SPECIAL_CAT(a, b) a##b
+#define SPECIAL_NAME(pre, name) SPECIAL_CAT(pre, name)
+
+#define MAKE(rndr) (&SPECIAL_NAME(local_, MKD_SPECIAL))
+#define SPAN(rndr) (SPECIAL_NAME(local_, MKD_SPECIAL).spans)
+#define MKD_SPECIAL_RENDER SPECIAL_NAME(special_, MKD_SPECIAL)
+
+/* the other renderers and the generic helpers are left unused */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-const-variable"
+#endif
+
+#include "renderers.c"
+#include "markdown.c"
+
+#endif /* ndef MKD_NO_SPECIAL */
+
+/* vim: set filetype=c: */
@@ -0,0 +1,88 @@
+/* document.c - incremental documents checked against markdown() */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Each case renders a first version of a document, then an edited one,
+ * with every built-in renderer. The second rendering reuses the blocks
+ * the edit left untouched, and must still give the output of markdown()
+ * on the edited text. The exit status is non-zero when one does not.
+ */
+
+#include "markdown.h"
+#include "renderers.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+/* edit • two successive versions of a document */
+struct edit {
+	const char *	name;
+	const char *	before;
+	const char *	after; };
+
+static const struct edit edits[] = {
+	{ "comment end read past its line",
+		"<!-- a\n\nb\n\nc -->d\n",
+		"<!-- a\n\nb\n\nc -->\nd\n" },
+	{ "hr end read past its line",
+		"<hr a\n\nb\n\nc >d\n",
+		"<hr a\n\nb\n\nc >\nd\n" },
+	{ NULL, NULL, NULL } };
+
+static const struct mkd_renderer *const renderers[] = {
+	&mkd_html, &discount_html, &nat_html, NULL };
+
+
+/* check • renders an edit with rndr, returns whether it matches */
+static int
+check(const struct edit *e, const struct mkd_renderer *rndr) {
+	struct mkd_document *doc = mkd_document_new(rndr);
+	struct buf *ib = bufnew(64), *ob = bufnew(64), *ref = bufnew(64);
+	int ret;
+
+	bufputs(ib, e->before);
+	mkd_document_render(doc, ob, ib);
+	ib->size = 0;
+	ob->size = 0;
+	bufputs(ib, e->after);
+	mkd_document_render(doc, ob, ib);
+	markdown(ref, ib, rndr);
+	ret = ob->size == ref->size && !memcmp(ob->data, ref->data, ob->size);
+
+	mkd_document_free(doc);
+	bufrelease(ib);
+	bufrelease(ob);
+	bufrelease(ref);
+	return ret; }
+
+
+/* main • runs every case */
+int
+main(void) {
+	const struct edit *e;
+	int i, ret = 0;
+
+	for (e = edits; e->name; e += 1)
+		for (i = 0; renderers[i]; i += 1)
+			if (!check(e, renderers[i])) {
+				printf("%s: renderer %d differs\n", e->name, i);
+				ret = 1; }
+	return ret; }
+
+/* vim: set filetype=c: */
@@ -0,0 +1,188 @@
+/* renderers.c - struct buf callbacks of the built-in renderers */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The parser uses the span callbacks of the built-in renderers, so their
+ * struct buf counterparts are only reached by callers using them directly
+ * or by copies whose spans are cleared. Each one is called here on sample
+ * text, and a document is rendered without the span callbacks, which must
+ * give the same output. The exit status is non-zero when one does not.
+ */
+
+#include "markdown.h"
+#include "renderers.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+/* named • a built-in renderer, and whether it renders tables */
+struct named {
+	const char *			name;
+	const struct mkd_renderer *	rndr;
+	int				tables; };
+
+static const struct named renderers[] = {
+	{ "mkd_html", &mkd_html, 0 },
+	{ "mkd_xhtml", &mkd_xhtml, 0 },
+	{ "discount_html", &discount_html, 1 },
+	{ "discount_xhtml", &discount_xhtml, 1 },
+	{ "nat_html", &nat_html, 0 },
+	{ "nat_xhtml", &nat_xhtml, 0 },
+	{ NULL, NULL, 0 } };
+
+static const char document[] =
+	"Some *text* with a&b, &amp; and `a<b` in it,\n"
+	"a <span class=\"x\">tag</span> and <http://example.com/?a&b>.\n"
+	"\n"
+	"<div>\n"
+	"raw <b>block</b>\n"
+	"</div>\n"
+	"\n"
+	"| a | b |\n"
+	"|:--|--:|\n"
+	"| 1 | *2* |\n"
+	"| `3` | 4 |\n"
+	"\n"
+	"a | b\n"
+	"--|--\n"
+	"c | d\n";
+
+
+/* same • checks that ob holds expect, reports it otherwise */
+static int
+same(const char *rname, const char *slot, struct buf *ob,
+					const char *expect) {
+	size_t len = strlen(expect);
+
+	if (ob->size == len && !memcmp(ob->data, expect, len)) {
+		ob->size = 0;
+		return 1; }
+	printf("%s: %s gives \"%.*s\", not \"%s\"\n",
+			rname, slot, (int)ob->size, ob->data, expect);
+	ob->size = 0;
+	return 0; }
+
+
+/* check_slots • calls each struct buf callback of a renderer directly */
+static int
+check_slots(const struct named *n) {
+	const struct mkd_renderer *r = n->rndr;
+	struct buf *ob = bufnew(64), *a = bufnew(64), *b = bufnew(64);
+	int ret = 1;
+
+	if (!r->normal_text || !r->codespan || !r->autolink
+	|| !r->raw_html_tag || !r->blockhtml
+	|| (n->tables && (!r->table || !r->table_row || !r->table_cell))) {
+		printf("%s: a struct buf callback is NULL\n", n->name);
+		ret = 0;
+		goto out; }
+
+	bufputs(a, "a<b & \"c\"");
+	r->normal_text(ob, a, r->opaque);
+	ret &= same(n->name, "normal_text", ob, "a&lt;b &amp; \"c\"");
+	r->normal_text(ob, 0, r->opaque);
+	ret &= same(n->name, "normal_text(NULL)", ob, "");
+
+	a->size = 0;
+	bufputs(a, "x<y");
+	ret &= r->codespan(ob, a, r->opaque);
+	ret &= same(n->name, "codespan", ob, "<code>x&lt;y</code>");
+	ret &= r->codespan(ob, 0, r->opaque);
+	ret &= same(n->name, "codespan(NULL)", ob, "<code></code>");
+
+	a->size = 0;
+	bufputs(a, "http://x/?a&b");
+	ret &= r->autolink(ob, a, MKDA_NORMAL, r->opaque);
+	ret &= same(n->name, "autolink", ob,
+			"<a href=\"http://x/?a&amp;b\">http://x/?a&amp;b</a>");
+	ret &= !r->autolink(ob, 0, MKDA_NORMAL, r->opaque);
+	ret &= same(n->name, "autolink(NULL)", ob, "");
+
+	a->size = 0;
+	bufputs(a, "<span a=\"b\">");
+	ret &= r->raw_html_tag(ob, a, r->opaque);
+	ret &= same(n->name, "raw_html_tag", ob, "<span a=\"b\">");
+
+	a->size = 0;
+	bufputs(a, "\n\n<div>\nx\n</div>\n\n");
+	r->blockhtml(ob, a, r->opaque);
+	ret &= same(n->name, "blockhtml", ob, "<div>\nx\n</div>\n");
+	r->blockhtml(ob, 0, r->opaque);
+	ret &= same(n->name, "blockhtml(NULL)", ob, "");
+
+	if (!n->tables) goto out;
+	a->size = 0;
+	bufputs(a, "h");
+	r->table_cell(ob, a, MKD_CELL_HEAD | MKD_CELL_ALIGN_LEFT, r->opaque);
+	ret &= same(n->name, "table_cell", ob,
+			"    <th align=\"left\">h</th>\n");
+	r->table_cell(ob, a, MKD_CELL_ALIGN_CENTER, r->opaque);
+	ret &= same(n->name, "table_cell", ob,
+			"    <td align=\"center\">h</td>\n");
+	r->table_row(ob, a, MKD_CELL_HEAD, r->opaque);
+	ret &= same(n->name, "table_row", ob, "  <tr>\nh  </tr>\n");
+	bufputs(b, "r");
+	r->table(ob, a, b, r->opaque);
+	ret &= same(n->name, "table", ob, "<table>\n<thead>\nh</thead>\n"
+			"<tbody>\nr</tbody>\n</table>\n");
+	r->table(ob, 0, b, r->opaque);
+	ret &= same(n->name, "table(NULL)", ob,
+			"<table>\nr</table>\n");
+out:
+	bufrelease(ob);
+	bufrelease(a);
+	bufrelease(b);
+	return ret; }
+
+
+/* check_document • renders with and without the span callbacks */
+static int
+check_document(const struct named *n) {
+	struct mkd_renderer copy = *n->rndr;
+	struct buf *ib = bufnew(64), *ob = bufnew(64), *ref = bufnew(64);
+	int ret;
+
+	copy.spans = 0;
+	bufputs(ib, document);
+	markdown(ref, ib, n->rndr);
+	markdown(ob, ib, &copy);
+	ret = ob->size == ref->size && !memcmp(ob->data, ref->data, ob->size);
+	if (!ret)
+		printf("%s: rendering without spans differs:\n%.*s\n"
+			"instead of:\n%.*s\n", n->name,
+			(int)ob->size, ob->data, (int)ref->size, ref->data);
+
+	bufrelease(ib);
+	bufrelease(ob);
+	bufrelease(ref);
+	return ret; }
+
+
+/* main • runs every check */
+int
+main(void) {
+	const struct named *n;
+	int ret = 0;
+
+	for (n = renderers; n->name; n += 1) {
+		if (!check_slots(n)) ret = 1;
+		if (!check_document(n)) ret = 1; }
+	return ret; }
+
+/* vim: set filetype=c: */
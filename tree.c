@@ -0,0 +1,439 @@
+/* tree.c - flat document tree, for consumers without rendered output */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The tree is built by a renderer: instead of markup, each callback writes
+ * a single placeholder byte into its output buffer and records where it is.
+ * The placeholders found in the text given to a callback are the children
+ * of its node, and the bytes between them are copied verbatim by the parser
+ * (normal text, or constructs too deep for max_work_stack) and become text
+ * nodes. Work buffers thus only hold text and one byte per child node.
+ */
+
+#include "tree.h"
+
+#include "array.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TREE_UNIT 256	/* unit for the text of a tree and the output */
+#define GROWTH 50	/* geometric growth percentage of the buffers */
+
+#define HAS_CALLBACK(syn, f) ((syn)->f || ((syn)->spans && (syn)->spans->f))
+
+
+/***************
+ * LOCAL TYPES *
+ ***************/
+
+/* struct tree_mark • placeholder of a node written into an output buffer */
+struct tree_mark {
+	struct buf *	ob;
+	size_t		offset;
+	int		node; };
+
+
+/* struct tree_state • opaque data of the tree renderer */
+struct tree_state {
+	struct array	nodes;	/* struct mkd_node */
+	struct array	marks;	/* struct tree_mark, in output order */
+	struct buf *	text;
+	int		failed; };	/* whether an allocation failed */
+
+
+
+/***************************
+ * STATIC HELPER FUNCTIONS *
+ ***************************/
+
+/* new_item • appends an element to an array, returns its index or -1 */
+static int
+new_item(struct tree_state *st, struct array *arr) {
+	if (!arr_push(arr)) {
+		st->failed = 1;
+		return -1; }
+	return arr->size - 1; }
+
+
+/* node_new • appends a node without children, returns its index or -1 */
+static int
+node_new(struct tree_state *st, enum mkd_node_type type, int flags) {
+	struct mkd_node *node;
+	int n = new_item(st, &st->nodes);
+	if (n < 0) return -1;
+	node = arr_item(&st->nodes, n);
+	memset(node, 0, sizeof *node);
+	node->type = type;
+	node->flags = flags;
+	node->child = node->next = -1;
+	return n; }
+
+
+/* node_at • returns the node of the given index */
+static struct mkd_node *
+node_at(struct tree_state *st, int n) {
+	return arr_item(&st->nodes, n); }
+
+
+/* slice_put • copies data into the text of the tree */
+static void
+slice_put(struct tree_state *st, struct mkd_slice *slice,
+					const char *data, size_t size) {
+	slice->offset = st->text->size;
+	slice->size = size;
+	if (size) bufput(st->text, data, size); }
+
+
+/* node_text • prepends a text node to the list starting at next */
+static int
+node_text(struct tree_state *st, const char *data, size_t size, int next) {
+	int n;
+	if (!size || (n = node_new(st, MKDN_TEXT, 0)) < 0) return next;
+	slice_put(st, &node_at(st, n)->text, data, size);
+	node_at(st, n)->next = next;
+	return n; }
+
+
+/* children • turns the contents of a callback text into a list of nodes */
+/*	the list is put before next, and its head is returned */
+static int
+children(struct tree_state *st, const struct buf *text, int next) {
+	struct tree_mark *mark;
+	size_t end;
+
+	if (!text) return next;
+	end = text->size;
+	while (st->marks.size > 0) {
+		mark = arr_item(&st->marks, st->marks.size - 1);
+		if (mark->ob != text || mark->offset >= end) break;
+		next = node_text(st, text->data + mark->offset + 1,
+					end - mark->offset - 1, next);
+		node_at(st, mark->node)->next = next;
+		next = mark->node;
+		end = mark->offset;
+		st->marks.size -= 1; }
+	return node_text(st, text->data, end, next); }
+
+
+/* emit • writes the placeholder of a node into ob */
+static void
+emit(struct tree_state *st, struct buf *ob, int n) {
+	struct tree_mark *mark;
+	int i;
+	if (n < 0) return;
+	if ((i = new_item(st, &st->marks)) < 0) return;
+	mark = arr_item(&st->marks, i);
+	mark->ob = ob;
+	mark->offset = ob->size;
+	mark->node = n;
+	bufputc(ob, 0); }
+
+
+/* emit_parent • renders a node whose children are in text */
+static void
+emit_parent(struct tree_state *st, struct buf *ob, enum mkd_node_type type,
+					int flags, const struct buf *text) {
+	int n = node_new(st, type, flags), child = children(st, text, -1);
+	if (n < 0) return;
+	node_at(st, n)->child = child;
+	emit(st, ob, n); }
+
+
+/* emit_leaf • renders a node holding only text */
+static int
+emit_leaf(struct tree_state *st, struct buf *ob, enum mkd_node_type type,
+			int flags, const char *data, size_t size) {
+	int n = node_new(st, type, flags);
+	if (n < 0) return 1;
+	slice_put(st, &node_at(st, n)->text, data, size);
+	emit(st, ob, n);
+	return 1; }
+
+
+/* link_node • creates a link or an image node, returns its index or -1 */
+static int
+link_node(struct tree_state *st, enum mkd_node_type type,
+		const struct buf *link, const struct buf *title) {
+	struct mkd_slice slink, stitle;
+	int n;
+	slice_put(st, &slink, link ? link->data : 0, link ? link->size : 0);
+	slice_put(st, &stitle, title ? title->data : 0,
+						title ? title->size : 0);
+	if ((n = node_new(st, type, 0)) < 0) return -1;
+	node_at(st, n)->link = slink;
+	node_at(st, n)->title = stitle;
+	return n; }
+
+
+
+/***********************
+ * RENDERING CALLBACKS *
+ ***********************/
+
+/* blocks missing from the syntax renderer are dropped with their children */
+static void
+tree_skip(struct buf *ob, struct buf *text, void *opaque) {
+	children(opaque, text, -1); }
+
+static void
+tree_skip_flags(struct buf *ob, struct buf *text, int flags, void *opaque) {
+	children(opaque, text, -1); }
+
+static void
+tree_skip_header(struct buf *ob, struct buf *text, int level, void *opaque) {
+	children(opaque, text, -1); }
+
+static void
+tree_blockcode(struct buf *ob, struct buf *text, void *opaque) {
+	emit_leaf(opaque, ob, MKDN_BLOCKCODE, 0,
+				text ? text->data : 0, text ? text->size : 0); }
+
+static void
+tree_blockquote(struct buf *ob, struct buf *text, void *opaque) {
+	emit_parent(opaque, ob, MKDN_BLOCKQUOTE, 0, text); }
+
+static void
+tree_blockhtml(struct buf *ob, const char *text, size_t size, void *opaque) {
+	emit_leaf(opaque, ob, MKDN_BLOCKHTML, 0, text, size); }
+
+static void
+tree_header(struct buf *ob, struct buf *text, int level, void *opaque) {
+	emit_parent(opaque, ob, MKDN_HEADER, level, text); }
+
+static void
+tree_hrule(struct buf *ob, void *opaque) {
+	emit(opaque, ob, node_new(opaque, MKDN_HRULE, 0)); }
+
+static void
+tree_list(struct buf *ob, struct buf *text, int flags, void *opaque) {
+	emit_parent(opaque, ob, MKDN_LIST, flags, text); }
+
+static void
+tree_listitem(struct buf *ob, struct buf *text, int flags, void *opaque) {
+	emit_parent(opaque, ob, MKDN_LISTITEM, flags, text); }
+
+static void
+tree_paragraph(struct buf *ob, struct buf *text, void *opaque) {
+	emit_parent(opaque, ob, MKDN_PARAGRAPH, 0, text); }
+
+static void
+tree_table(struct buf *ob, struct buf *head_row, struct buf *rows,
+						void *opaque) {
+	struct tree_state *st = opaque;
+	int n = node_new(st, MKDN_TABLE, head_row ? MKD_CELL_HEAD : 0);
+	int child = children(st, head_row, children(st, rows, -1));
+	if (n < 0) return;
+	node_at(st, n)->child = child;
+	emit(st, ob, n); }
+
+static void
+tree_table_cell(struct buf *ob, struct buf *text, int flags, void *opaque) {
+	emit_parent(opaque, ob, MKDN_TABLE_CELL, flags, text); }
+
+static void
+tree_table_row(struct buf *ob, struct buf *cells, int flags, void *opaque) {
+	emit_parent(opaque, ob, MKDN_TABLE_ROW, flags, cells); }
+
+static int
+tree_autolink(struct buf *ob, const char *link, size_t size,
+				enum mkd_autolink type, void *opaque) {
+	struct tree_state *st = opaque;
+	int n = node_new(st, MKDN_AUTOLINK, type);
+	if (n < 0) return 1;
+	slice_put(st, &node_at(st, n)->link, link, size);
+	emit(st, ob, n);
+	return 1; }
+
+static int
+tree_codespan(struct buf *ob, const char *text, size_t size, void *opaque) {
+	return emit_leaf(opaque, ob, MKDN_CODESPAN, 0, text, size); }
+
+static int
+tree_double_emphasis(struct buf *ob, struct buf *text, char c, void *opaque){
+	emit_parent(opaque, ob, MKDN_DOUBLE_EMPHASIS, c, text);
+	return 1; }
+
+static int
+tree_emphasis(struct buf *ob, struct buf *text, char c, void *opaque) {
+	emit_parent(opaque, ob, MKDN_EMPHASIS, c, text);
+	return 1; }
+
+static int
+tree_image(struct buf *ob, struct buf *link, struct buf *title,
+					struct buf *alt, void *opaque) {
+	struct tree_state *st = opaque;
+	int n = link_node(st, MKDN_IMAGE, link, title);
+	if (n < 0) return 1;
+	slice_put(st, &node_at(st, n)->text, alt ? alt->data : 0,
+						alt ? alt->size : 0);
+	emit(st, ob, n);
+	return 1; }
+
+static int
+tree_linebreak(struct buf *ob, void *opaque) {
+	emit(opaque, ob, node_new(opaque, MKDN_LINEBREAK, 0));
+	return 1; }
+
+static int
+tree_link(struct buf *ob, struct buf *link, struct buf *title,
+				struct buf *content, void *opaque) {
+	struct tree_state *st = opaque;
+	int n = link_node(st, MKDN_LINK, link, title);
+	int child = children(st, content, -1);
+	if (n < 0) return 1;
+	node_at(st, n)->child = child;
+	emit(st, ob, n);
+	return 1; }
+
+static int
+tree_raw_html_tag(struct buf *ob, const char *tag, size_t size, void *opaque){
+	return emit_leaf(opaque, ob, MKDN_RAW_HTML_TAG, 0, tag, size); }
+
+static int
+tree_triple_emphasis(struct buf *ob, struct buf *text, char c, void *opaque){
+	emit_parent(opaque, ob, MKDN_TRIPLE_EMPHASIS, c, text);
+	return 1; }
+
+static void
+tree_entity(struct buf *ob, const char *entity, size_t size, void *opaque) {
+	emit_leaf(opaque, ob, MKDN_ENTITY, 0, entity, size); }
+
+
+/* tree_renderer • fills the callbacks matching the syntax renderer */
+static void
+tree_renderer(struct mkd_renderer *rndr, struct mkd_span_renderer *spans,
+		const struct mkd_renderer *syn, struct tree_state *st) {
+	memset(rndr, 0, sizeof *rndr);
+	memset(spans, 0, sizeof *spans);
+
+	/* NULL block callbacks skip their block, other ones change the parsing */
+	rndr->blockcode = syn->blockcode ? tree_blockcode : tree_skip;
+	rndr->blockquote = syn->blockquote ? tree_blockquote : tree_skip;
+	rndr->header = syn->header ? tree_header : tree_skip_header;
+	rndr->hrule = syn->hrule ? tree_hrule : 0;
+	rndr->list = syn->list ? tree_list : tree_skip_flags;
+	rndr->listitem = syn->listitem ? tree_listitem : tree_skip_flags;
+	rndr->paragraph = syn->paragraph ? tree_paragraph : tree_skip;
+	if (HAS_CALLBACK(syn, blockhtml)) spans->blockhtml = tree_blockhtml;
+	if ((syn->table && syn->table_row && syn->table_cell)
+	|| (syn->spans && syn->spans->table_begin && syn->spans->table_end
+	    && syn->spans->row_begin && syn->spans->row_end
+	    && syn->spans->cell_begin && syn->spans->cell_end)) {
+		rndr->table = tree_table;
+		rndr->table_row = tree_table_row;
+		rndr->table_cell = tree_table_cell; }
+
+	/* NULL span callbacks leave their span as text */
+	if (HAS_CALLBACK(syn, autolink)) spans->autolink = tree_autolink;
+	if (HAS_CALLBACK(syn, codespan)) spans->codespan = tree_codespan;
+	if (syn->double_emphasis) rndr->double_emphasis = tree_double_emphasis;
+	if (syn->emphasis) rndr->emphasis = tree_emphasis;
+	if (syn->image) rndr->image = tree_image;
+	if (syn->linebreak) rndr->linebreak = tree_linebreak;
+	if (syn->link) rndr->link = tree_link;
+	if (HAS_CALLBACK(syn, raw_html_tag))
+		spans->raw_html_tag = tree_raw_html_tag;
+	if (syn->triple_emphasis) rndr->triple_emphasis = tree_triple_emphasis;
+
+	/* entities are always nodes, normal text is copied by the parser */
+	spans->entity = tree_entity;
+
+	rndr->max_work_stack = syn->max_work_stack;
+	rndr->emph_chars = syn->emph_chars;
+	rndr->opaque = st;
+	rndr->spans = spans; }
+
+
+
+/**********************
+ * EXPORTED FUNCTIONS *
+ **********************/
+
+/* mkd_tree_free • releases a tree and its text */
+void
+mkd_tree_free(struct mkd_tree *tree) {
+	if (!tree) return;
+	free(tree->node);
+	bufrelease(tree->text);
+	free(tree); }
+
+
+/* mkd_tree_new • parses the input buffer into a new tree, or returns NULL */
+struct mkd_tree *
+mkd_tree_new(struct buf *ib, const struct mkd_renderer *syntax) {
+	struct mkd_renderer rndr;
+	struct mkd_span_renderer spans;
+	struct tree_state st;
+	struct mkd_tree *tree;
+	struct buf *ob;
+	int root;
+
+	if (!ib || !syntax || (tree = malloc(sizeof *tree)) == 0) return 0;
+	arr_init(&st.nodes, sizeof (struct mkd_node));
+	arr_init(&st.marks, sizeof (struct tree_mark));
+	st.text = bufnew(TREE_UNIT);
+	st.failed = 0;
+	ob = bufnew(TREE_UNIT);
+	bufsetgrowth(st.text, GROWTH, 0);
+	bufsetgrowth(ob, GROWTH, 0);
+
+	tree_renderer(&rndr, &spans, syntax, &st);
+	markdown(ob, ib, &rndr);
+	root = node_new(&st, MKDN_DOCUMENT, 0);
+	if (root >= 0) node_at(&st, root)->child = children(&st, ob, -1);
+	bufrelease(ob);
+	arr_free(&st.marks);
+
+	if (st.failed || !st.text) {
+		arr_free(&st.nodes);
+		bufrelease(st.text);
+		free(tree);
+		return 0; }
+	tree->node = st.nodes.base;
+	tree->size = st.nodes.size;
+	tree->root = root;
+	tree->text = st.text;
+	return tree; }
+
+
+/* mkd_tree_walk • calls fn on entering and leaving every node, in order */
+void
+mkd_tree_walk(const struct mkd_tree *tree, mkd_tree_event fn, void *opaque) {
+	struct array stack; /* parents of n */
+	int n, *parent;
+
+	if (!tree || !fn) return;
+	arr_init(&stack, sizeof (int));
+	n = tree->root;
+	while (n >= 0) {
+		fn(tree, n, 0, opaque);
+		if (tree->node[n].child >= 0
+		&& (parent = arr_push(&stack)) != 0) {
+			*parent = n;
+			n = tree->node[n].child;
+			continue; }
+		fn(tree, n, 1, opaque);
+		while (tree->node[n].next < 0 && stack.size > 0) {
+			n = *(int *)arr_item(&stack, stack.size - 1);
+			stack.size -= 1;
+			fn(tree, n, 1, opaque); }
+		n = tree->node[n].next; }
+	arr_free(&stack); }
+
+/* vim: set filetype=c: */
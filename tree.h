@@ -0,0 +1,109 @@
+/* tree.h - flat document tree, for consumers without rendered output */
+
+/*
+ * Copyright (c) 2009, Natacha Porté
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LITHIUM_TREE_H
+#define LITHIUM_TREE_H
+
+#include "markdown.h"
+
+
+/********************
+ * TYPE DEFINITIONS *
+ ********************/
+
+/* mkd_node_type • kind of a tree node, after the renderer callbacks */
+enum mkd_node_type {
+	MKDN_DOCUMENT,
+	MKDN_BLOCKCODE,		/* text is the code */
+	MKDN_BLOCKQUOTE,
+	MKDN_BLOCKHTML,		/* text is the HTML */
+	MKDN_HEADER,		/* flags is the level */
+	MKDN_HRULE,
+	MKDN_LIST,		/* flags as for mkd_renderer.list */
+	MKDN_LISTITEM,		/* flags as for mkd_renderer.listitem */
+	MKDN_PARAGRAPH,
+	MKDN_TABLE,		/* flags is MKD_CELL_HEAD with a head row */
+	MKDN_TABLE_ROW,		/* flags as for mkd_renderer.table_row */
+	MKDN_TABLE_CELL,	/* flags as for mkd_renderer.table_cell */
+	MKDN_AUTOLINK,		/* link, and flags is the enum mkd_autolink */
+	MKDN_CODESPAN,		/* text is the code */
+	MKDN_DOUBLE_EMPHASIS,	/* flags is the emphasis char */
+	MKDN_EMPHASIS,		/* flags is the emphasis char */
+	MKDN_IMAGE,		/* link, title, and text is the alt text */
+	MKDN_LINEBREAK,
+	MKDN_LINK,		/* link and title */
+	MKDN_RAW_HTML_TAG,	/* text is the tag */
+	MKDN_TRIPLE_EMPHASIS,	/* flags is the emphasis char */
+	MKDN_ENTITY,		/* text is the entity, with '&' and ';' */
+	MKDN_TEXT		/* text is the raw markdown text */
+};
+
+
+/* mkd_node • element of a tree, linked to its children by index */
+/*	slices are parts of mkd_tree.text */
+struct mkd_node {
+	enum mkd_node_type	type;
+	int			flags;
+	int			child;	/* first child, or -1 */
+	int			next;	/* next sibling, or -1 */
+	struct mkd_slice	text;
+	struct mkd_slice	link;
+	struct mkd_slice	title; };
+
+
+/* mkd_tree • parsed document, as a flat array of nodes */
+/*	children are created before their parent, so the root is the last */
+struct mkd_tree {
+	struct mkd_node *	node;
+	int			size;	/* number of nodes */
+	int			root;	/* index of the MKDN_DOCUMENT node */
+	struct buf *		text; };	/* contents of every slice */
+
+
+/* mkd_tree_event • called when entering and leaving a node */
+typedef void (*mkd_tree_event)(const struct mkd_tree *tree, int node,
+						int leave, void *opaque);
+
+
+
+/******************
+ * TREE FUNCTIONS *
+ ******************/
+
+/* mkd_tree_free • releases a tree and its text */
+void
+mkd_tree_free(struct mkd_tree *tree);
+
+/* mkd_tree_new • parses the input buffer into a new tree, or returns NULL */
+/*	syntax is the renderer whose parsing is reproduced: blocks without */
+/*	a callback are dropped, spans without one are left as text, and its */
+/*	emph_chars and max_work_stack apply; spans are never refused, even */
+/*	when the callbacks of syntax would return 0 for them */
+struct mkd_tree *
+mkd_tree_new(struct buf *ib, const struct mkd_renderer *syntax);
+
+/* mkd_tree_walk • calls fn on entering and leaving every node, in order */
+/*	each node is entered (leave = 0) before its children and left */
+/*	(leave = 1) after them, without recursion */
+void
+mkd_tree_walk(const struct mkd_tree *tree, mkd_tree_event fn, void *opaque);
+
+
+#endif /* ndef LITHIUM_TREE_H */
+
+/* vim: set filetype=c: */